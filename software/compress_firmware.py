@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+"""
+brickletboot
+Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+
+compress_firmware.py: Packs a firmware image for WRITE_FIRMWARE_COMPRESSED
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+General Public License for more details.
+
+You should have received a copy of the GNU General Public
+License along with this program; if not, write to the
+Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+Boston, MA 02111-1307, USA.
+"""
+
+# The stream format is described in src/firmware_lz.c.
+#
+# The output file is a sequence of chunks, one per WRITE_FIRMWARE_COMPRESSED
+# call: a length byte followed by up to CHUNK_SIZE bytes of stream. Chunks
+# only end on token boundaries and decompress to at most MAX_CHUNK_OUTPUT
+# bytes, so the bootloader never blocks for long on flash writes while
+# handling a single message.
+#
+# Start the transfer with SET_WRITE_FIRMWARE_POINTER(0) and send the chunks
+# in order.
+
+import argparse
+import sys
+
+PAGE_SIZE = 64
+CHUNK_SIZE = 64
+MAX_CHUNK_OUTPUT = 16 * PAGE_SIZE
+WINDOW_SIZE = 256
+MIN_MATCH = 3
+MAX_MATCH = 130
+MAX_LITERAL = 128
+
+def find_match(data, pos, chains):
+    best_length = 0
+    best_distance = 0
+    max_length = min(MAX_MATCH, len(data) - pos)
+
+    if max_length < MIN_MATCH:
+        return 0, 0
+
+    for candidate in reversed(chains.get(bytes(data[pos:pos + MIN_MATCH]), [])):
+        distance = pos - candidate
+
+        if distance > WINDOW_SIZE:
+            break
+
+        length = 0
+
+        while length < max_length and data[candidate + length] == data[pos + length]:
+            length += 1
+
+        if length > best_length:
+            best_length = length
+            best_distance = distance
+
+            if length == max_length:
+                break
+
+    if best_length < MIN_MATCH:
+        return 0, 0
+
+    return best_length, best_distance
+
+def tokenize(data):
+    tokens = [] # (stream bytes, decompressed length)
+    literals = bytearray()
+    chains = {}
+    pos = 0
+
+    def flush_literals():
+        if len(literals) > 0:
+            tokens.append((bytes([len(literals) - 1]) + bytes(literals), len(literals)))
+            literals.clear()
+
+    def add_to_chain(p):
+        key = bytes(data[p:p + MIN_MATCH])
+
+        if len(key) == MIN_MATCH:
+            chains.setdefault(key, []).append(p)
+
+    while pos < len(data):
+        length, distance = find_match(data, pos, chains)
+
+        if length > 0:
+            flush_literals()
+            tokens.append((bytes([0x80 | (length - MIN_MATCH), distance - 1]), length))
+
+            for p in range(pos, pos + length):
+                add_to_chain(p)
+
+            pos += length
+        else:
+            literals.append(data[pos])
+
+            if len(literals) == MAX_LITERAL:
+                flush_literals()
+
+            add_to_chain(pos)
+            pos += 1
+
+    flush_literals()
+
+    return tokens
+
+def compress(data):
+    chunks = []
+    chunk = bytearray()
+    chunk_output = 0
+
+    for stream, length in tokenize(data):
+        if len(chunk) + len(stream) > CHUNK_SIZE or chunk_output + length > MAX_CHUNK_OUTPUT:
+            chunks.append(bytes(chunk))
+            chunk = bytearray()
+            chunk_output = 0
+
+        chunk += stream
+        chunk_output += length
+
+    if len(chunk) > 0:
+        chunks.append(bytes(chunk))
+
+    return chunks
+
+def decompress(chunks):
+    out = bytearray()
+    stream = b''.join(chunks)
+    i = 0
+
+    while i < len(stream):
+        control = stream[i]
+
+        if control & 0x80:
+            length = (control & 0x7F) + MIN_MATCH
+            distance = stream[i + 1] + 1
+
+            for _ in range(length):
+                out.append(out[-distance])
+
+            i += 2
+        else:
+            out += stream[i + 1:i + 2 + control]
+            i += 2 + control
+
+    return bytes(out)
+
+def main():
+    parser = argparse.ArgumentParser(description='Packs a firmware image for WRITE_FIRMWARE_COMPRESSED')
+    parser.add_argument('input', help='firmware image (.bin)')
+    parser.add_argument('output', help='compressed chunks')
+    args = parser.parse_args()
+
+    with open(args.input, 'rb') as f:
+        data = bytearray(f.read())
+
+    # The bootloader only writes complete pages, erased flash is 0xFF
+    if len(data) % PAGE_SIZE != 0:
+        data += b'\xFF' * (PAGE_SIZE - len(data) % PAGE_SIZE)
+
+    chunks = compress(data)
+
+    if decompress(chunks) != data:
+        print('Error: Compressed stream does not match input')
+        sys.exit(1)
+
+    with open(args.output, 'wb') as f:
+        for chunk in chunks:
+            f.write(bytes([len(chunk)]) + chunk)
+
+    compressed_length = sum(map(len, chunks))
+    print('{0} bytes -> {1} bytes in {2} chunks ({3:.1f}%)'.format(len(data), compressed_length, len(chunks), 100.0 * compressed_length / len(data)))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,64 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * tinydma.h: tinydma replacement for the host simulation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef TINYDMA_H
+#define TINYDMA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sam.h"
+
+#define TINYDMA_SPITFP_RX_INDEX 0
+#define TINYDMA_SPITFP_TX_INDEX 1
+#define TINYDMA_CHANNEL_COUNT   2
+
+// Number of beats that are left in the block of the given channel. The
+// simulated DMAC updates the write-back descriptor after every beat.
+#define TINYDMA_CURRENT_BUFFER_COUNT_FOR_CHANNEL(channel) (tinydma_get_write_back_section()[(channel)].BTCNT.reg)
+
+typedef struct {
+	uint8_t peripheral_trigger;
+	uint8_t trigger_action;
+	uint8_t priority;
+} TinyDmaChannelConfig;
+
+typedef struct {
+	bool src_increment_enable;
+	bool dst_increment_enable;
+	uint8_t beat_size;
+	uint8_t block_action;
+	uint16_t block_transfer_count;
+	uint32_t source_address;
+	uint32_t destination_address;
+	uint32_t next_descriptor_address;
+} TinyDmaDescriptorConfig;
+
+DmacDescriptor *tinydma_get_descriptor_section(void);
+DmacDescriptor *tinydma_get_write_back_section(void);
+void tinydma_init(DmacDescriptor *descriptor_section, DmacDescriptor *write_back_section);
+void tinydma_get_channel_config_defaults(TinyDmaChannelConfig *config);
+void tinydma_channel_init(const uint8_t channel, TinyDmaChannelConfig *config);
+void tinydma_descriptor_get_config_defaults(TinyDmaDescriptorConfig *config);
+void tinydma_descriptor_init(DmacDescriptor *descriptor, TinyDmaDescriptorConfig *config);
+void tinydma_start_transfer(const uint8_t channel);
+
+#endif
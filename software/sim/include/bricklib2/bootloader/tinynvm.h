@@ -0,0 +1,31 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * tinynvm.h: tinynvm replacement for the host simulation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef TINYNVM_H
+#define TINYNVM_H
+
+#include <stdint.h>
+
+void tinynvm_init(void);
+void tinynvm_erase_row(const uint32_t address);
+void tinynvm_write_page(const uint32_t address, const uint8_t *data);
+
+#endif
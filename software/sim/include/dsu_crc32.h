@@ -0,0 +1,38 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * dsu_crc32.h: ASF DSU CRC32 driver replacement for the host simulation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef DSU_CRC32_H
+#define DSU_CRC32_H
+
+#include <stdint.h>
+
+#include "sam.h"
+
+enum status_code {
+	STATUS_OK               = 0x00,
+	STATUS_ERR_BAD_ADDRESS  = -0x14,
+	STATUS_ERR_INVALID_ARG  = -0x1D,
+};
+
+// Calculates the IEEE 802.3 CRC-32 of the simulated memory like the DSU does
+enum status_code dsu_crc32_cal(const uint32_t addr, const uint32_t len, uint32_t *pcrc32);
+
+#endif
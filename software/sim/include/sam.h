@@ -0,0 +1,352 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * sam.h: SAMD09 register model for the host simulation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// This header replaces the ASF/CMSIS sam.h for the host build. Only the
+// registers and bits that brickletboot uses are modelled. The register
+// names and layouts follow CMSIS, so the bootloader sources compile
+// unchanged. Registers with side effects (DMAC, NVMCTRL) are reached
+// through an access function, which lets the simulation carry out the
+// command that was written with the previous access (see sim.c).
+
+#ifndef SAM_H
+#define SAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define __I  volatile const
+#define __O  volatile
+#define __IO volatile
+
+// ---- Memory map ----
+
+#define FLASH_ADDR        0x00000000
+#define FLASH_SIZE        16384
+#define FLASH_PAGE_SIZE   64
+#define NVMCTRL_PAGE_SIZE 64
+#define NVMCTRL_ROW_PAGES 4
+#define NVMCTRL_USER      0x00804000
+
+// ---- DMAC ----
+
+typedef union {
+	struct {
+		uint16_t VALID:1;
+		uint16_t EVOSEL:2;
+		uint16_t BLOCKACT:2;
+		uint16_t :3;
+		uint16_t BEATSIZE:2;
+		uint16_t SRCINC:1;
+		uint16_t DSTINC:1;
+		uint16_t STEPSEL:1;
+		uint16_t STEPSIZE:3;
+	} bit;
+	uint16_t reg;
+} DMAC_BTCTRL_Type;
+
+typedef union { uint16_t reg; } DMAC_BTCNT_Type;
+typedef union { uint32_t reg; } DMAC_SRCADDR_Type;
+typedef union { uint32_t reg; } DMAC_DSTADDR_Type;
+typedef union { uint32_t reg; } DMAC_DESCADDR_Type;
+
+typedef struct {
+	__IO DMAC_BTCTRL_Type   BTCTRL;
+	__IO DMAC_BTCNT_Type    BTCNT;
+	__IO DMAC_SRCADDR_Type  SRCADDR;
+	__IO DMAC_DSTADDR_Type  DSTADDR;
+	__IO DMAC_DESCADDR_Type DESCADDR;
+} __attribute__((aligned(8))) DmacDescriptor;
+
+typedef union { uint32_t reg; } DMAC_Reg32_Type;
+typedef union { uint16_t reg; } DMAC_Reg16_Type;
+typedef union { uint8_t  reg; } DMAC_Reg8_Type;
+
+typedef struct {
+	__IO DMAC_Reg16_Type CTRL;
+	__IO DMAC_Reg16_Type CRCCTRL;
+	__IO DMAC_Reg32_Type CRCDATAIN;
+	__IO DMAC_Reg32_Type CRCCHKSUM;
+	__IO DMAC_Reg8_Type  CRCSTATUS;
+	__IO DMAC_Reg8_Type  CHID;
+	__IO DMAC_Reg8_Type  CHCTRLA;
+	__IO DMAC_Reg32_Type CHCTRLB;
+	__IO DMAC_Reg8_Type  CHINTENCLR;
+	__IO DMAC_Reg8_Type  CHINTENSET;
+	__IO DMAC_Reg8_Type  CHINTFLAG;
+	__IO DMAC_Reg32_Type BASEADDR;
+	__IO DMAC_Reg32_Type WRBADDR;
+} Dmac;
+
+#define DMAC_CTRL_CRCENABLE           (1 << 2)
+#define DMAC_CRCCTRL_CRCBEATSIZE_BYTE (0 << 0)
+#define DMAC_CRCCTRL_CRCPOLY_CRC16    (0 << 2)
+#define DMAC_CRCCTRL_CRCPOLY_CRC32    (1 << 2)
+#define DMAC_CRCCTRL_CRCPOLY_Msk      (3 << 2)
+#define DMAC_CRCCTRL_CRCSRC(value)    ((value) << 8)
+#define DMAC_CRCCTRL_CRCSRC_IO        (1 << 8)
+#define DMAC_CRCSTATUS_CRCBUSY        (1 << 0)
+#define DMAC_CRCSTATUS_CRCZERO        (1 << 1)
+#define DMAC_CHID_ID(value)           ((value) & 0x7)
+#define DMAC_CHINTFLAG_TCMPL          (1 << 1)
+#define DMAC_CHINTENSET_TCMPL         (1 << 1)
+#define DMAC_CHINTENCLR_TCMPL         (1 << 1)
+
+#define DMA_BEAT_SIZE_BYTE       0
+#define DMA_BLOCK_ACTION_NOACT   0
+#define DMA_BLOCK_ACTION_INT     1
+#define DMA_TRIGGER_ACTION_BEAT  2
+
+// ---- SERCOM SPI ----
+
+typedef union {
+	struct {
+		uint32_t SWRST:1;
+		uint32_t ENABLE:1;
+		uint32_t MODE:3;
+		uint32_t :27;
+	} bit;
+	uint32_t reg;
+} SERCOM_SPI_CTRLA_Type;
+
+typedef union {
+	struct {
+		uint8_t DRE:1;
+		uint8_t TXC:1;
+		uint8_t RXC:1;
+		uint8_t SSL:1;
+		uint8_t :3;
+		uint8_t ERROR:1;
+	} bit;
+	uint8_t reg;
+} SERCOM_SPI_INTFLAG_Type;
+
+typedef union {
+	struct {
+		uint32_t SWRST:1;
+		uint32_t ENABLE:1;
+		uint32_t CTRLB:1;
+		uint32_t :29;
+	} bit;
+	uint32_t reg;
+} SERCOM_SPI_SYNCBUSY_Type;
+
+typedef union { uint32_t reg; } SERCOM_SPI_Reg32_Type;
+typedef union { uint16_t reg; } SERCOM_SPI_Reg16_Type;
+typedef union { uint8_t  reg; } SERCOM_SPI_Reg8_Type;
+
+typedef struct {
+	__IO SERCOM_SPI_CTRLA_Type    CTRLA;
+	__IO SERCOM_SPI_Reg32_Type    CTRLB;
+	__IO SERCOM_SPI_Reg8_Type     BAUD;
+	__IO SERCOM_SPI_Reg8_Type     INTENCLR;
+	__IO SERCOM_SPI_Reg8_Type     INTENSET;
+	__IO SERCOM_SPI_INTFLAG_Type  INTFLAG;
+	__IO SERCOM_SPI_Reg16_Type    STATUS;
+	__IO SERCOM_SPI_SYNCBUSY_Type SYNCBUSY;
+	__IO SERCOM_SPI_Reg32_Type    DATA;
+} SercomSpi;
+
+typedef union {
+	SercomSpi SPI;
+} Sercom;
+
+#define SERCOM_SPI_INTFLAG_DRE   (1 << 0)
+#define SERCOM_SPI_INTFLAG_TXC   (1 << 1)
+#define SERCOM_SPI_INTFLAG_RXC   (1 << 2)
+#define SERCOM_SPI_INTFLAG_SSL   (1 << 3)
+#define SERCOM_SPI_INTFLAG_ERROR (1 << 7)
+#define SERCOM_SPI_INTENSET_TXC  (1 << 1)
+#define SERCOM_SPI_INTENCLR_TXC  (1 << 1)
+
+#define SERCOM0_DMAC_ID_RX 1
+#define SERCOM0_DMAC_ID_TX 2
+#define SERCOM1_DMAC_ID_RX 3
+#define SERCOM1_DMAC_ID_TX 4
+
+#define PINMUX_UNUSED               0xFFFFFFFF
+#define PINMUX_PA04D_SERCOM0_PAD0   ((4 << 16) | 3)
+#define PINMUX_PA05D_SERCOM0_PAD1   ((5 << 16) | 3)
+#define PINMUX_PA06D_SERCOM0_PAD2   ((6 << 16) | 3)
+#define PINMUX_PA07D_SERCOM0_PAD3   ((7 << 16) | 3)
+#define PINMUX_PA16C_SERCOM1_PAD2   ((16 << 16) | 2)
+
+// ---- NVMCTRL ----
+
+typedef union { uint32_t reg; } NVMCTRL_Reg32_Type;
+typedef union { uint16_t reg; } NVMCTRL_Reg16_Type;
+typedef union { uint8_t  reg; } NVMCTRL_Reg8_Type;
+
+typedef struct {
+	__IO NVMCTRL_Reg16_Type CTRLA;
+	__IO NVMCTRL_Reg32_Type CTRLB;
+	__IO NVMCTRL_Reg32_Type PARAM;
+	__IO NVMCTRL_Reg8_Type  INTENCLR;
+	__IO NVMCTRL_Reg8_Type  INTENSET;
+	__IO NVMCTRL_Reg8_Type  INTFLAG;
+	__IO NVMCTRL_Reg16_Type STATUS;
+	__IO NVMCTRL_Reg32_Type ADDR;
+	__IO NVMCTRL_Reg16_Type LOCK;
+} Nvmctrl;
+
+#define NVMCTRL_CTRLA_CMD_Msk   0x7F
+#define NVMCTRL_CTRLA_CMD_ER    0x02
+#define NVMCTRL_CTRLA_CMD_WP    0x04
+#define NVMCTRL_CTRLA_CMD_EAR   0x05
+#define NVMCTRL_CTRLA_CMD_WAP   0x06
+#define NVMCTRL_CTRLA_CMD_PBC   0x44
+#define NVMCTRL_CTRLA_CMDEX_Msk 0xFF00
+#define NVMCTRL_CTRLA_CMDEX_KEY 0xA500
+#define NVMCTRL_CTRLB_MANW      (1 << 7)
+#define NVMCTRL_INTFLAG_READY   (1 << 0)
+#define NVMCTRL_INTFLAG_ERROR   (1 << 1)
+#define NVMCTRL_STATUS_PRM      (1 << 0)
+#define NVMCTRL_STATUS_LOAD     (1 << 1)
+#define NVMCTRL_STATUS_PROGE    (1 << 2)
+#define NVMCTRL_STATUS_LOCKE    (1 << 3)
+#define NVMCTRL_STATUS_NVME     (1 << 4)
+#define NVMCTRL_STATUS_SB       (1 << 8)
+#define NVMCTRL_STATUS_MASK     0x011F
+
+// ---- PM, PAC, PORT ----
+
+typedef union { uint32_t reg; } PM_Reg32_Type;
+typedef union { uint8_t  reg; } PM_Reg8_Type;
+
+typedef struct {
+	__IO PM_Reg32_Type APBAMASK;
+	__IO PM_Reg32_Type APBBMASK;
+	__IO PM_Reg32_Type APBCMASK;
+	__IO PM_Reg8_Type  RCAUSE;
+} Pm;
+
+#define PM_APBBMASK_DSU (1 << 3)
+#define PM_RCAUSE_POR   (1 << 0)
+#define PM_RCAUSE_BOD12 (1 << 1)
+#define PM_RCAUSE_BOD33 (1 << 2)
+#define PM_RCAUSE_EXT   (1 << 4)
+#define PM_RCAUSE_WDT   (1 << 5)
+#define PM_RCAUSE_SYST  (1 << 6)
+
+typedef union { uint32_t reg; } PAC_Reg32_Type;
+
+typedef struct {
+	__IO PAC_Reg32_Type WPCLR;
+	__IO PAC_Reg32_Type WPSET;
+} Pac;
+
+#define ID_DSU 33
+
+typedef union { uint32_t reg; } PORT_Reg32_Type;
+
+typedef struct {
+	__IO PORT_Reg32_Type DIR;
+	__IO PORT_Reg32_Type DIRCLR;
+	__IO PORT_Reg32_Type DIRSET;
+	__IO PORT_Reg32_Type OUT;
+	__IO PORT_Reg32_Type OUTCLR;
+	__IO PORT_Reg32_Type OUTSET;
+	__IO PORT_Reg32_Type IN;
+	__IO PORT_Reg32_Type WRCONFIG;
+} PortGroup;
+
+typedef struct {
+	PortGroup Group[1];
+} Port;
+
+#define PIN_PA16 16
+
+// ---- Cortex-M0+ core ----
+
+typedef struct {
+	__IO uint32_t CTRL;
+	__IO uint32_t LOAD;
+	__IO uint32_t VAL;
+	__I  uint32_t CALIB;
+} SysTick_Type;
+
+typedef struct {
+	__I  uint32_t CPUID;
+	__IO uint32_t ICSR;
+	__IO uint32_t VTOR;
+	__IO uint32_t AIRCR;
+} SCB_Type;
+
+#define SysTick_CTRL_ENABLE_Msk    (1UL << 0)
+#define SysTick_CTRL_TICKINT_Msk   (1UL << 1)
+#define SysTick_CTRL_CLKSOURCE_Msk (1UL << 2)
+#define SysTick_CTRL_COUNTFLAG_Msk (1UL << 16)
+#define SysTick_LOAD_RELOAD_Msk    0xFFFFFFUL
+
+#define SCB_ICSR_PENDSTSET_Msk (1UL << 26)
+#define SCB_VTOR_TBLOFF_Msk 0xFFFFFF80
+
+typedef enum {
+	SysTick_IRQn = -1,
+	NVMCTRL_IRQn = 5,
+	DMAC_IRQn    = 6,
+	SERCOM0_IRQn = 9,
+	SERCOM1_IRQn = 10
+} IRQn_Type;
+
+// ---- Peripheral instances ----
+
+extern Sercom       sim_sercom0;
+extern Sercom       sim_sercom1;
+extern Pm           sim_pm;
+extern Pac          sim_pac1;
+extern Port         sim_port;
+extern SysTick_Type sim_systick;
+extern SCB_Type     sim_scb;
+
+Dmac *sim_dmac_access(void);
+Nvmctrl *sim_nvmctrl_access(void);
+SysTick_Type *sim_systick_access(void);
+SCB_Type *sim_scb_access(void);
+
+#define SERCOM0 (&sim_sercom0)
+#define SERCOM1 (&sim_sercom1)
+#define PM      (&sim_pm)
+#define PAC1    (&sim_pac1)
+#define PORT    (&sim_port)
+#define SysTick (sim_systick_access())
+#define SCB     (sim_scb_access())
+#define DMAC    (sim_dmac_access())
+#define NVMCTRL (sim_nvmctrl_access())
+
+void NVIC_EnableIRQ(IRQn_Type irqn);
+void NVIC_DisableIRQ(IRQn_Type irqn);
+void NVIC_SetPendingIRQ(IRQn_Type irqn);
+void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority);
+void NVIC_SystemReset(void) __attribute__((noreturn));
+uint32_t SysTick_Config(uint32_t ticks);
+
+void cpu_irq_disable(void);
+void cpu_irq_enable(void);
+
+static inline void __set_MSP(uint32_t top_of_main_stack) {
+	(void)top_of_main_stack;
+}
+
+#define __DMB() __asm__ volatile("" ::: "memory")
+#define __DSB() __asm__ volatile("" ::: "memory")
+#define __WFI() do {} while(0)
+
+#endif
@@ -0,0 +1,85 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * spi.h: ASF SPI driver replacement for the host simulation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef SPI_H
+#define SPI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sam.h"
+#include "dsu_crc32.h"
+
+enum spi_mode {
+	SPI_MODE_MASTER = 1,
+	SPI_MODE_SLAVE  = 0,
+};
+
+enum spi_transfer_mode {
+	SPI_TRANSFER_MODE_0 = 0,
+	SPI_TRANSFER_MODE_1 = 1,
+	SPI_TRANSFER_MODE_2 = 2,
+	SPI_TRANSFER_MODE_3 = 3,
+};
+
+enum spi_frame_format {
+	SPI_FRAME_FORMAT_SPI_FRAME      = 0,
+	SPI_FRAME_FORMAT_SPI_FRAME_ADDR = 2,
+};
+
+enum spi_signal_mux_setting {
+	SPI_SIGNAL_MUX_SETTING_A,
+	SPI_SIGNAL_MUX_SETTING_D,
+	SPI_SIGNAL_MUX_SETTING_E,
+	SPI_SIGNAL_MUX_SETTING_I,
+	SPI_SIGNAL_MUX_SETTING_M,
+};
+
+struct spi_slave_config {
+	enum spi_frame_format frame_format;
+	uint8_t address_mask;
+	uint8_t address;
+	bool preload_enable;
+};
+
+struct spi_config {
+	enum spi_mode mode;
+	enum spi_transfer_mode transfer_mode;
+	enum spi_signal_mux_setting mux_setting;
+	union {
+		struct spi_slave_config slave;
+	} mode_specific;
+	uint32_t pinmux_pad0;
+	uint32_t pinmux_pad1;
+	uint32_t pinmux_pad2;
+	uint32_t pinmux_pad3;
+};
+
+struct spi_module {
+	Sercom *hw;
+	enum spi_mode mode;
+};
+
+void spi_get_config_defaults(struct spi_config *const config);
+enum status_code spi_init(struct spi_module *const module, Sercom *const hw, const struct spi_config *const config);
+void spi_enable(struct spi_module *const module);
+
+#endif
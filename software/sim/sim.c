@@ -0,0 +1,818 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * sim.c: Host simulation of the SAMD09 peripherals used by brickletboot
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+
+---- Host simulation ----
+
+The bootloader sources are compiled unchanged for the host, the headers in
+sim/include replace sam.h, the ASF drivers and the tinydma/tinynvm parts of
+bricklib2. This file implements the hardware behind them:
+
+ Memory:
+  * Flash (incl. the bootloader region) is mapped at address 0 and the
+    NVM user row and serial number at 0x800000, so the absolute addresses
+    in the bootloader can be used as they are. Mapping address 0 needs
+    root or vm.mmap_min_addr = 0
+  * The executable is linked below 4GB without PIE, so the pointer to
+    uint32_t casts for DMA descriptors stay valid
+
+ Time:
+  * Simulated time only advances through sim_advance: The main loop costs
+    loop_time_ns per iteration, every DMAC/NVMCTRL register access costs
+    poll_time_ns (this way busy waits terminate) and every SPI byte costs
+    its bit time (done by the master)
+  * SysTick and pending interrupts are delivered from sim_advance, unless
+    interrupts are disabled with cpu_irq_disable. SysTick VAL is
+    calculated from the simulated time on access, SCB only models
+    ICSR.PENDSTSET
+
+ SERCOM/DMAC:
+  * Every SPI byte is one beat on the rx channel (MOSI -> DATA -> ring)
+    and one beat on the tx channel (descriptor -> DATA -> MISO)
+  * The write-back descriptor is updated after every beat, so
+    TINYDMA_CURRENT_BUFFER_COUNT_FOR_CHANNEL returns the beats that are
+    left in the block
+  * On block completion the next descriptor is fetched from DESCADDR of
+    the write-back descriptor first, then the TCMPL interrupt runs. The
+    interrupt resets DESCADDR of the tx base descriptor to itself, as the
+    tinydma interrupt handler does
+  * TXC is set when slave select goes high
+  * The CRC engine works through CRCDATAIN like the real one. Since a
+    register write can't be observed directly, a byte written to
+    CRCDATAIN is consumed with the next access to DMAC
+
+ NVMCTRL:
+  * A command written to CTRLA is carried out with the next access to
+    NVMCTRL. Page buffer writes go directly to the mapped flash, a page
+    write then ANDs them into the programmed content (bits can't go
+    from 0 to 1 without erase, this is counted)
+  * READY is low for nvm_erase_time_ns/nvm_write_time_ns after a command
+  * Commands in the BOOTPROT region set LOCKE, invalid addresses set NVME
+
+ DSU:
+  * dsu_crc32_cal calculates the CRC-32 over the simulated memory and
+    takes one cycle per word
+
+*/
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+
+#include "spi.h"
+#include "dsu_crc32.h"
+
+#include "bricklib2/bootloader/tinydma.h"
+#include "bricklib2/bootloader/tinynvm.h"
+
+#define SIM_SYSTEM_ADDRESS        0x00800000
+#define SIM_SYSTEM_SIZE           0x0000B000
+#define SIM_SERIAL_NUMBER_ADDRESS 0x0080A00C
+#define SIM_USER_ROW_SIZE         NVMCTRL_PAGE_SIZE
+#define SIM_ROW_SIZE              (NVMCTRL_ROW_PAGES*NVMCTRL_PAGE_SIZE)
+#define SIM_IRQ_COUNT             32
+
+typedef struct {
+	SimConfig config;
+	SimStats stats;
+	uint64_t time;
+
+	// Interrupts, index is IRQn + 1 (SysTick is -1)
+	SimIrqHandler irq_handler[SIM_IRQ_COUNT + 1];
+	uint32_t irq_enabled;
+	uint32_t irq_pending;
+	bool irq_disabled;
+	bool irq_active;
+	uint32_t systick_ctrl;   // CTRL and LOAD as last seen
+	uint32_t systick_load;
+	uint64_t systick_start;
+	uint64_t systick_period;
+	uint64_t systick_next;
+
+	// DMAC
+	DmacDescriptor *descriptor_section;
+	DmacDescriptor *write_back_section;
+	bool dma_channel_active[TINYDMA_CHANNEL_COUNT];
+	uint8_t dma_channel_interrupt[TINYDMA_CHANNEL_COUNT];
+	uint16_t dmac_ctrl;
+	uint32_t dmac_crc;
+
+	// NVMCTRL
+	uint64_t nvm_busy_until;
+	uint8_t flash_programmed[FLASH_SIZE];
+	uint8_t user_row_programmed[SIM_USER_ROW_SIZE];
+} Sim;
+
+static Sim sim;
+
+static Dmac sim_dmac;
+static Nvmctrl sim_nvmctrl;
+
+Sercom       sim_sercom0;
+Sercom       sim_sercom1;
+Pm           sim_pm;
+Pac          sim_pac1;
+Port         sim_port;
+SysTick_Type sim_systick;
+SCB_Type     sim_scb;
+
+static DmacDescriptor tinydma_descriptor_section[TINYDMA_CHANNEL_COUNT] __attribute__((aligned(16)));
+static DmacDescriptor tinydma_write_back_section[TINYDMA_CHANNEL_COUNT] __attribute__((aligned(16)));
+
+jmp_buf sim_reset_jmp_buf;
+
+// ---- Configuration and time ----
+
+void sim_get_config_defaults(SimConfig *config) {
+	config->cpu_frequency       = 48000000;
+	config->loop_time_ns        = 2000;
+	config->poll_time_ns        = 100;
+	config->nvm_erase_time_ns   = 6000000; // tFRE (datasheet max)
+	config->nvm_write_time_ns   = 2500000; // tFPP (datasheet max)
+	config->nvm_boot_protection = 8*1024;  // brickletboot is protected with BOOTPROT
+	config->spi_bit_error_interval = 0;
+}
+
+static void sim_deliver_irqs(void) {
+	if(sim.irq_disabled || sim.irq_active) {
+		return;
+	}
+
+	while(sim.irq_pending & sim.irq_enabled) {
+		const uint8_t index = __builtin_ctz(sim.irq_pending & sim.irq_enabled);
+		sim.irq_pending &= ~(1 << index);
+
+		if(sim.irq_handler[index] != NULL) {
+			sim.stats.irqs++;
+			sim.irq_active = true;
+			sim.irq_handler[index]();
+			sim.irq_active = false;
+		}
+
+		if(sim.irq_disabled) {
+			return;
+		}
+	}
+}
+
+const SimConfig *sim_get_config(void) {
+	return &sim.config;
+}
+
+uint64_t sim_get_time(void) {
+	return sim.time;
+}
+
+static void sim_systick_sync(void);
+
+void sim_advance(const uint64_t ns) {
+	sim_systick_sync();
+	sim.time += ns;
+
+	if(sim.systick_period != 0) {
+		while(sim.time >= sim.systick_next) {
+			sim.systick_next += sim.systick_period;
+			sim.irq_pending |= 1 << (SysTick_IRQn + 1);
+		}
+	}
+
+	sim_deliver_irqs();
+}
+
+const SimStats *sim_get_stats(void) {
+	return &sim.stats;
+}
+
+void sim_set_irq_handler(const IRQn_Type irqn, SimIrqHandler handler) {
+	sim.irq_handler[irqn + 1] = handler;
+}
+
+// ---- Cortex-M0+ ----
+
+void NVIC_EnableIRQ(IRQn_Type irqn) {
+	sim.irq_enabled |= 1 << (irqn + 1);
+}
+
+void NVIC_DisableIRQ(IRQn_Type irqn) {
+	sim.irq_enabled &= ~(1 << (irqn + 1));
+}
+
+void NVIC_SetPendingIRQ(IRQn_Type irqn) {
+	sim.irq_pending |= 1 << (irqn + 1);
+}
+
+void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority) {
+	(void)irqn;
+	(void)priority;
+}
+
+void NVIC_SystemReset(void) {
+	longjmp(sim_reset_jmp_buf, 1);
+}
+
+// Carries out what was written to SysTick since the last access and
+// updates VAL. A changed CTRL or LOAD restarts the counter.
+static void sim_systick_sync(void) {
+	const uint32_t ctrl = sim_systick.CTRL & (SysTick_CTRL_ENABLE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_CLKSOURCE_Msk);
+	const uint32_t load = sim_systick.LOAD & SysTick_LOAD_RELOAD_Msk;
+
+	if((ctrl != sim.systick_ctrl) || (load != sim.systick_load)) {
+		sim.systick_ctrl   = ctrl;
+		sim.systick_load   = load;
+		sim.systick_start  = sim.time;
+		sim.systick_period = (ctrl & SysTick_CTRL_ENABLE_Msk) ? (uint64_t)(load + 1)*1000000000ULL/sim.config.cpu_frequency : 0;
+		sim.systick_next   = sim.time + sim.systick_period;
+
+		if((ctrl & SysTick_CTRL_ENABLE_Msk) && (ctrl & SysTick_CTRL_TICKINT_Msk)) {
+			sim.irq_enabled |= 1 << (SysTick_IRQn + 1);
+		} else {
+			sim.irq_enabled &= ~(1 << (SysTick_IRQn + 1));
+		}
+	}
+
+	if(ctrl & SysTick_CTRL_ENABLE_Msk) {
+		const uint64_t cycles = (sim.time - sim.systick_start)*sim.config.cpu_frequency/1000000000ULL;
+		sim_systick.VAL = load - cycles % (load + 1);
+	} else {
+		sim_systick.VAL = 0;
+	}
+}
+
+SysTick_Type *sim_systick_access(void) {
+	sim_systick_sync();
+	return &sim_systick;
+}
+
+// Only ICSR.PENDSTSET is modelled
+SCB_Type *sim_scb_access(void) {
+	if(sim.irq_pending & (1 << (SysTick_IRQn + 1))) {
+		sim_scb.ICSR |= SCB_ICSR_PENDSTSET_Msk;
+	} else {
+		sim_scb.ICSR &= ~SCB_ICSR_PENDSTSET_Msk;
+	}
+
+	return &sim_scb;
+}
+
+uint32_t SysTick_Config(uint32_t ticks) {
+	sim_systick.LOAD = ticks - 1;
+	sim_systick.VAL  = 0;
+	sim_systick.CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+	sim_systick_sync();
+
+	return 0;
+}
+
+void cpu_irq_disable(void) {
+	sim.irq_disabled = true;
+}
+
+void cpu_irq_enable(void) {
+	sim.irq_disabled = false;
+	sim_deliver_irqs();
+}
+
+// ---- Memory ----
+
+static bool sim_map(const uintptr_t address, const size_t size) {
+	void *p = mmap((void *)address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if(p != (void *)address) {
+		fprintf(stderr, "Could not map simulated memory at 0x%08lx (run as root or set vm.mmap_min_addr = 0)\n", (unsigned long)address);
+		return false;
+	}
+
+	return true;
+}
+
+uint8_t *sim_flash_get(const uint32_t address) {
+	// Flash starts at address 0, hide that from the compiler so it doesn't
+	// treat the pointer as NULL
+	uint8_t *pointer = (uint8_t *)(uintptr_t)address;
+	__asm__ volatile("" : "+r" (pointer));
+	return pointer;
+}
+
+// Programs flash directly, like a debugger would
+void sim_flash_program(const uint32_t address, const uint8_t *data, const uint32_t length) {
+	memcpy(sim_flash_get(address), data, length);
+	if(address + length <= FLASH_SIZE) {
+		memcpy(&sim.flash_programmed[address], data, length);
+	} else if((address >= NVMCTRL_USER) && (address + length <= NVMCTRL_USER + SIM_USER_ROW_SIZE)) {
+		memcpy(&sim.user_row_programmed[address - NVMCTRL_USER], data, length);
+	}
+}
+
+void sim_set_serial_number(const uint32_t serial_number) {
+	memcpy(sim_flash_get(SIM_SERIAL_NUMBER_ADDRESS), &serial_number, sizeof(serial_number));
+}
+
+// ---- SERCOM ----
+
+void spi_get_config_defaults(struct spi_config *const config) {
+	memset(config, 0, sizeof(struct spi_config));
+	config->mode          = SPI_MODE_MASTER;
+	config->transfer_mode = SPI_TRANSFER_MODE_0;
+	config->mux_setting   = SPI_SIGNAL_MUX_SETTING_D;
+	config->pinmux_pad0   = PINMUX_UNUSED;
+	config->pinmux_pad1   = PINMUX_UNUSED;
+	config->pinmux_pad2   = PINMUX_UNUSED;
+	config->pinmux_pad3   = PINMUX_UNUSED;
+}
+
+enum status_code spi_init(struct spi_module *const module, Sercom *const hw, const struct spi_config *const config) {
+	module->hw   = hw;
+	module->mode = config->mode;
+	memset(hw, 0, sizeof(Sercom));
+	hw->SPI.INTFLAG.reg = SERCOM_SPI_INTFLAG_DRE;
+
+	return STATUS_OK;
+}
+
+void spi_enable(struct spi_module *const module) {
+	module->hw->SPI.CTRLA.bit.ENABLE = 1;
+}
+
+// ---- DMAC ----
+
+static void sim_dmac_crc_consume(const uint8_t data) {
+	if((sim.dmac_ctrl & DMAC_CTRL_CRCENABLE) == 0) {
+		return;
+	}
+
+	if((sim_dmac.CRCCTRL.reg & DMAC_CRCCTRL_CRCPOLY_Msk) == DMAC_CRCCTRL_CRCPOLY_CRC32) {
+		// IEEE 802.3, the checksum register shows the complemented value
+		sim.dmac_crc ^= data;
+		for(uint8_t i = 0; i < 8; i++) {
+			sim.dmac_crc = (sim.dmac_crc >> 1) ^ (0xEDB88320 & -(sim.dmac_crc & 1));
+		}
+		sim_dmac.CRCCHKSUM.reg = ~sim.dmac_crc;
+	} else {
+		// CCITT, MSB first
+		uint16_t crc = sim.dmac_crc;
+		crc ^= data << 8;
+		for(uint8_t i = 0; i < 8; i++) {
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+		}
+		sim.dmac_crc = crc;
+		sim_dmac.CRCCHKSUM.reg = crc;
+	}
+}
+
+// Carries out what was written to DMAC since the last access
+static void sim_dmac_sync(void) {
+	const uint16_t ctrl = sim_dmac.CTRL.reg;
+	if((ctrl & DMAC_CTRL_CRCENABLE) && !(sim.dmac_ctrl & DMAC_CTRL_CRCENABLE)) {
+		// CRCCHKSUM holds the start value when the CRC is enabled
+		sim.dmac_crc = sim_dmac.CRCCHKSUM.reg;
+	}
+	sim.dmac_ctrl = ctrl;
+
+	// Values written to CRCDATAIN are bytes, so the marker can't be written
+	if(sim_dmac.CRCDATAIN.reg != 0xFFFFFFFF) {
+		sim_dmac_crc_consume(sim_dmac.CRCDATAIN.reg);
+		sim_dmac.CRCDATAIN.reg = 0xFFFFFFFF;
+	}
+
+	// Channel registers are only used to (re-)enable the tx interrupt
+	const uint8_t channel = sim_dmac.CHID.reg;
+	if(channel < TINYDMA_CHANNEL_COUNT) {
+		sim.dma_channel_interrupt[channel] |= sim_dmac.CHINTENSET.reg;
+		sim.dma_channel_interrupt[channel] &= ~sim_dmac.CHINTENCLR.reg;
+	}
+	sim_dmac.CHINTENSET.reg = 0;
+	sim_dmac.CHINTENCLR.reg = 0;
+	sim_dmac.CHINTFLAG.reg  = 0;
+	sim_dmac.CRCSTATUS.reg  = 0;
+}
+
+Dmac *sim_dmac_access(void) {
+	sim_dmac_sync();
+	sim_advance(sim.config.poll_time_ns);
+
+	return &sim_dmac;
+}
+
+DmacDescriptor *tinydma_get_descriptor_section(void) {
+	return tinydma_descriptor_section;
+}
+
+DmacDescriptor *tinydma_get_write_back_section(void) {
+	return tinydma_write_back_section;
+}
+
+void tinydma_init(DmacDescriptor *descriptor_section, DmacDescriptor *write_back_section) {
+	sim.descriptor_section = descriptor_section;
+	sim.write_back_section = write_back_section;
+	sim_dmac.BASEADDR.reg  = (uint32_t)descriptor_section;
+	sim_dmac.WRBADDR.reg   = (uint32_t)write_back_section;
+
+	for(uint8_t channel = 0; channel < TINYDMA_CHANNEL_COUNT; channel++) {
+		sim.dma_channel_active[channel]    = false;
+		sim.dma_channel_interrupt[channel] = 0;
+	}
+}
+
+void tinydma_get_channel_config_defaults(TinyDmaChannelConfig *config) {
+	config->peripheral_trigger = 0;
+	config->trigger_action     = DMA_TRIGGER_ACTION_BEAT;
+	config->priority           = 0;
+}
+
+void tinydma_channel_init(const uint8_t channel, TinyDmaChannelConfig *config) {
+	// Trigger is implied: rx channel is fed by MOSI, tx channel feeds MISO
+	(void)channel;
+	(void)config;
+}
+
+void tinydma_descriptor_get_config_defaults(TinyDmaDescriptorConfig *config) {
+	config->src_increment_enable    = true;
+	config->dst_increment_enable    = true;
+	config->beat_size               = DMA_BEAT_SIZE_BYTE;
+	config->block_action            = DMA_BLOCK_ACTION_NOACT;
+	config->block_transfer_count    = 0;
+	config->source_address          = 0;
+	config->destination_address     = 0;
+	config->next_descriptor_address = 0;
+}
+
+void tinydma_descriptor_init(DmacDescriptor *descriptor, TinyDmaDescriptorConfig *config) {
+	DMAC_BTCTRL_Type btctrl = {.reg = 0};
+	btctrl.bit.VALID    = 1;
+	btctrl.bit.BLOCKACT = config->block_action;
+	btctrl.bit.BEATSIZE = config->beat_size;
+	btctrl.bit.SRCINC   = config->src_increment_enable;
+	btctrl.bit.DSTINC   = config->dst_increment_enable;
+
+	descriptor->BTCTRL.reg   = btctrl.reg;
+	descriptor->BTCNT.reg    = config->block_transfer_count;
+	descriptor->SRCADDR.reg  = config->source_address;
+	descriptor->DSTADDR.reg  = config->destination_address;
+	descriptor->DESCADDR.reg = config->next_descriptor_address;
+}
+
+void tinydma_start_transfer(const uint8_t channel) {
+	sim.write_back_section[channel] = sim.descriptor_section[channel];
+	sim.dma_channel_active[channel] = true;
+}
+
+static void sim_dma_block_complete(const uint8_t channel) {
+	// The last register write before the block completed has to be seen
+	sim_dmac_sync();
+
+	DmacDescriptor *wb = &sim.write_back_section[channel];
+	const bool interrupt = wb->BTCTRL.bit.BLOCKACT == DMA_BLOCK_ACTION_INT;
+
+	// Fetch next descriptor
+	if(wb->DESCADDR.reg == 0) {
+		sim.dma_channel_active[channel] = false;
+	} else {
+		*wb = *(DmacDescriptor *)(uintptr_t)wb->DESCADDR.reg;
+	}
+
+	// Transfer complete interrupt (tinydma interrupt handler): The base
+	// descriptor loops on itself again, the chained descriptor was fetched
+	if(interrupt && (sim.dma_channel_interrupt[channel] & DMAC_CHINTENSET_TCMPL)) {
+		sim.descriptor_section[channel].DESCADDR.reg = (uint32_t)&sim.descriptor_section[channel];
+	}
+}
+
+static bool sim_dma_beat(const uint8_t channel, uint8_t *data, const bool read) {
+	DmacDescriptor *wb = &sim.write_back_section[channel];
+	if(!sim.dma_channel_active[channel] || !wb->BTCTRL.bit.VALID || (wb->BTCNT.reg == 0)) {
+		return false;
+	}
+
+	if(read) {
+		const uint32_t source = wb->BTCTRL.bit.SRCINC ? wb->SRCADDR.reg - wb->BTCNT.reg : wb->SRCADDR.reg;
+		*data = *(volatile uint8_t *)(uintptr_t)source;
+	} else {
+		const uint32_t destination = wb->BTCTRL.bit.DSTINC ? wb->DSTADDR.reg - wb->BTCNT.reg : wb->DSTADDR.reg;
+		*(volatile uint8_t *)(uintptr_t)destination = *data;
+	}
+
+	wb->BTCNT.reg--;
+	if(wb->BTCNT.reg == 0) {
+		sim_dma_block_complete(channel);
+	}
+
+	return true;
+}
+
+void sim_spi_select(const bool selected) {
+	SercomSpi *spi = &sim_sercom0.SPI;
+	if(!spi->CTRLA.bit.ENABLE) {
+		return;
+	}
+
+	if(selected) {
+		sim.stats.spi_transactions++;
+	} else {
+		spi->INTFLAG.reg |= SERCOM_SPI_INTFLAG_TXC;
+		if(spi->INTENSET.reg & SERCOM_SPI_INTENSET_TXC) {
+			NVIC_SetPendingIRQ(SERCOM0_IRQn);
+			sim_deliver_irqs();
+		}
+	}
+}
+
+uint8_t sim_spi_transfer_byte(const uint8_t mosi) {
+	SercomSpi *spi = &sim_sercom0.SPI;
+	if(!spi->CTRLA.bit.ENABLE) {
+		return 0xFF;
+	}
+
+	sim.stats.spi_bytes++;
+
+	// DATA was preloaded by the tx channel, without a running channel
+	// the last byte is sent again
+	uint8_t miso = spi->DATA.reg;
+	if(sim_dma_beat(TINYDMA_SPITFP_TX_INDEX, &miso, true)) {
+		spi->DATA.reg = miso;
+	}
+
+	// Bit errors on the cable, the bit position moves with every error
+	uint8_t data = mosi;
+	if((sim.config.spi_bit_error_interval > 0) && ((sim.stats.spi_bytes % sim.config.spi_bit_error_interval) == 0)) {
+		data ^= 1 << (sim.stats.spi_bit_errors % 8);
+		sim.stats.spi_bit_errors++;
+	}
+
+	if(!sim_dma_beat(TINYDMA_SPITFP_RX_INDEX, &data, false)) {
+		sim.stats.dma_rx_overruns++;
+	}
+
+	return miso;
+}
+
+// ---- NVMCTRL ----
+
+static uint8_t *sim_nvm_programmed(const uint32_t address, const uint32_t length) {
+	if(address + length <= FLASH_SIZE) {
+		return &sim.flash_programmed[address];
+	}
+
+	if((address >= NVMCTRL_USER) && (address + length <= NVMCTRL_USER + SIM_USER_ROW_SIZE)) {
+		return &sim.user_row_programmed[address - NVMCTRL_USER];
+	}
+
+	return NULL;
+}
+
+static void sim_nvm_erase(const uint32_t address) {
+	uint8_t *programmed = sim_nvm_programmed(address, SIM_ROW_SIZE);
+	memset(programmed, 0xFF, SIM_ROW_SIZE);
+	memset(sim_flash_get(address), 0xFF, SIM_ROW_SIZE);
+	sim.stats.nvm_erases++;
+}
+
+// Page buffer content was written to the mapped flash, program it
+static void sim_nvm_write(const uint32_t address, const uint32_t length) {
+	uint8_t *programmed = sim_nvm_programmed(address, length);
+	uint8_t *flash = sim_flash_get(address);
+	bool without_erase = false;
+	for(uint32_t i = 0; i < length; i++) {
+		if(flash[i] & ~programmed[i]) {
+			without_erase = true;
+		}
+		programmed[i] &= flash[i];
+		flash[i] = programmed[i];
+	}
+
+	if(without_erase) {
+		sim.stats.nvm_write_without_erase++;
+	}
+	sim.stats.nvm_writes++;
+}
+
+static void sim_nvm_error(const uint16_t status) {
+	sim_nvmctrl.STATUS.reg  |= status;
+	sim_nvmctrl.INTFLAG.reg |= NVMCTRL_INTFLAG_ERROR;
+	sim.stats.nvm_errors++;
+}
+
+static void sim_nvm_command(const uint16_t ctrla) {
+	if((ctrla & NVMCTRL_CTRLA_CMDEX_Msk) != NVMCTRL_CTRLA_CMDEX_KEY) {
+		sim_nvm_error(NVMCTRL_STATUS_PROGE);
+		return;
+	}
+
+	const uint8_t command = ctrla & NVMCTRL_CTRLA_CMD_Msk;
+	const uint32_t address = sim_nvmctrl.ADDR.reg*2;
+	uint32_t time = 0;
+
+	switch(command) {
+		case NVMCTRL_CTRLA_CMD_ER:
+		case NVMCTRL_CTRLA_CMD_WP: {
+			const uint32_t size = command == NVMCTRL_CTRLA_CMD_ER ? SIM_ROW_SIZE : NVMCTRL_PAGE_SIZE;
+			const uint32_t start = address & ~(size - 1);
+			if(start + size > FLASH_SIZE) {
+				sim_nvm_error(NVMCTRL_STATUS_NVME);
+				return;
+			}
+
+			if(start < sim.config.nvm_boot_protection) {
+				sim_nvm_error(NVMCTRL_STATUS_LOCKE);
+				return;
+			}
+
+			if(command == NVMCTRL_CTRLA_CMD_ER) {
+				sim_nvm_erase(start);
+				time = sim.config.nvm_erase_time_ns;
+			} else {
+				sim_nvm_write(start, size);
+				time = sim.config.nvm_write_time_ns;
+			}
+			break;
+		}
+
+		case NVMCTRL_CTRLA_CMD_EAR:
+		case NVMCTRL_CTRLA_CMD_WAP: {
+			if((address & ~(SIM_USER_ROW_SIZE - 1)) != NVMCTRL_USER) {
+				sim_nvm_error(NVMCTRL_STATUS_NVME);
+				return;
+			}
+
+			if(command == NVMCTRL_CTRLA_CMD_EAR) {
+				memset(sim.user_row_programmed, 0xFF, SIM_USER_ROW_SIZE);
+				memset(sim_flash_get(NVMCTRL_USER), 0xFF, SIM_USER_ROW_SIZE);
+				sim.stats.nvm_erases++;
+				time = sim.config.nvm_erase_time_ns;
+			} else {
+				sim_nvm_write(NVMCTRL_USER, SIM_USER_ROW_SIZE);
+				time = sim.config.nvm_write_time_ns;
+			}
+			break;
+		}
+
+		case NVMCTRL_CTRLA_CMD_PBC: {
+			// Page buffer writes go to the mapped flash directly, nothing to clear
+			break;
+		}
+
+		default: {
+			sim_nvm_error(NVMCTRL_STATUS_PROGE);
+			return;
+		}
+	}
+
+	if(time > 0) {
+		sim.nvm_busy_until = sim.time + time;
+		sim_nvmctrl.INTFLAG.reg &= ~NVMCTRL_INTFLAG_READY;
+	}
+}
+
+// Carries out what was written to NVMCTRL since the last access
+Nvmctrl *sim_nvmctrl_access(void) {
+	if(!(sim_nvmctrl.INTFLAG.reg & NVMCTRL_INTFLAG_READY) && (sim.time >= sim.nvm_busy_until)) {
+		sim_nvmctrl.INTFLAG.reg |= NVMCTRL_INTFLAG_READY;
+	}
+
+	// Writing to STATUS clears the written bits (the bootloader writes the mask)
+	if(sim_nvmctrl.STATUS.reg == NVMCTRL_STATUS_MASK) {
+		sim_nvmctrl.STATUS.reg   = 0;
+		sim_nvmctrl.INTFLAG.reg &= ~NVMCTRL_INTFLAG_ERROR;
+	}
+
+	if(sim_nvmctrl.CTRLA.reg != 0) {
+		const uint16_t ctrla = sim_nvmctrl.CTRLA.reg;
+		sim_nvmctrl.CTRLA.reg = 0;
+		sim_nvm_command(ctrla);
+	}
+
+	sim_advance(sim.config.poll_time_ns);
+
+	return &sim_nvmctrl;
+}
+
+void tinynvm_init(void) {
+	NVMCTRL->CTRLB.reg |= NVMCTRL_CTRLB_MANW;
+}
+
+void tinynvm_erase_row(const uint32_t address) {
+	while(!(NVMCTRL->INTFLAG.reg & NVMCTRL_INTFLAG_READY));
+	NVMCTRL->ADDR.reg  = address / 2;
+	NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMD_ER | NVMCTRL_CTRLA_CMDEX_KEY;
+	while(!(NVMCTRL->INTFLAG.reg & NVMCTRL_INTFLAG_READY));
+}
+
+void tinynvm_write_page(const uint32_t address, const uint8_t *data) {
+	while(!(NVMCTRL->INTFLAG.reg & NVMCTRL_INTFLAG_READY));
+
+	const uint16_t *page = (const uint16_t *)data;
+	volatile uint16_t *nvm = (volatile uint16_t *)(uintptr_t)address;
+	for(uint8_t i = 0; i < NVMCTRL_PAGE_SIZE/2; i++) {
+		nvm[i] = page[i];
+	}
+
+	NVMCTRL->ADDR.reg  = address / 2;
+	NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMD_WP | NVMCTRL_CTRLA_CMDEX_KEY;
+	while(!(NVMCTRL->INTFLAG.reg & NVMCTRL_INTFLAG_READY));
+}
+
+// ---- DSU ----
+
+enum status_code dsu_crc32_cal(const uint32_t addr, const uint32_t len, uint32_t *pcrc32) {
+	if((addr & 0x3) || (len & 0x3)) {
+		return STATUS_ERR_BAD_ADDRESS;
+	}
+
+	// Same as DSU: Reflected CRC-32, start value given, not complemented
+	uint32_t crc = *pcrc32;
+	const uint8_t *data = sim_flash_get(addr);
+	for(uint32_t i = 0; i < len; i++) {
+		crc ^= data[i];
+		for(uint8_t j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+
+	*pcrc32 = crc;
+	sim_advance((uint64_t)(len/4)*1000000000ULL/sim.config.cpu_frequency);
+
+	return STATUS_OK;
+}
+
+// ---- Reset ----
+
+// Peripheral state after a reset, memory content is kept
+void sim_power_on_reset(void) {
+	memset(&sim_dmac, 0, sizeof(sim_dmac));
+	memset(&sim_nvmctrl, 0, sizeof(sim_nvmctrl));
+	memset(&sim_sercom0, 0, sizeof(sim_sercom0));
+	memset(&sim_sercom1, 0, sizeof(sim_sercom1));
+	memset(&sim_pm, 0, sizeof(sim_pm));
+	memset(&sim_pac1, 0, sizeof(sim_pac1));
+	memset(&sim_port, 0, sizeof(sim_port));
+	memset(&sim_systick, 0, sizeof(sim_systick));
+	memset(&sim_scb, 0, sizeof(sim_scb));
+
+	sim_dmac.CRCDATAIN.reg  = 0xFFFFFFFF;
+	sim_nvmctrl.INTFLAG.reg = NVMCTRL_INTFLAG_READY;
+	sim_nvmctrl.PARAM.reg   = (FLASH_SIZE/NVMCTRL_PAGE_SIZE) | (1 << 16); // NVMP, PSZ = 16 bytes << 1
+	sim_pm.RCAUSE.reg       = PM_RCAUSE_POR;
+
+	sim.descriptor_section = NULL;
+	sim.write_back_section = NULL;
+	memset(sim.dma_channel_active, 0, sizeof(sim.dma_channel_active));
+	memset(sim.dma_channel_interrupt, 0, sizeof(sim.dma_channel_interrupt));
+	sim.dmac_ctrl      = 0;
+	sim.nvm_busy_until = 0;
+	sim.irq_enabled    = 0;
+	sim.irq_pending    = 0;
+	sim.irq_disabled   = false;
+	sim.irq_active     = false;
+	sim.systick_ctrl   = 0;
+	sim.systick_load   = 0;
+	sim.systick_period = 0;
+}
+
+// Can be called again to start over with erased flash
+bool sim_init(const SimConfig *config) {
+	static bool mapped = false;
+
+	memset(&sim, 0, sizeof(sim));
+	sim.config = *config;
+
+	if(!mapped) {
+		if(!sim_map(FLASH_ADDR, FLASH_SIZE) || !sim_map(SIM_SYSTEM_ADDRESS, SIM_SYSTEM_SIZE)) {
+			return false;
+		}
+		mapped = true;
+	}
+
+	memset(sim_flash_get(FLASH_ADDR), 0xFF, FLASH_SIZE);
+	memset(sim.flash_programmed, 0xFF, FLASH_SIZE);
+
+	// User row: Fuses in the first 8 bytes, the rest is erased
+	static const uint8_t fuses[8] = {0xFA, 0xFE, 0x85, 0xDB, 0x5D, 0xDC, 0xFF, 0xFF};
+	memset(sim_flash_get(NVMCTRL_USER), 0xFF, SIM_USER_ROW_SIZE);
+	memset(sim.user_row_programmed, 0xFF, SIM_USER_ROW_SIZE);
+	sim_flash_program(NVMCTRL_USER, fuses, sizeof(fuses));
+
+	sim_set_serial_number(0x1234ABCD);
+	sim_power_on_reset();
+
+	return true;
+}
@@ -0,0 +1,78 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * sim.h: Host simulation of the SAMD09 peripherals used by brickletboot
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <setjmp.h>
+
+#include "sam.h"
+
+typedef struct {
+	uint32_t cpu_frequency;      // in Hz, SysTick and DSU timing
+	uint32_t loop_time_ns;       // Duration of one main loop iteration
+	uint32_t poll_time_ns;       // Duration of one DMAC/NVMCTRL register access
+	uint32_t nvm_erase_time_ns;  // Row erase
+	uint32_t nvm_write_time_ns;  // Page write
+	uint32_t nvm_boot_protection; // Bytes at start of flash that are locked (BOOTPROT)
+	uint32_t spi_bit_error_interval; // Flip one MOSI bit every n bytes, 0 = no errors
+} SimConfig;
+
+typedef struct {
+	uint32_t nvm_erases;
+	uint32_t nvm_writes;
+	uint32_t nvm_errors;              // Commands that set PROGE, LOCKE or NVME
+	uint32_t nvm_write_without_erase; // Page writes that tried to program a 0 to 1
+	uint32_t spi_bytes;
+	uint32_t spi_transactions;
+	uint32_t spi_bit_errors;          // MOSI bits flipped (spi_bit_error_interval)
+	uint32_t dma_rx_overruns;         // Bytes received while the rx channel was not running
+	uint32_t irqs;
+} SimStats;
+
+typedef void (*SimIrqHandler)(void);
+
+// NVIC_SystemReset jumps here
+extern jmp_buf sim_reset_jmp_buf;
+
+void sim_get_config_defaults(SimConfig *config);
+bool sim_init(const SimConfig *config);
+const SimConfig *sim_get_config(void);
+void sim_power_on_reset(void);
+
+uint64_t sim_get_time(void);
+void sim_advance(const uint64_t ns);
+const SimStats *sim_get_stats(void);
+
+void sim_set_irq_handler(const IRQn_Type irqn, SimIrqHandler handler);
+
+// Host side of the SPI bus, the simulated master drives these
+void sim_spi_select(const bool selected);
+uint8_t sim_spi_transfer_byte(const uint8_t mosi);
+
+// Direct access to simulated flash (bootloader, firmware and user row)
+uint8_t *sim_flash_get(const uint32_t address);
+void sim_flash_program(const uint32_t address, const uint8_t *data, const uint32_t length);
+void sim_set_serial_number(const uint32_t serial_number);
+
+#endif
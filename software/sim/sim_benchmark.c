@@ -0,0 +1,310 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * sim_benchmark.c: Firmware flashing benchmark with the simulated master
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+// Flashes images of different sizes with different SPI clocks and poll
+// intervals through the simulated bootloader and reports for every run:
+//  * Time to flash (until the last page is in flash) and throughput
+//  * Time from SET_BOOTLOADER_MODE to firmware start (full images only)
+//  * Round-trip latency of SET_WRITE_FIRMWARE_POINTER (until ACK) and
+//    WRITE_FIRMWARE (until response) as power-of-two histogram
+//  * Poll efficiency: Share of SPI transactions that moved a frame
+//
+// With -J the bootloader is asked for jumbo frames first (several chunks
+// per WRITE_FIRMWARE, only if built with SPITFP_USE_JUMBO_FRAMES). With -S
+// the firmware is erased with ERASE_FIRMWARE first and erased chunks are not
+// sent (only if built with BOOTLOADER_USE_BULK_ERASE). -g sets the size of
+// the code in the generated image, the rest is 0xFF.
+//
+// The simulation is single threaded: While the bootloader busy waits (e.g.
+// for a page write before the next one can be buffered) the master does not
+// poll. These polls would be idle on the device, so the poll efficiency is
+// a bit too optimistic for small poll intervals.
+//
+// All times are simulated and deterministic, so results of two versions
+// of the bootloader can be compared directly. With -j every run is printed
+// as one JSON object per line.
+//
+// Usage: brickletboot-benchmark [-c spi_clocks] [-s image_sizes]
+//                               [-p poll_intervals_us] [-g code_size]
+//                               [-J] [-S] [-j] [firmware.bin]
+//        Lists are comma separated
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "sim_bootloader.h"
+#include "sim_master.h"
+#include "sim_update.h"
+
+#include "nvm_writer.h"
+#include "tfp_common.h"
+#include "configs/config.h"
+
+#define SIM_BENCHMARK_LIST_MAX_LENGTH 16
+#define SIM_BENCHMARK_IDLE_TIMEOUT    1000000000ULL // 1s
+
+typedef struct {
+	uint32_t values[SIM_BENCHMARK_LIST_MAX_LENGTH];
+	uint8_t length;
+} SimBenchmarkList;
+
+typedef struct {
+	uint32_t spi_clock;
+	uint32_t poll_interval_us;
+	uint32_t image_size;
+	bool jumbo;
+	bool sparse;
+
+	bool ok;
+	uint8_t chunks; // Chunks per WRITE_FIRMWARE
+	uint64_t flash_time_ns;
+	uint64_t boot_time_ns; // 0 if not booted (image smaller than firmware)
+
+	SimMaster master; // State after flashing, without the reboot
+	SimStats stats;
+} SimBenchmarkResult;
+
+static uint8_t image[BOOTLOADER_FIRMWARE_SIZE];
+
+static bool sim_benchmark_parse_list(SimBenchmarkList *list, const char *arg) {
+	list->length = 0;
+	while(*arg != '\0') {
+		char *end;
+		const unsigned long value = strtoul(arg, &end, 0);
+		if((end == arg) || (value == 0) || (list->length == SIM_BENCHMARK_LIST_MAX_LENGTH)) {
+			return false;
+		}
+
+		list->values[list->length++] = value;
+		arg = (*end == ',') ? end + 1 : end;
+		if((*end != ',') && (*end != '\0')) {
+			return false;
+		}
+	}
+
+	return list->length > 0;
+}
+
+// The last page of WRITE_FIRMWARE is still written in the background
+static bool sim_benchmark_wait_nvm_idle(SimMaster *master) {
+	const uint64_t end = sim_get_time() + SIM_BENCHMARK_IDLE_TIMEOUT;
+	while(!nvm_writer_is_idle()) {
+		if(sim_get_time() >= end) {
+			return false;
+		}
+
+		sim_master_transaction(master);
+		if(sim_bootloader_run_until(sim_get_time() + master->poll_interval_ns) == SIM_BOOTLOADER_RESET) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void sim_benchmark_run(SimBenchmarkResult *result) {
+	SimConfig config;
+	sim_get_config_defaults(&config);
+	if(!sim_init(&config)) {
+		exit(2);
+	}
+
+	result->ok = false;
+	result->flash_time_ns = 0;
+	result->boot_time_ns = 0;
+	memset(&result->master, 0, sizeof(SimMaster));
+	memset(&result->stats, 0, sizeof(SimStats));
+
+	SimMaster master;
+	sim_master_init(&master, result->spi_clock);
+	master.poll_interval_ns = result->poll_interval_us*1000;
+
+	if(sim_bootloader_start() == TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK) {
+		fprintf(stderr, "Empty flash has a valid firmware\n");
+		return;
+	}
+
+	result->chunks = result->jumbo ? sim_update_get_chunks(sim_update_set_spitfp_features(&master, SPITFP_FEATURE_JUMBO, 1)) : 1;
+
+	const uint64_t start = sim_get_time();
+	if(!sim_update_flash(&master, image, result->image_size, result->chunks, result->sparse) ||
+	   !sim_benchmark_wait_nvm_idle(&master)) {
+		return;
+	}
+	result->flash_time_ns = sim_get_time() - start;
+	result->master = master;
+
+	// Only whole chunks are written
+	const uint32_t written = (result->image_size + SIM_UPDATE_CHUNK_SIZE - 1) / SIM_UPDATE_CHUNK_SIZE * SIM_UPDATE_CHUNK_SIZE;
+	if(!sim_update_verify(image, written)) {
+		fprintf(stderr, "Flash content differs\n");
+		return;
+	}
+
+	if(result->image_size == BOOTLOADER_FIRMWARE_SIZE) {
+		const uint64_t boot_start = sim_get_time();
+		if(!sim_update_reboot_to_firmware(&master)) {
+			return;
+		}
+		result->boot_time_ns = sim_get_time() - boot_start;
+	}
+
+	result->stats = *sim_get_stats();
+	result->ok = true;
+}
+
+static double sim_benchmark_throughput(const SimBenchmarkResult *result) {
+	return result->flash_time_ns > 0 ? result->image_size*1000000000.0/result->flash_time_ns : 0.0;
+}
+
+static double sim_benchmark_poll_efficiency(const SimBenchmarkResult *result) {
+	const SimMaster *m = &result->master;
+	return m->transactions > 0 ? 1.0 - ((double)m->idle_transactions)/m->transactions : 0.0;
+}
+
+static double sim_benchmark_latency_avg_us(const SimMasterLatency *latency) {
+	return latency->calls > 0 ? latency->total_ns/1000.0/latency->calls : 0.0;
+}
+
+static void sim_benchmark_print_json_latency(const char *name, const SimMasterLatency *latency) {
+	printf("\"%s\":{\"calls\":%u,\"min_us\":%.3f,\"avg_us\":%.3f,\"max_us\":%.3f,\"histogram_us\":[",
+	       name, latency->calls, latency->min_ns/1000.0, sim_benchmark_latency_avg_us(latency), latency->max_ns/1000.0);
+	for(uint8_t i = 0; i < SIM_MASTER_LATENCY_BUCKETS; i++) {
+		printf("%s%u", i == 0 ? "" : ",", latency->histogram[i]);
+	}
+	printf("]}");
+}
+
+static void sim_benchmark_print_json(const SimBenchmarkResult *result) {
+	const SimMaster *m = &result->master;
+	printf("{\"spi_clock_hz\":%u,\"poll_interval_us\":%u,\"image_size\":%u,\"chunks\":%u,\"sparse\":%s,\"ok\":%s,",
+	       result->spi_clock, result->poll_interval_us, result->image_size, result->chunks,
+	       result->sparse ? "true" : "false", result->ok ? "true" : "false");
+	printf("\"flash_time_us\":%.3f,\"throughput_bps\":%.1f,\"boot_time_us\":%.3f,",
+	       result->flash_time_ns/1000.0, sim_benchmark_throughput(result), result->boot_time_ns/1000.0);
+	printf("\"transactions\":%u,\"idle_transactions\":%u,\"poll_efficiency\":%.4f,\"spi_bytes\":%u,",
+	       m->transactions, m->idle_transactions, sim_benchmark_poll_efficiency(result), m->bytes);
+	printf("\"resends\":%u,\"checksum_errors\":%u,\"frame_errors\":%u,",
+	       m->resends, m->checksum_errors, m->frame_errors);
+	printf("\"nvm_erases\":%u,\"nvm_writes\":%u,", result->stats.nvm_erases, result->stats.nvm_writes);
+	sim_benchmark_print_json_latency("latency_ack", &m->latency_ack);
+	printf(",");
+	sim_benchmark_print_json_latency("latency_response", &m->latency_response);
+	printf("}\n");
+}
+
+static void sim_benchmark_print_histogram(const char *name, const SimMasterLatency *latency) {
+	printf("  %s: %u calls, min %.1f us, avg %.1f us, max %.1f us\n",
+	       name, latency->calls, latency->min_ns/1000.0, sim_benchmark_latency_avg_us(latency), latency->max_ns/1000.0);
+	for(uint8_t i = 0; i < SIM_MASTER_LATENCY_BUCKETS; i++) {
+		if(latency->histogram[i] > 0) {
+			printf("    %6u us - %6u us: %u\n", i == 0 ? 0 : 1 << i, 1 << (i+1), latency->histogram[i]);
+		}
+	}
+}
+
+static void sim_benchmark_print_text(const SimBenchmarkResult *result) {
+	const SimMaster *m = &result->master;
+	printf("spi clock %u Hz, poll interval %u us, image %u bytes, %u chunks per write%s: %s\n",
+	       result->spi_clock, result->poll_interval_us, result->image_size, result->chunks,
+	       result->sparse ? " (sparse)" : "", result->ok ? "ok" : "failed");
+	printf("  flash time %.3f ms, %.0f bytes/s, boot time %.3f ms\n",
+	       result->flash_time_ns/1000000.0, sim_benchmark_throughput(result), result->boot_time_ns/1000000.0);
+	printf("  transactions %u (%u idle, poll efficiency %.1f%%), %u bytes, %u resends\n",
+	       m->transactions, m->idle_transactions, sim_benchmark_poll_efficiency(result)*100.0, m->bytes, m->resends);
+	sim_benchmark_print_histogram("SET_WRITE_FIRMWARE_POINTER", &m->latency_ack);
+	sim_benchmark_print_histogram("WRITE_FIRMWARE", &m->latency_response);
+}
+
+int main(int argc, char **argv) {
+	SimBenchmarkList spi_clocks     = {{400000, 1400000, 2000000, 8000000}, 4};
+	SimBenchmarkList image_sizes    = {{1024, 4096, BOOTLOADER_FIRMWARE_SIZE}, 3};
+	SimBenchmarkList poll_intervals = {{200}, 1};
+	uint32_t code_size = BOOTLOADER_FIRMWARE_SIZE;
+	bool jumbo = false;
+	bool sparse = false;
+	bool json = false;
+	int opt;
+
+	while((opt = getopt(argc, argv, "c:s:p:g:JSj")) != -1) {
+		bool ok = true;
+		switch(opt) {
+			case 'c': ok = sim_benchmark_parse_list(&spi_clocks, optarg);     break;
+			case 's': ok = sim_benchmark_parse_list(&image_sizes, optarg);    break;
+			case 'p': ok = sim_benchmark_parse_list(&poll_intervals, optarg); break;
+			case 'g': code_size = strtoul(optarg, NULL, 0);                   break;
+			case 'J': jumbo = true;                                           break;
+			case 'S': sparse = true;                                          break;
+			case 'j': json = true;                                            break;
+			default:  ok = false;                                             break;
+		}
+
+		if(!ok) {
+			fprintf(stderr, "Usage: %s [-c spi_clocks] [-s image_sizes] [-p poll_intervals_us] [-g code_size] [-J] [-S] [-j] [firmware.bin]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	for(uint8_t i = 0; i < image_sizes.length; i++) {
+		if(image_sizes.values[i] > BOOTLOADER_FIRMWARE_SIZE) {
+			fprintf(stderr, "Image size has to be 1 to %d bytes\n", BOOTLOADER_FIRMWARE_SIZE);
+			return 2;
+		}
+	}
+
+	if(optind < argc) {
+		if(!sim_update_load_image(image, argv[optind])) {
+			return 2;
+		}
+	} else {
+		sim_update_generate_image(image, code_size);
+	}
+
+	bool all_ok = true;
+	for(uint8_t s = 0; s < image_sizes.length; s++) {
+		for(uint8_t c = 0; c < spi_clocks.length; c++) {
+			for(uint8_t p = 0; p < poll_intervals.length; p++) {
+				SimBenchmarkResult result;
+				result.spi_clock        = spi_clocks.values[c];
+				result.poll_interval_us = poll_intervals.values[p];
+				result.image_size       = image_sizes.values[s];
+				result.jumbo            = jumbo;
+				result.sparse           = sparse;
+
+				sim_benchmark_run(&result);
+				all_ok &= result.ok;
+
+				if(json) {
+					sim_benchmark_print_json(&result);
+				} else {
+					sim_benchmark_print_text(&result);
+				}
+				fflush(stdout);
+			}
+		}
+	}
+
+	return all_ok ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * sim_bootloader.c: Main loop of brickletboot for the host simulation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// This is the host counterpart of main.c: Same start-up sequence and main
+// loop, but the loop runs for a given amount of simulated time and a reset
+// (NVIC_SystemReset) returns to the caller. The firmware itself is not
+// simulated, sim_bootloader_start only reports that it would be started.
+// sim_bootloader_start_firmware runs the part of a firmware that uses the
+// bootloader: firmware_entry and the SPITFP functions it hands out.
+//
+// RAM is not cleared on a reset, like on the device everything the
+// bootloader relies on is initialized in sim_bootloader_start.
+
+#include "sim_bootloader.h"
+
+#include <stdbool.h>
+
+#include "sim.h"
+#include "bootloader_spitfp.h"
+#include "boot.h"
+#include "tfp_common.h"
+#include "firmware_entry.h"
+#include "nvm_writer.h"
+#include "profile.h"
+
+#include "bricklib2/bootloader/tinydma.h"
+#include "bricklib2/bootloader/tinynvm.h"
+#include "configs/config.h"
+
+// The extension is reserved behind the BootloaderStatus, see firmware_entry.h
+BootloaderStatusStorage bootloader_status_storage;
+BootloaderStatus *const bootloader_status = &bootloader_status_storage.status;
+
+// In firmware mode the loop calls the functions that firmware_entry put
+// into the BootloaderFunctions of the firmware, with its BootloaderStatus
+static BootloaderFunctions *sim_bootloader_firmware_functions = NULL;
+static BootloaderStatus *sim_bootloader_firmware_status = NULL;
+
+static void sim_bootloader_systick_handler(void) {
+	bootloader_status->system_timer_tick++;
+}
+
+static void sim_bootloader_firmware_systick_handler(void) {
+	sim_bootloader_firmware_status->system_timer_tick++;
+}
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+static void sim_bootloader_spitfp_irq_handler(void) {
+	spitfp_irq_handler(bootloader_status);
+}
+
+static void sim_bootloader_firmware_spitfp_irq_handler(void) {
+	sim_bootloader_firmware_functions->spitfp_irq_handler(sim_bootloader_firmware_status);
+}
+#endif
+
+// Returns TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK if the firmware would be
+// started, otherwise the bootloader is running
+uint8_t sim_bootloader_start(void) {
+	sim_bootloader_firmware_functions = NULL;
+	sim_bootloader_firmware_status = NULL;
+
+#ifdef BOOTLOADER_USE_PROFILING
+	profile_init(&bootloader_status->system_timer_tick);
+#endif
+
+	const uint8_t can_jump_to_firmware = boot_can_jump_to_firmware(true);
+	if(can_jump_to_firmware == TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK) {
+		return can_jump_to_firmware;
+	}
+
+	bootloader_status->boot_mode = BOOT_MODE_BOOTLOADER;
+	bootloader_status->status_led_config = 0;
+	bootloader_status->st.descriptor_section = tinydma_get_descriptor_section();
+	bootloader_status->st.write_back_section = tinydma_get_write_back_section();
+	bootloader_status->system_timer_tick = 0;
+
+	tinynvm_init();
+	nvm_writer_init();
+
+	spitfp_init(&bootloader_status->st);
+	tfp_common_init();
+
+	sim_set_irq_handler(SysTick_IRQn, sim_bootloader_systick_handler);
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	sim_set_irq_handler(SPITFP_IRQN, sim_bootloader_spitfp_irq_handler);
+#endif
+	SysTick_Config(BOOTLOADER_SYSTEM_TIMER_CLOCK_FREQUENCY/1000);
+
+	return can_jump_to_firmware;
+}
+
+// Like the start-up code of a firmware: The firmware sets its message
+// handler and the BootloaderFunctions header (if it has one) before
+// firmware_entry is called
+void sim_bootloader_start_firmware(BootloaderFunctions *bf, BootloaderStatus *bs) {
+	bs->boot_mode = BOOT_MODE_FIRMWARE;
+	bs->status_led_config = 0;
+	bs->st.descriptor_section = tinydma_get_descriptor_section();
+	bs->st.write_back_section = tinydma_get_write_back_section();
+	bs->system_timer_tick = 0;
+
+	firmware_entry_handle(bf, bs);
+
+	sim_bootloader_firmware_functions = bf;
+	sim_bootloader_firmware_status = bs;
+
+	sim_set_irq_handler(SysTick_IRQn, sim_bootloader_firmware_systick_handler);
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	// Only a firmware with extension gets the IRQ handler, without it the
+	// receive interrupt stays disabled
+	if(bootloader_functions_has(bf, BOOTLOADER_FUNCTIONS_CAPABILITY_SPITFP_IRQ_HANDLER)) {
+		sim_set_irq_handler(SPITFP_IRQN, sim_bootloader_firmware_spitfp_irq_handler);
+	}
+#endif
+	SysTick_Config(BOOTLOADER_SYSTEM_TIMER_CLOCK_FREQUENCY/1000);
+}
+
+void sim_bootloader_iteration(void) {
+	if(sim_bootloader_firmware_functions != NULL) {
+		sim_bootloader_firmware_functions->spitfp_tick(sim_bootloader_firmware_status);
+	} else {
+		spitfp_tick(bootloader_status);
+		nvm_writer_tick();
+	}
+
+	sim_advance(sim_get_config()->loop_time_ns);
+}
+
+uint8_t sim_bootloader_run_until(const uint64_t time) {
+	if(setjmp(sim_reset_jmp_buf)) {
+		sim_power_on_reset();
+		PM->RCAUSE.reg = PM_RCAUSE_SYST;
+		return SIM_BOOTLOADER_RESET;
+	}
+
+	while(sim_get_time() < time) {
+		sim_bootloader_iteration();
+	}
+
+	return SIM_BOOTLOADER_RUNNING;
+}
@@ -0,0 +1,39 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * sim_bootloader.h: Main loop of brickletboot for the host simulation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef SIM_BOOTLOADER_H
+#define SIM_BOOTLOADER_H
+
+#include <stdint.h>
+
+#include "bricklib2/bootloader/bootloader.h"
+
+#define SIM_BOOTLOADER_RUNNING 0
+#define SIM_BOOTLOADER_RESET   1
+
+extern BootloaderStatus *const bootloader_status;
+
+uint8_t sim_bootloader_start(void);
+void sim_bootloader_start_firmware(BootloaderFunctions *bf, BootloaderStatus *bs);
+void sim_bootloader_iteration(void);
+uint8_t sim_bootloader_run_until(const uint64_t time);
+
+#endif
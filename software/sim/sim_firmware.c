@@ -0,0 +1,291 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * sim_firmware.c: Firmware side of firmware_entry
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// A firmware that only uses the SPITFP functions of the bootloader, in
+// two variants:
+// * Built against the original bricklib2: BootloaderFunctions without the
+//   header and BootloaderStatus without extension. Behind BootloaderFunctions
+//   the RAM looks like a valid header (but without the marker in
+//   spitfp_tick), behind BootloaderStatus is a canary. Both have to stay
+//   untouched.
+// * Built against bricklib2 ABI version 2 with the extension reserved.
+//
+// The master talks to both through SPITFP. GET_IDENTITY is answered by
+// the bootloader, FIDs of the firmware are forwarded to it and
+// SET_SPITFP_CONFIG only goes to the bootloader with extension.
+// GET_SPITFP_ERROR_COUNT is firmware API and in firmware mode always goes
+// to the firmware.
+// At the end RESET has to reset the device into the firmware again and
+// SET_BOOTLOADER_MODE has to erase the firmware and reset into the
+// bootloader. The flash is restored afterwards.
+
+#include "sim_firmware.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+#include "sim_bootloader.h"
+#include "sim_master.h"
+
+#include "firmware_entry.h"
+#include "tfp_common.h"
+
+#define SIM_FIRMWARE_TIMEOUT 1000000000ULL // 1s
+#define SIM_FIRMWARE_FID     1
+#define SIM_FIRMWARE_MARKER  0x5A
+#define SIM_FIRMWARE_CANARY  0xA5
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t marker;
+} __attribute__((__packed__)) SimFirmwareReturn;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t mode;
+} __attribute__((__packed__)) SetBootloaderMode;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t status;
+} __attribute__((__packed__)) SetBootloaderModeReturn;
+
+typedef struct {
+	TFPMessageHeader header;
+	char uid[8];
+	char connected_uid[8];
+	char position;
+	uint8_t hardware_version[3];
+	uint8_t firmware_version[3];
+	uint16_t device_identifier;
+} __attribute__((__packed__)) GetIdentityReturn;
+
+// RAM of the firmware: The structs as the firmware was compiled and
+// whatever it has behind them
+static union {
+	struct {
+		BootloaderFunctions functions;
+		BootloaderStatusStorage status_storage;
+	} extension;
+	struct {
+		uint8_t functions[offsetof(BootloaderFunctions, size)];
+		uint8_t functions_behind[sizeof(BootloaderFunctions) - offsetof(BootloaderFunctions, size)];
+		BootloaderStatus status;
+		uint8_t status_canary[sizeof(BootloaderExtension)];
+	} legacy;
+} sim_firmware_ram;
+
+static uint32_t sim_firmware_messages;
+static uint8_t sim_firmware_flash[FLASH_SIZE];
+
+static BootloaderHandleMessageReturn sim_firmware_handle_message(const void *message, void *response) {
+	SimFirmwareReturn *sfr = response;
+	sim_firmware_messages++;
+
+	sfr->header = *((const TFPMessageHeader*)message);
+	sfr->header.length = sizeof(SimFirmwareReturn);
+	sfr->marker = SIM_FIRMWARE_MARKER;
+
+	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
+}
+
+static bool sim_firmware_is_canary(const uint8_t *data, const uint32_t length) {
+	for(uint32_t i = 0; i < length; i++) {
+		if(data[i] != SIM_FIRMWARE_CANARY) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// What the legacy firmware has behind its BootloaderFunctions
+static void sim_firmware_get_fake_header(uint8_t *data) {
+	BootloaderFunctions bf;
+	bootloader_functions_init(&bf);
+	bf.status_size = sizeof(BootloaderStatusStorage);
+	memcpy(data, ((const uint8_t *)&bf) + offsetof(BootloaderFunctions, size), sizeof(sim_firmware_ram.legacy.functions_behind));
+}
+
+// forwarded is set if the firmware answered the message
+static uint8_t sim_firmware_call(SimMaster *master, const uint8_t fid, bool *forwarded) {
+	TFPMessageHeader request;
+	uint8_t response[SIM_MASTER_MESSAGE_MAX_LENGTH];
+	const uint32_t messages = sim_firmware_messages;
+
+	sim_master_header(&request, sizeof(request), fid, true);
+	const uint8_t ret = sim_master_call(master, &request, response, SIM_FIRMWARE_TIMEOUT);
+
+	*forwarded = (sim_firmware_messages != messages) && (response[sizeof(TFPMessageHeader)] == SIM_FIRMWARE_MARKER);
+	return ret;
+}
+
+// Start-up of the firmware, RAM is initialized like the firmware would do it
+static BootloaderFunctions *sim_firmware_start(const bool extension) {
+	BootloaderFunctions *bf;
+	BootloaderStatus *bs;
+
+	if(extension) {
+		memset(&sim_firmware_ram, 0, sizeof(sim_firmware_ram));
+		bf = &sim_firmware_ram.extension.functions;
+		bs = &sim_firmware_ram.extension.status_storage.status;
+		bootloader_functions_init(bf);
+		// As if the firmware was compiled with BOOTLOADER_STATUS_EXTENSION_SIZE
+		// set to sizeof(BootloaderExtension)
+		bf->status_size = sizeof(BootloaderStatusStorage);
+	} else {
+		memset(&sim_firmware_ram, SIM_FIRMWARE_CANARY, sizeof(sim_firmware_ram));
+		memset(sim_firmware_ram.legacy.functions, 0, sizeof(sim_firmware_ram.legacy.functions));
+		sim_firmware_get_fake_header(sim_firmware_ram.legacy.functions_behind);
+		memset(&sim_firmware_ram.legacy.status, 0, sizeof(sim_firmware_ram.legacy.status));
+		bf = (BootloaderFunctions *)&sim_firmware_ram.legacy.functions;
+		bs = &sim_firmware_ram.legacy.status;
+	}
+
+	bs->firmware_handle_message_func = sim_firmware_handle_message;
+	sim_bootloader_start_firmware(bf, bs);
+
+	return bf;
+}
+
+// Polls until the device resets
+static bool sim_firmware_wait_for_reset(SimMaster *master) {
+	const uint64_t end = sim_get_time() + SIM_FIRMWARE_TIMEOUT;
+	while(sim_get_time() < end) {
+		sim_master_transaction(master);
+		if(sim_bootloader_run_until(sim_get_time() + master->poll_interval_ns) == SIM_BOOTLOADER_RESET) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// RESET has to reset the device, the bootloader starts the firmware again
+static bool sim_firmware_check_reset(SimMaster *master) {
+	TFPMessageHeader reset;
+	sim_master_header(&reset, sizeof(reset), SIM_MASTER_FID_RESET, false);
+	const uint8_t ret = sim_master_call(master, &reset, NULL, SIM_FIRMWARE_TIMEOUT);
+	if((ret != SIM_MASTER_CALL_RESET) && !((ret == SIM_MASTER_CALL_OK) && sim_firmware_wait_for_reset(master))) {
+		fprintf(stderr, "No reset after RESET in firmware mode\n");
+		return false;
+	}
+
+	if(sim_bootloader_start() != TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK) {
+		fprintf(stderr, "Firmware is not started after RESET\n");
+		return false;
+	}
+
+	return true;
+}
+
+// SET_BOOTLOADER_MODE has to erase the firmware and reset the device into
+// the bootloader
+static bool sim_firmware_check_set_bootloader_mode(SimMaster *master) {
+	SetBootloaderMode sbm;
+	SetBootloaderModeReturn sbmr;
+	sim_master_header(&sbm, sizeof(sbm), SIM_MASTER_FID_SET_BOOTLOADER_MODE, true);
+	sbm.mode = BOOT_MODE_BOOTLOADER;
+	if((sim_master_call(master, &sbm, &sbmr, SIM_FIRMWARE_TIMEOUT) != SIM_MASTER_CALL_OK) ||
+	   (sbmr.status != TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK)) {
+		fprintf(stderr, "SET_BOOTLOADER_MODE in firmware mode failed\n");
+		return false;
+	}
+
+	if(!sim_firmware_wait_for_reset(master)) {
+		fprintf(stderr, "No reset after SET_BOOTLOADER_MODE in firmware mode\n");
+		return false;
+	}
+
+	if(sim_bootloader_start() == TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK) {
+		fprintf(stderr, "Firmware was not erased by SET_BOOTLOADER_MODE\n");
+		return false;
+	}
+
+	return true;
+}
+
+bool sim_firmware_check(const uint32_t spi_clock, const uint32_t poll_interval_ns, const bool extension) {
+	BootloaderFunctions *bf = sim_firmware_start(extension);
+
+	if(extension && !bootloader_functions_has(bf, BOOTLOADER_FUNCTIONS_CAPABILITY_EXTENSION | BOOTLOADER_FUNCTIONS_CAPABILITY_SPITFP_TICK)) {
+		fprintf(stderr, "Firmware with extension: capabilities 0x%08x, version %u\n", bf->capabilities, bf->version);
+		return false;
+	}
+
+	SimMaster master;
+	sim_master_init(&master, spi_clock);
+	master.poll_interval_ns = poll_interval_ns;
+
+	bool forwarded;
+	GetIdentityReturn gir;
+	TFPMessageHeader gi;
+	sim_master_header(&gi, sizeof(gi), SIM_MASTER_FID_GET_IDENTITY, true);
+	const uint32_t messages = sim_firmware_messages;
+	if((sim_master_call(&master, &gi, &gir, SIM_FIRMWARE_TIMEOUT) != SIM_MASTER_CALL_OK) ||
+	   (gir.header.length != sizeof(gir)) || (sim_firmware_messages != messages)) {
+		fprintf(stderr, "GET_IDENTITY in firmware mode failed\n");
+		return false;
+	}
+
+	if((sim_firmware_call(&master, SIM_FIRMWARE_FID, &forwarded) != SIM_MASTER_CALL_OK) || !forwarded) {
+		fprintf(stderr, "FID %u was not forwarded to the firmware\n", SIM_FIRMWARE_FID);
+		return false;
+	}
+
+	// Without parameters: INVALID_PARAMETER from the bootloader, the firmware
+	// without extension gets it
+	const uint8_t ret = sim_firmware_call(&master, SIM_MASTER_FID_SET_SPITFP_CONFIG, &forwarded);
+	if(extension ? (ret != SIM_MASTER_CALL_ERROR || forwarded) : (ret != SIM_MASTER_CALL_OK || !forwarded)) {
+		fprintf(stderr, "SET_SPITFP_CONFIG went to the %s\n", forwarded ? "firmware" : "bootloader");
+		return false;
+	}
+
+	if((sim_firmware_call(&master, SIM_MASTER_FID_GET_SPITFP_ERROR_COUNT, &forwarded) != SIM_MASTER_CALL_OK) || !forwarded) {
+		fprintf(stderr, "GET_SPITFP_ERROR_COUNT was not forwarded to the firmware\n");
+		return false;
+	}
+
+	if(!extension) {
+		uint8_t fake_header[sizeof(sim_firmware_ram.legacy.functions_behind)];
+		sim_firmware_get_fake_header(fake_header);
+		if((memcmp(sim_firmware_ram.legacy.functions_behind, fake_header, sizeof(fake_header)) != 0) ||
+		   !sim_firmware_is_canary(sim_firmware_ram.legacy.status_canary, sizeof(sim_firmware_ram.legacy.status_canary))) {
+			fprintf(stderr, "Bootloader wrote behind the structs of the firmware\n");
+			return false;
+		}
+	}
+
+	if(!sim_firmware_check_reset(&master)) {
+		return false;
+	}
+
+	sim_firmware_start(extension);
+	sim_master_init(&master, spi_clock);
+	master.poll_interval_ns = poll_interval_ns;
+
+	memcpy(sim_firmware_flash, sim_flash_get(FLASH_ADDR), FLASH_SIZE);
+	const bool erased = sim_firmware_check_set_bootloader_mode(&master);
+	sim_flash_program(FLASH_ADDR, sim_firmware_flash, FLASH_SIZE);
+
+	return erased;
+}
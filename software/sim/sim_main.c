@@ -0,0 +1,230 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * sim_main.c: Flashes a firmware through the simulated bootloader
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// Flashes a firmware image (or a generated test image) through the real
+// SPITFP/TFP code path like brickv does, reboots into the firmware and
+// prints the simulated time that was needed.
+//
+// Usage: brickletboot-sim [-c spi_clock_hz] [-p poll_interval_us] [-e bit_error_interval]
+//                        [-g code_size] [-w send_window_size] [-J] [-S] [-V] [-A] [firmware.bin]
+//
+// With -V the written firmware is verified with GET_FIRMWARE_CRC before
+// the reboot (needs BOOTLOADER_USE_RANGE_CRC). With -A aggregate frames are
+// enabled and the row CRCs after a mismatch are read in batches. With -w
+// the master enables the send window and keeps several requests in flight.
+//
+// Afterwards the simulated firmware talks to the master through the
+// functions it gets from firmware_entry, once as a firmware without and
+// once with extension (see sim_firmware.c).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sim.h"
+#include "sim_bootloader.h"
+#include "sim_master.h"
+#include "sim_update.h"
+#include "sim_firmware.h"
+
+#include "tfp_common.h"
+#include "configs/config.h"
+
+static uint8_t image[BOOTLOADER_FIRMWARE_SIZE];
+
+#ifdef BOOTLOADER_USE_PROFILING
+#include "profile.h"
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t probe;
+	bool clear;
+} __attribute__((__packed__)) GetProfileProbe;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+} __attribute__((__packed__)) GetProfileProbeReturn;
+
+// Reads the probes back through GET_PROFILE_PROBE, like on a real device
+static void sim_main_print_profile(SimMaster *master) {
+	static const char *names[PROFILE_PROBE_COUNT] = {
+		"spitfp parse", "handle message", "nvm erase row", "nvm write page", "firmware crc"
+	};
+
+	for(uint8_t i = 0; i < PROFILE_PROBE_COUNT; i++) {
+		GetProfileProbe gpp;
+		GetProfileProbeReturn gppr;
+		sim_master_header(&gpp, sizeof(gpp), SIM_MASTER_FID_GET_PROFILE_PROBE, true);
+		gpp.probe = i;
+		gpp.clear = false;
+		if(sim_master_call(master, &gpp, &gppr, 1000000000ULL) != SIM_MASTER_CALL_OK) {
+			fprintf(stderr, "GET_PROFILE_PROBE(%u) failed\n", i);
+			return;
+		}
+
+		printf("profile %-14s %6u calls, cycles min %u, avg %u, max %u\n", names[i], gppr.count,
+		       gppr.min, gppr.count > 0 ? (uint32_t)(gppr.total/gppr.count) : 0, gppr.max);
+	}
+}
+#endif
+
+#ifdef SPITFP_USE_STATISTICS
+typedef struct {
+	TFPMessageHeader header;
+} __attribute__((__packed__)) GetSPITFPErrorCount;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t error_count_ack_checksum;
+	uint32_t error_count_message_checksum;
+	uint32_t error_count_frame;
+	uint32_t error_count_overflow;
+} __attribute__((__packed__)) GetSPITFPErrorCountReturn;
+
+// The bootloader side of the link. The error counts are read through
+// GET_SPITFP_ERROR_COUNT, the throughput counters are not part of the API
+// and are taken directly from the extension.
+static void sim_main_print_spitfp_statistics(SimMaster *master) {
+	GetSPITFPErrorCount gsec;
+	GetSPITFPErrorCountReturn gsecr;
+	sim_master_header(&gsec, sizeof(gsec), SIM_MASTER_FID_GET_SPITFP_ERROR_COUNT, true);
+	if(sim_master_call(master, &gsec, &gsecr, 1000000000ULL) != SIM_MASTER_CALL_OK) {
+		fprintf(stderr, "GET_SPITFP_ERROR_COUNT failed\n");
+		return;
+	}
+
+	const SPITFPExtension *ext = spitfp_get_extension(&bootloader_status->st);
+	printf("spitfp rx %u frames/%u bytes, tx %u frames/%u bytes, %u resends\n",
+	       ext->frames_received, ext->bytes_received, ext->frames_sent, ext->bytes_sent, ext->resend_count);
+	printf("spitfp checksum errors %u ack/%u message, %u frame errors, %u overflows\n",
+	       gsecr.error_count_ack_checksum, gsecr.error_count_message_checksum, gsecr.error_count_frame, gsecr.error_count_overflow);
+}
+#endif
+
+int main(int argc, char **argv) {
+	uint32_t spi_clock = 1400000;
+	uint32_t poll_interval_us = 200;
+	uint32_t bit_error_interval = 0;
+	uint32_t code_size = BOOTLOADER_FIRMWARE_SIZE;
+	bool jumbo = false;
+	bool sparse = false;
+	bool verify_crc = false;
+	bool aggregate = false;
+	uint8_t send_window_size = 1;
+	int opt;
+
+	while((opt = getopt(argc, argv, "c:p:e:g:w:JSVA")) != -1) {
+		switch(opt) {
+			case 'c': spi_clock = strtoul(optarg, NULL, 0);          break;
+			case 'p': poll_interval_us = strtoul(optarg, NULL, 0);   break;
+			case 'e': bit_error_interval = strtoul(optarg, NULL, 0); break;
+			case 'g': code_size = strtoul(optarg, NULL, 0);          break;
+			case 'w': send_window_size = strtoul(optarg, NULL, 0);   break;
+			case 'J': jumbo = true;                                  break;
+			case 'S': sparse = true;                                 break;
+			case 'V': verify_crc = true;                             break;
+			case 'A': aggregate = true;                              break;
+			default: {
+				fprintf(stderr, "Usage: %s [-c spi_clock_hz] [-p poll_interval_us] [-e bit_error_interval] [-g code_size] [-w send_window_size] [-J] [-S] [-V] [-A] [firmware.bin]\n", argv[0]);
+				return 2;
+			}
+		}
+	}
+
+	if(optind < argc) {
+		if(!sim_update_load_image(image, argv[optind])) {
+			return 2;
+		}
+	} else {
+		sim_update_generate_image(image, code_size);
+	}
+
+	SimConfig config;
+	sim_get_config_defaults(&config);
+	config.spi_bit_error_interval = bit_error_interval;
+	if(!sim_init(&config)) {
+		return 2;
+	}
+
+	if(sim_bootloader_start() == TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK) {
+		fprintf(stderr, "Empty flash has a valid firmware\n");
+		return 1;
+	}
+
+	SimMaster master;
+	sim_master_init(&master, spi_clock);
+	master.poll_interval_ns = poll_interval_us*1000;
+
+	uint8_t features = 0;
+	if(jumbo || aggregate || (send_window_size > 1)) {
+		features = sim_update_set_spitfp_features(&master, (jumbo ? SPITFP_FEATURE_JUMBO : 0) | (aggregate ? SPITFP_FEATURE_AGGREGATE : 0) |
+		                                          ((send_window_size > 1) ? SPITFP_FEATURE_SEND_WINDOW : 0), send_window_size);
+	}
+	const uint8_t chunks = sim_update_get_chunks(features);
+	send_window_size = master.send_window_size; // What the bootloader supports
+
+	const uint64_t start = sim_get_time();
+	const bool flashed = sim_update_flash(&master, image, BOOTLOADER_FIRMWARE_SIZE, chunks, sparse);
+	const uint64_t flash_time = sim_get_time() - start;
+#ifdef BOOTLOADER_USE_PROFILING
+	if(flashed) {
+		sim_main_print_profile(&master);
+	}
+#endif
+#ifdef SPITFP_USE_STATISTICS
+	if(flashed) {
+		sim_main_print_spitfp_statistics(&master);
+	}
+#endif
+
+	const bool crc_verified = flashed && (!verify_crc || sim_update_verify_crc(&master, image, BOOTLOADER_FIRMWARE_SIZE, (features & SPITFP_FEATURE_AGGREGATE) != 0));
+	const bool restart_checked = crc_verified && sim_update_check_master_restart(&master);
+	const bool started = restart_checked && sim_update_reboot_to_firmware(&master);
+	const bool verified = sim_update_verify(image, BOOTLOADER_FIRMWARE_SIZE);
+	const bool firmware_mode = started && verified &&
+	                           sim_firmware_check(spi_clock, master.poll_interval_ns, false) &&
+	                           sim_firmware_check(spi_clock, master.poll_interval_ns, true);
+
+	const SimStats *stats = sim_get_stats();
+	printf("firmware size:     %d bytes\n", BOOTLOADER_FIRMWARE_SIZE);
+	printf("spi clock:         %u Hz\n", spi_clock);
+	printf("write chunks:      %u per WRITE_FIRMWARE%s\n", chunks, sparse ? ", sparse" : "");
+	printf("send window:       %u\n", send_window_size);
+	printf("flash time:        %.3f ms (simulated)\n", flash_time/1000000.0);
+	printf("throughput:        %.0f bytes/s\n", flash_time > 0 ? BOOTLOADER_FIRMWARE_SIZE*1000000000.0/flash_time : 0.0);
+	printf("transactions:      %u (%u polls, %u bytes)\n", master.transactions, master.polls, master.bytes);
+	printf("resends:           %u\n", master.resends);
+	printf("checksum errors:   %u\n", master.checksum_errors);
+	printf("bit errors:        %u (mosi)\n", stats->spi_bit_errors);
+	printf("nvm erase/write:   %u/%u (%u errors, %u writes without erase)\n", stats->nvm_erases, stats->nvm_writes, stats->nvm_errors, stats->nvm_write_without_erase);
+	if(verify_crc) {
+		printf("crc verify:        %s\n", crc_verified ? "ok" : "failed");
+	}
+	printf("master restart:    %s\n", restart_checked ? "ok" : "failed");
+	printf("firmware mode:     %s\n", firmware_mode ? "ok" : "failed");
+	printf("result:            %s\n", !started ? "failed" : !verified ? "flash content differs" : "firmware started");
+
+	return (started && verified && firmware_mode && restart_checked) ? 0 : 1;
+}
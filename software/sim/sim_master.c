@@ -0,0 +1,544 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * sim_master.c: SPITFP master (Brick side) for the host simulation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// The master implements the SPITFP protocol as described in
+// bootloader_spitfp.c without send window, with the Pearson checksum or
+// the CRC checksum (after SET_SPITFP_CONFIG): Poll with a NoData byte if
+// there is nothing to send, ACK every data packet, re-send after a timeout
+// and only send the next packet after the ACK. A transaction is extended
+// with NoData bytes until a packet from the slave that started during the
+// transaction is complete.
+//
+// With a send window (sim_master_call_window) up to send_window_size
+// packets are in flight, they are sent back-to-back. ACKs are cumulative
+// and after a timeout all packets in flight are sent again (go-back-N).
+// As long as send_window_size > 1 only the packet after the last one seen
+// is new, like in the bootloader. A new packet is not taken (and not
+// ACKed) as long as the last message was not picked up.
+
+#include "sim_master.h"
+
+#include <string.h>
+
+#include "sim.h"
+#include "sim_bootloader.h"
+
+#include "bricklib2/utility/pearson_hash.h"
+
+// Same CRCs as the DMAC: CRC-16-CCITT and IEEE 802.3 CRC-32, both with
+// start value 0xFFFF(FFFF) and in little endian behind the frame
+static uint32_t sim_master_crc(const uint8_t *data, const uint8_t length, const uint8_t checksum_size) {
+	uint32_t crc = 0xFFFFFFFF;
+	for(uint8_t i = 0; i < length; i++) {
+		if(checksum_size == 4) {
+			crc ^= data[i];
+			for(uint8_t bit = 0; bit < 8; bit++) {
+				crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+			}
+		} else {
+			crc ^= data[i] << 8;
+			for(uint8_t bit = 0; bit < 8; bit++) {
+				crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+			}
+			crc &= 0xFFFF;
+		}
+	}
+
+	return (checksum_size == 4) ? ~crc : crc;
+}
+
+static uint8_t sim_master_get_overhead(SimMaster *master) {
+	return SIM_MASTER_PROTOCOL_OVERHEAD - 1 + master->checksum_size;
+}
+
+// Writes the checksum behind the frame, the length is already in frame[0]
+static void sim_master_write_checksum(SimMaster *master, uint8_t *frame) {
+	const uint8_t length = frame[0] - master->checksum_size;
+	if(master->checksum_size == 1) {
+		uint8_t checksum = 0;
+		for(uint8_t i = 0; i < length; i++) {
+			PEARSON(checksum, frame[i]);
+		}
+		frame[length] = checksum;
+		return;
+	}
+
+	uint32_t crc = sim_master_crc(frame, length, master->checksum_size);
+	for(uint8_t i = 0; i < master->checksum_size; i++) {
+		frame[length + i] = crc & 0xFF;
+		crc >>= 8;
+	}
+}
+
+static bool sim_master_is_checksum_valid(SimMaster *master, const uint8_t *frame) {
+	uint8_t expected[SIM_MASTER_FRAME_MAX_LENGTH];
+	memcpy(expected, frame, frame[0]);
+	sim_master_write_checksum(master, expected);
+
+	return memcmp(expected, frame, frame[0]) == 0;
+}
+
+void sim_master_init(SimMaster *master, const uint32_t spi_clock) {
+	memset(master, 0, sizeof(SimMaster));
+	master->spi_clock = spi_clock;
+	master->poll_interval_ns = 200000;
+	master->timeout_ns = 20000000;
+	master->checksum_size = 1;
+	master->send_window_size = 1;
+	master->current_sequence_number = 1;
+	master->tfp_sequence_number = 1;
+}
+
+void sim_master_header(void *message, const uint8_t length, const uint8_t fid, const bool return_expected) {
+	TFPMessageHeader *header = message;
+	memset(header, 0, sizeof(TFPMessageHeader));
+	header->uid = 0;
+	header->length = length;
+	header->fid = fid;
+	header->return_expected = return_expected;
+}
+
+// ACKs are cumulative, the packet with the given sequence number and all
+// packets before it are removed from the window
+static void sim_master_window_handle_ack(SimMaster *master, const uint8_t sequence_number) {
+	for(uint8_t i = 0; i < master->window_frames; i++) {
+		if(master->window[i].sent && (master->window[i].sequence_number == sequence_number)) {
+			master->window_frames -= i + 1;
+			memmove(&master->window[0], &master->window[i + 1], master->window_frames*sizeof(SimMasterWindowFrame));
+			master->window_time = sim_get_time();
+			return;
+		}
+	}
+}
+
+// Appends all packets of the window that were not sent yet (after a
+// timeout all of them) to frames, returns the length
+static uint16_t sim_master_window_build(SimMaster *master, uint8_t *frames, const uint64_t now) {
+	if((master->window_frames > 0) && master->window[0].sent && (now - master->window_time >= master->timeout_ns)) {
+		for(uint8_t i = 0; i < master->window_frames; i++) {
+			if(master->window[i].sent) {
+				master->window[i].sent = false;
+				master->resends++;
+			}
+		}
+	}
+
+	uint16_t length = 0;
+	for(uint8_t i = 0; i < master->window_frames; i++) {
+		SimMasterWindowFrame *window_frame = &master->window[i];
+		if(window_frame->sent) {
+			continue;
+		}
+
+		// Data packet, also ACKs the last packet seen
+		uint8_t *frame = &frames[length];
+		frame[0] = window_frame->length + sim_master_get_overhead(master);
+		frame[1] = window_frame->sequence_number | (master->last_sequence_number_seen << 4);
+		memcpy(&frame[2], window_frame->message, window_frame->length);
+		sim_master_write_checksum(master, frame);
+		length += frame[0];
+
+		if(i == 0) {
+			master->window_time = now;
+		}
+		window_frame->sent = true;
+	}
+
+	return length;
+}
+
+static void sim_master_handle_frame(SimMaster *master) {
+	const uint8_t *frame = master->recv_frame;
+	const uint8_t length = frame[0];
+	const uint8_t overhead = sim_master_get_overhead(master);
+
+	if(!sim_master_is_checksum_valid(master, frame)) {
+		master->checksum_errors++;
+		return;
+	}
+
+	// ACK for our packet (separate or in a data packet)
+	if(master->send_in_flight && ((frame[1] >> 4) == master->current_sequence_number)) {
+		master->send_in_flight = false;
+		master->send_length = 0;
+		master->current_sequence_number = (master->current_sequence_number % 0xF) + 1;
+	}
+
+	sim_master_window_handle_ack(master, frame[1] >> 4);
+
+	if(length == overhead) {
+		return;
+	}
+
+	const uint8_t sequence_number = frame[1] & 0x0F;
+	const uint8_t next_sequence_number = (master->last_sequence_number_seen % 0xF) + 1;
+	if((master->send_window_size > 1) && (master->last_sequence_number_seen != 0) &&
+	   (sequence_number != next_sequence_number)) {
+		// Duplicates are ACKed again, packets behind a lost one are dropped
+		if(sequence_number == master->last_sequence_number_seen) {
+			master->ack_pending = true;
+		}
+		return;
+	}
+
+	if(sequence_number == master->last_sequence_number_seen) {
+		// Duplicates are ACKed again, the slave did not see our ACK
+		master->ack_pending = true;
+		return;
+	}
+
+	if(master->recv_length > 0) {
+		// No room, the slave sends it again
+		return;
+	}
+
+	master->ack_pending = true;
+	master->last_sequence_number_seen = sequence_number;
+	master->recv_length = length - overhead;
+	memcpy(master->recv_message, frame + 2, master->recv_length);
+}
+
+static void sim_master_parse(SimMaster *master, const uint8_t data) {
+	const uint8_t overhead = sim_master_get_overhead(master);
+	if(master->recv_position == 0) {
+		if(data == 0) {
+			return; // NoData
+		}
+
+		if((data < overhead) || (data > SIM_MASTER_MESSAGE_MAX_LENGTH + overhead) ||
+		   ((data > overhead) && (data < overhead + TFP_MESSAGE_MIN_LENGTH))) {
+			master->frame_errors++;
+			return;
+		}
+	}
+
+	master->recv_frame[master->recv_position++] = data;
+	if(master->recv_position == master->recv_frame[0]) {
+		master->recv_position = 0;
+		sim_master_handle_frame(master);
+	}
+}
+
+static uint8_t sim_master_transfer_byte(SimMaster *master, const uint8_t mosi) {
+	const uint8_t miso = sim_spi_transfer_byte(mosi);
+	master->bytes++;
+	sim_advance(8ULL*1000000000ULL/master->spi_clock);
+	sim_master_parse(master, miso);
+
+	return miso;
+}
+
+static void sim_master_add_latency(SimMasterLatency *latency, const uint64_t ns) {
+	if((latency->calls == 0) || (ns < latency->min_ns)) {
+		latency->min_ns = ns;
+	}
+	if(ns > latency->max_ns) {
+		latency->max_ns = ns;
+	}
+	latency->total_ns += ns;
+	latency->calls++;
+
+	uint8_t bucket = 0;
+	for(uint64_t us = ns/1000; (us > 1) && (bucket < SIM_MASTER_LATENCY_BUCKETS-1); us >>= 1) {
+		bucket++;
+	}
+	latency->histogram[bucket]++;
+}
+
+void sim_master_transaction(SimMaster *master) {
+	uint8_t frame[SIM_MASTER_SEND_WINDOW_MAX*SIM_MASTER_FRAME_MAX_LENGTH];
+	uint16_t length;
+	const uint64_t now = sim_get_time();
+
+	if((master->window_frames > 0) && ((length = sim_master_window_build(master, frame, now)) > 0)) {
+		master->ack_pending = false;
+	} else if((master->send_length > 0) && (!master->send_in_flight || (now - master->send_time >= master->timeout_ns))) {
+		if(master->send_in_flight) {
+			master->resends++;
+		}
+
+		// Data packet, also ACKs the last packet seen
+		length = master->send_length + sim_master_get_overhead(master);
+		frame[0] = length;
+		frame[1] = master->current_sequence_number | (master->last_sequence_number_seen << 4);
+		memcpy(&frame[2], master->send_message, master->send_length);
+		sim_master_write_checksum(master, frame);
+
+		master->send_in_flight = true;
+		master->send_time = now;
+		master->ack_pending = false;
+	} else if(master->ack_pending) {
+		length = sim_master_get_overhead(master);
+		frame[0] = length;
+		frame[1] = master->last_sequence_number_seen << 4;
+		sim_master_write_checksum(master, frame);
+
+		master->ack_pending = false;
+	} else {
+		length = 1;
+		frame[0] = 0;
+		master->polls++;
+	}
+
+	master->transactions++;
+
+	// Only NoData bytes from the slave and nothing sent: Idle poll
+	bool idle = length == 1;
+
+	sim_spi_select(true);
+	for(uint16_t i = 0; i < length; i++) {
+		if(sim_master_transfer_byte(master, frame[i]) != 0) {
+			idle = false;
+		}
+	}
+
+	while(master->recv_position > 0) {
+		sim_master_transfer_byte(master, 0);
+	}
+	sim_spi_select(false);
+
+	if(idle) {
+		master->idle_transactions++;
+	}
+}
+
+// One transaction with the given bytes instead of a frame, e.g. garbage
+// on the cable. Frames from the slave are received as usual.
+void sim_master_transfer(SimMaster *master, const uint8_t *data, const uint16_t length) {
+	master->transactions++;
+
+	sim_spi_select(true);
+	for(uint16_t i = 0; i < length; i++) {
+		sim_master_transfer_byte(master, data[i]);
+	}
+
+	while(master->recv_position > 0) {
+		sim_master_transfer_byte(master, 0);
+	}
+	sim_spi_select(false);
+}
+
+// Sends request and waits for the response (if return expected) or the ACK.
+// The bootloader runs between the transactions.
+uint8_t sim_master_call(SimMaster *master, const void *request, void *response, const uint64_t timeout_ns) {
+	TFPMessageHeader *header = (TFPMessageHeader *)master->send_message;
+	memcpy(master->send_message, request, ((const TFPMessageHeader *)request)->length);
+	header->sequence_num = master->tfp_sequence_number;
+	master->tfp_sequence_number = (master->tfp_sequence_number % 0xF) + 1;
+	master->send_length = header->length;
+	master->send_in_flight = false;
+
+	const uint64_t start = sim_get_time();
+	const uint64_t end = start + timeout_ns;
+	while(sim_get_time() < end) {
+		sim_master_transaction(master);
+
+		if(master->recv_length > 0) {
+			const TFPMessageHeader *recv_header = (const TFPMessageHeader *)master->recv_message;
+			const uint8_t recv_length = master->recv_length;
+			master->recv_length = 0;
+
+			// Everything else (e.g. enumerate callbacks) is dropped
+			if(header->return_expected &&
+			   (recv_header->fid == header->fid) &&
+			   (recv_header->sequence_num == header->sequence_num)) {
+				if(recv_header->error != TFP_MESSAGE_ERROR_CODE_OK) {
+					return SIM_MASTER_CALL_ERROR;
+				}
+
+				if(response != NULL) {
+					memcpy(response, master->recv_message, recv_length);
+				}
+				sim_master_add_latency(&master->latency_response, sim_get_time() - start);
+				return SIM_MASTER_CALL_OK;
+			}
+		}
+
+		if(!header->return_expected && (master->send_length == 0)) {
+			sim_master_add_latency(&master->latency_ack, sim_get_time() - start);
+			return SIM_MASTER_CALL_OK;
+		}
+
+		// Answer right away if there is something to send
+		uint64_t next = sim_get_time() + 1;
+		if(!master->ack_pending && ((master->send_length == 0) || master->send_in_flight)) {
+			next += master->poll_interval_ns;
+		}
+
+		if(sim_bootloader_run_until(next) == SIM_BOOTLOADER_RESET) {
+			return SIM_MASTER_CALL_RESET;
+		}
+	}
+
+	return SIM_MASTER_CALL_TIMEOUT;
+}
+
+// Sends count requests in separate packets with up to send_window_size
+// packets in flight (the master has to enable SPITFP_FEATURE_SEND_WINDOW
+// with SET_SPITFP_CONFIG first). Returns when all requests are ACKed and
+// all expected responses arrived, responses[i] gets the one for
+// requests[i] (or NULL). ERROR if one of them has an error code.
+uint8_t sim_master_call_window(SimMaster *master, const void *const *requests, const uint8_t count, void *const *responses, const uint64_t timeout_ns) {
+	uint8_t sequence_numbers[SIM_MASTER_WINDOW_CALL_MAX];
+	bool answered[SIM_MASTER_WINDOW_CALL_MAX] = {false};
+	uint8_t expected = 0;
+	uint8_t answered_count = 0;
+	uint8_t queued = 0;
+	bool error = false;
+
+	for(uint8_t i = 0; i < count; i++) {
+		if(((const TFPMessageHeader *)requests[i])->return_expected) {
+			expected++;
+		}
+	}
+
+	const uint64_t start = sim_get_time();
+	const uint64_t end = start + timeout_ns;
+	while(sim_get_time() < end) {
+		while((queued < count) && (master->window_frames < master->send_window_size)) {
+			SimMasterWindowFrame *window_frame = &master->window[master->window_frames++];
+			TFPMessageHeader *header = (TFPMessageHeader *)window_frame->message;
+			memcpy(window_frame->message, requests[queued], ((const TFPMessageHeader *)requests[queued])->length);
+			header->sequence_num = master->tfp_sequence_number;
+			master->tfp_sequence_number = (master->tfp_sequence_number % 0xF) + 1;
+			window_frame->length = header->length;
+			window_frame->sequence_number = master->current_sequence_number;
+			window_frame->sent = false;
+			master->current_sequence_number = (master->current_sequence_number % 0xF) + 1;
+			sequence_numbers[queued++] = header->sequence_num;
+		}
+
+		sim_master_transaction(master);
+
+		if(master->recv_length > 0) {
+			const TFPMessageHeader *recv_header = (const TFPMessageHeader *)master->recv_message;
+			const uint8_t recv_length = master->recv_length;
+			master->recv_length = 0;
+
+			// Everything else (e.g. enumerate callbacks) is dropped
+			for(uint8_t i = 0; i < queued; i++) {
+				const TFPMessageHeader *header = requests[i];
+				if(header->return_expected && !answered[i] &&
+				   (recv_header->fid == header->fid) &&
+				   (recv_header->sequence_num == sequence_numbers[i])) {
+					if(recv_header->error != TFP_MESSAGE_ERROR_CODE_OK) {
+						error = true;
+					} else if(responses[i] != NULL) {
+						memcpy(responses[i], master->recv_message, recv_length);
+					}
+					answered[i] = true;
+					answered_count++;
+					break;
+				}
+			}
+		}
+
+		if((queued == count) && (master->window_frames == 0) && (answered_count == expected)) {
+			sim_master_add_latency(expected > 0 ? &master->latency_response : &master->latency_ack, sim_get_time() - start);
+			return error ? SIM_MASTER_CALL_ERROR : SIM_MASTER_CALL_OK;
+		}
+
+		// Answer right away if there is something to send
+		uint64_t next = sim_get_time() + 1;
+		if(!master->ack_pending && ((queued == count) || (master->window_frames == master->send_window_size))) {
+			next += master->poll_interval_ns;
+		}
+
+		if(sim_bootloader_run_until(next) == SIM_BOOTLOADER_RESET) {
+			return SIM_MASTER_CALL_RESET;
+		}
+	}
+
+	return SIM_MASTER_CALL_TIMEOUT;
+}
+
+// Sends count requests back to back in one aggregate frame (the bootloader
+// needs SPITFP_USE_AGGREGATE_FRAMES and the master has to enable it with
+// SET_SPITFP_CONFIG). All requests have to expect a response, responses[i]
+// gets the one for requests[i] (or NULL). The responses arrive together in
+// one frame, ERROR if one of them has an error code or is missing.
+uint8_t sim_master_call_aggregate(SimMaster *master, const void *const *requests, const uint8_t count, void *const *responses, const uint64_t timeout_ns) {
+	uint8_t sequence_numbers[SIM_MASTER_MESSAGE_MAX_LENGTH/TFP_MESSAGE_MIN_LENGTH];
+	uint8_t length = 0;
+	for(uint8_t i = 0; i < count; i++) {
+		TFPMessageHeader *header = (TFPMessageHeader *)&master->send_message[length];
+		memcpy(header, requests[i], ((const TFPMessageHeader *)requests[i])->length);
+		header->sequence_num = master->tfp_sequence_number;
+		sequence_numbers[i] = header->sequence_num;
+		master->tfp_sequence_number = (master->tfp_sequence_number % 0xF) + 1;
+		length += header->length;
+	}
+	master->send_length = length;
+	master->send_in_flight = false;
+
+	const uint64_t start = sim_get_time();
+	const uint64_t end = start + timeout_ns;
+	while(sim_get_time() < end) {
+		sim_master_transaction(master);
+
+		if(master->recv_length > 0) {
+			const uint8_t recv_length = master->recv_length;
+			master->recv_length = 0;
+
+			uint8_t answered = 0;
+			bool error = false;
+			for(uint8_t offset = 0; offset + sizeof(TFPMessageHeader) <= recv_length;) {
+				const TFPMessageHeader *recv_header = (const TFPMessageHeader *)&master->recv_message[offset];
+				if((recv_header->length < sizeof(TFPMessageHeader)) || (offset + recv_header->length > recv_length)) {
+					break;
+				}
+
+				// Everything else (e.g. enumerate callbacks) is dropped
+				for(uint8_t i = 0; i < count; i++) {
+					if((recv_header->fid == ((const TFPMessageHeader *)requests[i])->fid) &&
+					   (recv_header->sequence_num == sequence_numbers[i])) {
+						if(recv_header->error != TFP_MESSAGE_ERROR_CODE_OK) {
+							error = true;
+						} else if(responses[i] != NULL) {
+							memcpy(responses[i], recv_header, recv_header->length);
+						}
+						answered++;
+						break;
+					}
+				}
+
+				offset += recv_header->length;
+			}
+
+			if(answered > 0) {
+				sim_master_add_latency(&master->latency_response, sim_get_time() - start);
+				return (error || (answered != count)) ? SIM_MASTER_CALL_ERROR : SIM_MASTER_CALL_OK;
+			}
+		}
+
+		// Answer right away if there is something to send
+		uint64_t next = sim_get_time() + 1;
+		if(!master->ack_pending && ((master->send_length == 0) || master->send_in_flight)) {
+			next += master->poll_interval_ns;
+		}
+
+		if(sim_bootloader_run_until(next) == SIM_BOOTLOADER_RESET) {
+			return SIM_MASTER_CALL_RESET;
+		}
+	}
+
+	return SIM_MASTER_CALL_TIMEOUT;
+}
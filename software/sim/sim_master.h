@@ -0,0 +1,124 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * sim_master.h: SPITFP master (Brick side) for the host simulation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef SIM_MASTER_H
+#define SIM_MASTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bricklib2/protocols/tfp/tfp.h"
+
+#define SIM_MASTER_PROTOCOL_OVERHEAD     3
+#define SIM_MASTER_MAX_PROTOCOL_OVERHEAD 6 // CRC-32 (SPITFP_USE_DMAC_CRC)
+#define SIM_MASTER_MESSAGE_MAX_LENGTH    200 // Jumbo frames (SPITFP_USE_JUMBO_FRAMES)
+#define SIM_MASTER_FRAME_MAX_LENGTH      (SIM_MASTER_MESSAGE_MAX_LENGTH + SIM_MASTER_MAX_PROTOCOL_OVERHEAD)
+#define SIM_MASTER_SEND_WINDOW_MAX       4 // Frames in flight with SPITFP_FEATURE_SEND_WINDOW
+#define SIM_MASTER_WINDOW_CALL_MAX       16 // Requests per sim_master_call_window
+
+#define SIM_MASTER_CALL_OK      0
+#define SIM_MASTER_CALL_TIMEOUT 1
+#define SIM_MASTER_CALL_RESET   2
+#define SIM_MASTER_CALL_ERROR   3 // Response with error code
+
+// Bucket n counts calls with a latency of [2^n, 2^(n+1)) us, the
+// first one includes everything below and the last one everything above
+#define SIM_MASTER_LATENCY_BUCKETS 16
+
+// Bootloader function ids, as used by brickv
+#define SIM_MASTER_FID_GET_FIRMWARE_CRC           220
+#define SIM_MASTER_FID_ERASE_FIRMWARE             221
+#define SIM_MASTER_FID_GET_PROFILE_PROBE          222
+#define SIM_MASTER_FID_SET_SPITFP_CONFIG          226
+#define SIM_MASTER_FID_GET_SPITFP_ERROR_COUNT     234
+#define SIM_MASTER_FID_SET_BOOTLOADER_MODE        235
+#define SIM_MASTER_FID_GET_BOOTLOADER_MODE        236
+#define SIM_MASTER_FID_SET_WRITE_FIRMWARE_POINTER 237
+#define SIM_MASTER_FID_WRITE_FIRMWARE             238
+#define SIM_MASTER_FID_RESET                      243
+#define SIM_MASTER_FID_ENUMERATE                  254
+#define SIM_MASTER_FID_GET_IDENTITY               255
+
+typedef struct {
+	uint32_t calls;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t total_ns;
+	uint32_t histogram[SIM_MASTER_LATENCY_BUCKETS];
+} SimMasterLatency;
+
+typedef struct {
+	uint8_t message[SIM_MASTER_MESSAGE_MAX_LENGTH];
+	uint8_t length;
+	uint8_t sequence_number;
+	bool sent;                 // Sent since the last (re-)send of the window
+} SimMasterWindowFrame;
+
+typedef struct {
+	uint32_t spi_clock;        // in Hz
+	uint32_t poll_interval_ns; // Pause between two transactions if nothing is to send
+	uint32_t timeout_ns;       // Re-send if there is no ACK after this time
+	uint8_t checksum_size;     // 1 (Pearson), 2 (CRC-16) or 4 (CRC-32)
+	uint8_t send_window_size;  // > 1 after SET_SPITFP_CONFIG with SPITFP_FEATURE_SEND_WINDOW
+
+	uint8_t current_sequence_number;
+	uint8_t last_sequence_number_seen;
+	uint8_t tfp_sequence_number;
+
+	uint8_t send_message[SIM_MASTER_MESSAGE_MAX_LENGTH];
+	uint8_t send_length;       // 0 = nothing to send
+	bool send_in_flight;       // Sent at least once, waiting for ACK
+	uint64_t send_time;
+	bool ack_pending;
+
+	// Only used by sim_master_call_window, ordered by sequence number
+	SimMasterWindowFrame window[SIM_MASTER_SEND_WINDOW_MAX];
+	uint8_t window_frames;
+	uint64_t window_time;      // Last (re-)send of the oldest frame
+
+	uint8_t recv_frame[SIM_MASTER_FRAME_MAX_LENGTH];
+	uint8_t recv_position;
+	uint8_t recv_message[SIM_MASTER_MESSAGE_MAX_LENGTH];
+	uint8_t recv_length;       // 0 = no new message
+
+	uint32_t transactions;
+	uint32_t polls;
+	uint32_t bytes;
+	uint32_t resends;
+	uint32_t checksum_errors;
+	uint32_t frame_errors;
+	uint32_t idle_transactions; // No frame in either direction
+
+	// Time from the first try of a request to its ACK (no return
+	// expected) or to its response
+	SimMasterLatency latency_ack;
+	SimMasterLatency latency_response;
+} SimMaster;
+
+void sim_master_init(SimMaster *master, const uint32_t spi_clock);
+void sim_master_transaction(SimMaster *master);
+void sim_master_transfer(SimMaster *master, const uint8_t *data, const uint16_t length);
+uint8_t sim_master_call(SimMaster *master, const void *request, void *response, const uint64_t timeout_ns);
+uint8_t sim_master_call_window(SimMaster *master, const void *const *requests, const uint8_t count, void *const *responses, const uint64_t timeout_ns);
+uint8_t sim_master_call_aggregate(SimMaster *master, const void *const *requests, const uint8_t count, void *const *responses, const uint64_t timeout_ns);
+void sim_master_header(void *message, const uint8_t length, const uint8_t fid, const bool return_expected);
+
+#endif
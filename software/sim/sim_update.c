@@ -0,0 +1,522 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * sim_update.c: Firmware update sequence of the simulated master
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+// The same sequence brickv uses: SET_WRITE_FIRMWARE_POINTER and
+// WRITE_FIRMWARE for every 64 byte chunk, then SET_BOOTLOADER_MODE to
+// start the firmware. With jumbo frames WRITE_FIRMWARE carries several
+// chunks at once. In sparse mode the firmware is erased with ERASE_FIRMWARE
+// first and chunks that are completely erased (0xFF) are not sent. With
+// aggregate frames the row CRCs for the verification are read five at once.
+// With a send window the pointer/write pairs of several chunks are sent
+// without waiting for the responses in between.
+
+#include "sim_update.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sim.h"
+#include "sim_bootloader.h"
+
+#include "tfp_common.h"
+#include "bootloader_spitfp.h"
+#include "configs/config.h"
+
+#define SIM_UPDATE_TIMEOUT 1000000000ULL // 1s
+#define SIM_UPDATE_ROW_SIZE (NVMCTRL_ROW_PAGES*SIM_UPDATE_CHUNK_SIZE)
+#define SIM_UPDATE_MAX_CHUNKS ((SIM_MASTER_MESSAGE_MAX_LENGTH - sizeof(TFPMessageHeader)) / SIM_UPDATE_CHUNK_SIZE)
+#define SIM_UPDATE_CRC_BATCH 5 // GET_FIRMWARE_CRC requests in one aggregate frame (5*16 bytes)
+#define SIM_UPDATE_GARBAGE_LENGTH (SPITFP_CONFIG_FALLBACK_ERRORS + 16)
+#define SIM_UPDATE_WINDOW_BATCH (SIM_MASTER_WINDOW_CALL_MAX/2) // WRITE_FIRMWARE (with pointer) per sim_master_call_window
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t pointer;
+} __attribute__((__packed__)) SetWriteFirmwarePointer;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t features;
+	uint8_t send_window_size;
+} __attribute__((__packed__)) SetSPITFPConfig;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t features;
+	uint8_t send_window_size;
+} __attribute__((__packed__)) SetSPITFPConfigReturn;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t data[SIM_UPDATE_MAX_CHUNKS*SIM_UPDATE_CHUNK_SIZE];
+} __attribute__((__packed__)) WriteFirmware;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t status;
+} __attribute__((__packed__)) WriteFirmwareReturn;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t pointer;
+	uint8_t row_count;
+} __attribute__((__packed__)) EraseFirmware;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t status;
+} __attribute__((__packed__)) EraseFirmwareReturn;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t pointer;
+	uint32_t length;
+} __attribute__((__packed__)) GetFirmwareCRC;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t crc;
+} __attribute__((__packed__)) GetFirmwareCRCReturn;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t mode;
+} __attribute__((__packed__)) SetBootloaderMode;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t status;
+} __attribute__((__packed__)) SetBootloaderModeReturn;
+
+static uint32_t sim_update_crc32(const uint8_t *data, const uint32_t length) {
+	uint32_t crc = 0xFFFFFFFF;
+	for(uint32_t i = 0; i < length; i++) {
+		crc ^= data[i];
+		for(uint8_t j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+
+	return ~crc;
+}
+
+// code_size bytes of pseudo random code, then 0xFF up to the firmware
+// configuration at the end. image has to be BOOTLOADER_FIRMWARE_SIZE bytes.
+void sim_update_generate_image(uint8_t *image, const uint32_t code_size) {
+	uint32_t state = 0x12345678;
+	memset(image, 0xFF, BOOTLOADER_FIRMWARE_SIZE);
+	for(uint32_t i = 0; (i < code_size) && (i < BOOTLOADER_FIRMWARE_SIZE); i++) {
+		state = state*1103515245 + 12345;
+		image[i] = state >> 24;
+	}
+
+	BootloaderFirmwareConfiguration *config = (BootloaderFirmwareConfiguration *)&image[BOOTLOADER_FIRMWARE_SIZE - sizeof(BootloaderFirmwareConfiguration)];
+	config->firmware_version  = (2 << 16) | (0 << 8) | 0;
+	config->device_identifier = BOOTLOADER_DEVICE_IDENTIFIER;
+	config->firmware_crc      = sim_update_crc32(image, BOOTLOADER_FIRMWARE_SIZE - BOOTLOADER_FIRMWARE_CRC_SIZE);
+}
+
+// image has to be BOOTLOADER_FIRMWARE_SIZE bytes, the rest is filled with 0xFF
+bool sim_update_load_image(uint8_t *image, const char *path) {
+	FILE *f = fopen(path, "rb");
+	if(f == NULL) {
+		perror(path);
+		return false;
+	}
+
+	memset(image, 0xFF, BOOTLOADER_FIRMWARE_SIZE);
+	const size_t length = fread(image, 1, BOOTLOADER_FIRMWARE_SIZE, f);
+	const bool too_long = fgetc(f) != EOF;
+	fclose(f);
+
+	if(length == 0 || too_long) {
+		fprintf(stderr, "%s: Firmware has to be 1 to %d bytes\n", path, BOOTLOADER_FIRMWARE_SIZE);
+		return false;
+	}
+
+	return true;
+}
+
+// Enables the SPITFP_FEATURE_* features and returns the ones the
+// bootloader supports (0 if it does not know SET_SPITFP_CONFIG)
+uint8_t sim_update_set_spitfp_features(SimMaster *master, const uint8_t features, const uint8_t send_window_size) {
+	SetSPITFPConfig ssc;
+	SetSPITFPConfigReturn sscr;
+	sim_master_header(&ssc, sizeof(ssc), SIM_MASTER_FID_SET_SPITFP_CONFIG, true);
+	ssc.features = features;
+	ssc.send_window_size = send_window_size;
+
+	// The bootloader keeps send window and checksum as long as one of its
+	// frames is not ACKed (e.g. the enumerate callback after the start),
+	// in that case we try again after the ACK
+	const uint8_t send_features = SPITFP_FEATURE_SEND_WINDOW | SPITFP_FEATURE_CRC16 | SPITFP_FEATURE_CRC32;
+	for(uint8_t i = 0; i < 2; i++) {
+		if(sim_master_call(master, &ssc, &sscr, SIM_UPDATE_TIMEOUT) != SIM_MASTER_CALL_OK) {
+			return 0;
+		}
+
+		if((features & send_features & ~sscr.features) == 0) {
+			break;
+		}
+	}
+
+	if(sscr.features & SPITFP_FEATURE_SEND_WINDOW) {
+		master->send_window_size = (sscr.send_window_size > SIM_MASTER_SEND_WINDOW_MAX) ? SIM_MASTER_SEND_WINDOW_MAX : sscr.send_window_size;
+	} else {
+		master->send_window_size = 1;
+	}
+
+	// Everything after the response uses the new checksum
+	if(sscr.features & SPITFP_FEATURE_CRC32) {
+		master->checksum_size = 4;
+	} else if(sscr.features & SPITFP_FEATURE_CRC16) {
+		master->checksum_size = 2;
+	} else {
+		master->checksum_size = 1;
+	}
+
+	return sscr.features;
+}
+
+static bool sim_update_get_identity(SimMaster *master) {
+	TFPMessageHeader gi;
+	uint8_t gir[SIM_MASTER_MESSAGE_MAX_LENGTH];
+	sim_master_header(&gi, sizeof(gi), SIM_MASTER_FID_GET_IDENTITY, true);
+
+	return sim_master_call(master, &gi, gir, SIM_UPDATE_TIMEOUT) == SIM_MASTER_CALL_OK;
+}
+
+// Like a restart of brickd: Same SPI clock and poll interval, the protocol
+// starts from the beginning. The statistics are kept. The ACK for the last
+// response is sent before, otherwise the new master sees the re-send with
+// the old checksum.
+static void sim_update_restart_master(SimMaster *master) {
+	if(master->ack_pending) {
+		sim_master_transaction(master);
+		sim_bootloader_run_until(sim_get_time() + master->poll_interval_ns);
+	}
+
+	SimMaster restarted;
+	sim_master_init(&restarted, master->spi_clock);
+	restarted.poll_interval_ns = master->poll_interval_ns;
+
+	restarted.transactions = master->transactions;
+	restarted.polls = master->polls;
+	restarted.bytes = master->bytes;
+	restarted.resends = master->resends;
+	restarted.checksum_errors = master->checksum_errors;
+	restarted.frame_errors = master->frame_errors;
+	restarted.idle_transactions = master->idle_transactions;
+	restarted.latency_ack = master->latency_ack;
+	restarted.latency_response = master->latency_response;
+
+	*master = restarted;
+}
+
+// Enables all SET_SPITFP_CONFIG features with a send window of 3 and checks
+// that the bootloader goes back to the defaults if the master is restarted
+// and after a burst of garbage. Afterwards the master is restarted, the
+// link uses the defaults.
+bool sim_update_check_master_restart(SimMaster *master) {
+	const uint8_t features = SPITFP_FEATURE_SEND_WINDOW | SPITFP_FEATURE_CRC16 | SPITFP_FEATURE_JUMBO | SPITFP_FEATURE_AGGREGATE;
+	uint8_t garbage[SIM_UPDATE_GARBAGE_LENGTH];
+	memset(garbage, 0xFF, sizeof(garbage));
+
+	for(uint8_t i = 0; i < 2; i++) {
+		if(sim_update_set_spitfp_features(master, features, 3) == 0) {
+			// Built without any of the features
+			return true;
+		}
+
+		if(!sim_update_get_identity(master)) {
+			fprintf(stderr, "GET_IDENTITY with SET_SPITFP_CONFIG features failed\n");
+			return false;
+		}
+
+		if(i == 1) {
+			// Length 255 is never valid, every byte is a protocol error
+			sim_master_transfer(master, garbage, sizeof(garbage));
+			sim_bootloader_run_until(sim_get_time() + master->poll_interval_ns);
+			if(!spitfp_is_config_default(&bootloader_status->st)) {
+				fprintf(stderr, "No fallback to the defaults after %u bytes of garbage\n", SIM_UPDATE_GARBAGE_LENGTH);
+				return false;
+			}
+		}
+
+		sim_update_restart_master(master);
+		if(!sim_update_get_identity(master) || !spitfp_is_config_default(&bootloader_status->st)) {
+			fprintf(stderr, "No fallback to the defaults after a restart of the master\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Returns the number of chunks per WRITE_FIRMWARE, 1 without jumbo frames
+uint8_t sim_update_get_chunks(const uint8_t features) {
+	return (features & SPITFP_FEATURE_JUMBO) ? SIM_UPDATE_MAX_CHUNKS : 1;
+}
+
+static bool sim_update_is_chunk_erased(const uint8_t *chunk) {
+	for(uint8_t i = 0; i < SIM_UPDATE_CHUNK_SIZE; i++) {
+		if(chunk[i] != 0xFF) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool sim_update_erase_firmware(SimMaster *master) {
+	EraseFirmware ef;
+	EraseFirmwareReturn efr;
+	sim_master_header(&ef, sizeof(ef), SIM_MASTER_FID_ERASE_FIRMWARE, true);
+	ef.pointer = 0;
+	ef.row_count = 0; // Up to the end of the firmware
+	if(sim_master_call(master, &ef, &efr, SIM_UPDATE_TIMEOUT) != SIM_MASTER_CALL_OK) {
+		fprintf(stderr, "ERASE_FIRMWARE failed (bootloader built without BOOTLOADER_USE_BULK_ERASE?)\n");
+		return false;
+	}
+
+	if(efr.status != 0) {
+		fprintf(stderr, "ERASE_FIRMWARE returned status %u\n", efr.status);
+		return false;
+	}
+
+	return true;
+}
+
+// SET_WRITE_FIRMWARE_POINTER and WRITE_FIRMWARE for count writes, one
+// after the other or with a send window all in one go
+static bool sim_update_write(SimMaster *master, const uint8_t *image, const uint32_t *pointers, const uint32_t *sizes, const uint8_t count) {
+	SetWriteFirmwarePointer swfp[SIM_UPDATE_WINDOW_BATCH];
+	WriteFirmware wf[SIM_UPDATE_WINDOW_BATCH];
+	WriteFirmwareReturn wfr[SIM_UPDATE_WINDOW_BATCH];
+	const void *requests[SIM_UPDATE_WINDOW_BATCH*2];
+	void *responses[SIM_UPDATE_WINDOW_BATCH*2];
+
+	for(uint8_t i = 0; i < count; i++) {
+		sim_master_header(&swfp[i], sizeof(swfp[i]), SIM_MASTER_FID_SET_WRITE_FIRMWARE_POINTER, false);
+		swfp[i].pointer = pointers[i];
+		sim_master_header(&wf[i], sizeof(TFPMessageHeader) + sizes[i], SIM_MASTER_FID_WRITE_FIRMWARE, true);
+		memcpy(wf[i].data, &image[pointers[i]], sizes[i]);
+		wfr[i].status = 0;
+
+		requests[i*2]      = &swfp[i];
+		requests[i*2 + 1]  = &wf[i];
+		responses[i*2]     = NULL;
+		responses[i*2 + 1] = &wfr[i];
+	}
+
+	if(master->send_window_size > 1) {
+		if(sim_master_call_window(master, requests, count*2, responses, SIM_UPDATE_TIMEOUT) != SIM_MASTER_CALL_OK) {
+			fprintf(stderr, "WRITE_FIRMWARE at %u (%u writes) failed\n", pointers[0], count);
+			return false;
+		}
+	} else {
+		for(uint8_t i = 0; i < count; i++) {
+			if(sim_master_call(master, &swfp[i], NULL, SIM_UPDATE_TIMEOUT) != SIM_MASTER_CALL_OK) {
+				fprintf(stderr, "SET_WRITE_FIRMWARE_POINTER(%u) failed\n", pointers[i]);
+				return false;
+			}
+
+			if(sim_master_call(master, &wf[i], &wfr[i], SIM_UPDATE_TIMEOUT) != SIM_MASTER_CALL_OK) {
+				fprintf(stderr, "WRITE_FIRMWARE at %u failed\n", pointers[i]);
+				return false;
+			}
+		}
+	}
+
+	for(uint8_t i = 0; i < count; i++) {
+		if(wfr[i].status != 0) {
+			fprintf(stderr, "WRITE_FIRMWARE at %u returned status %u\n", pointers[i], wfr[i].status);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Writes the first length bytes (rounded up to whole chunks) with up to
+// chunks chunks per WRITE_FIRMWARE. With sparse the firmware is erased first
+// and erased chunks are skipped.
+bool sim_update_flash(SimMaster *master, const uint8_t *image, const uint32_t length, const uint8_t chunks, const bool sparse) {
+	if(sparse && !sim_update_erase_firmware(master)) {
+		return false;
+	}
+
+	const uint8_t batch = (master->send_window_size > 1) ? SIM_UPDATE_WINDOW_BATCH : 1;
+	uint32_t pointers[SIM_UPDATE_WINDOW_BATCH];
+	uint32_t sizes[SIM_UPDATE_WINDOW_BATCH];
+	uint8_t count = 0;
+
+	uint32_t size;
+	for(uint32_t pointer = 0; pointer < length; pointer += size) {
+		// Consecutive chunks that are not skipped go into one WRITE_FIRMWARE
+		size = 0;
+		while((size < chunks*SIM_UPDATE_CHUNK_SIZE) && (pointer + size < length) &&
+		      !(sparse && sim_update_is_chunk_erased(&image[pointer + size]))) {
+			size += SIM_UPDATE_CHUNK_SIZE;
+		}
+
+		if(size == 0) {
+			size = SIM_UPDATE_CHUNK_SIZE;
+			continue;
+		}
+
+		pointers[count] = pointer;
+		sizes[count] = size;
+		count++;
+		if(count == batch) {
+			if(!sim_update_write(master, image, pointers, sizes, count)) {
+				return false;
+			}
+			count = 0;
+		}
+	}
+
+	return (count == 0) || sim_update_write(master, image, pointers, sizes, count);
+}
+
+bool sim_update_reboot_to_firmware(SimMaster *master) {
+	SetBootloaderMode sbm;
+	SetBootloaderModeReturn sbmr;
+	sim_master_header(&sbm, sizeof(sbm), SIM_MASTER_FID_SET_BOOTLOADER_MODE, true);
+	sbm.mode = BOOT_MODE_FIRMWARE;
+	if(sim_master_call(master, &sbm, &sbmr, SIM_UPDATE_TIMEOUT) != SIM_MASTER_CALL_OK) {
+		fprintf(stderr, "SET_BOOTLOADER_MODE failed\n");
+		return false;
+	}
+
+	if(sbmr.status != TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK) {
+		fprintf(stderr, "SET_BOOTLOADER_MODE returned status %u\n", sbmr.status);
+		return false;
+	}
+
+	// Keep polling until the bootloader resets
+	const uint64_t end = sim_get_time() + SIM_UPDATE_TIMEOUT;
+	while(sim_get_time() < end) {
+		sim_master_transaction(master);
+		if(sim_bootloader_run_until(sim_get_time() + master->poll_interval_ns) == SIM_BOOTLOADER_RESET) {
+			return sim_bootloader_start() == TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK;
+		}
+	}
+
+	fprintf(stderr, "No reset after SET_BOOTLOADER_MODE\n");
+	return false;
+}
+
+// Pages are written in the background, only complete after a reboot or
+// after the bootloader was idle long enough
+bool sim_update_verify(const uint8_t *image, const uint32_t length) {
+	return memcmp(sim_flash_get(BOOTLOADER_FIRMWARE_START_POS), image, length) == 0;
+}
+
+static bool sim_update_get_firmware_crc(SimMaster *master, const uint32_t pointer, const uint32_t length, uint32_t *crc) {
+	GetFirmwareCRC gfc;
+	GetFirmwareCRCReturn gfcr;
+	sim_master_header(&gfc, sizeof(gfc), SIM_MASTER_FID_GET_FIRMWARE_CRC, true);
+	gfc.pointer = pointer;
+	gfc.length = length;
+	if(sim_master_call(master, &gfc, &gfcr, SIM_UPDATE_TIMEOUT) != SIM_MASTER_CALL_OK) {
+		fprintf(stderr, "GET_FIRMWARE_CRC(%u, %u) failed (bootloader built without BOOTLOADER_USE_RANGE_CRC?)\n", pointer, length);
+		return false;
+	}
+
+	*crc = gfcr.crc;
+	return true;
+}
+
+// The last row can be shorter
+static uint32_t sim_update_get_row_length(const uint32_t pointer, const uint32_t length) {
+	return (length - pointer < SIM_UPDATE_ROW_SIZE) ? length - pointer : SIM_UPDATE_ROW_SIZE;
+}
+
+// Reads the CRCs of up to SIM_UPDATE_CRC_BATCH rows with one aggregate frame
+static bool sim_update_get_row_crcs(SimMaster *master, const uint32_t pointer, const uint32_t length, uint32_t *crcs, uint8_t *count) {
+	GetFirmwareCRC gfc[SIM_UPDATE_CRC_BATCH];
+	GetFirmwareCRCReturn gfcr[SIM_UPDATE_CRC_BATCH];
+	const void *requests[SIM_UPDATE_CRC_BATCH];
+	void *responses[SIM_UPDATE_CRC_BATCH];
+
+	*count = 0;
+	for(uint32_t row = pointer; (row < length) && (*count < SIM_UPDATE_CRC_BATCH); row += SIM_UPDATE_ROW_SIZE) {
+		sim_master_header(&gfc[*count], sizeof(GetFirmwareCRC), SIM_MASTER_FID_GET_FIRMWARE_CRC, true);
+		gfc[*count].pointer = row;
+		gfc[*count].length = sim_update_get_row_length(row, length);
+		requests[*count] = &gfc[*count];
+		responses[*count] = &gfcr[*count];
+		(*count)++;
+	}
+
+	if(sim_master_call_aggregate(master, requests, *count, responses, SIM_UPDATE_TIMEOUT) != SIM_MASTER_CALL_OK) {
+		fprintf(stderr, "Aggregated GET_FIRMWARE_CRC at %u failed (bootloader built without SPITFP_USE_AGGREGATE_FRAMES?)\n", pointer);
+		return false;
+	}
+
+	for(uint8_t i = 0; i < *count; i++) {
+		crcs[i] = gfcr[i].crc;
+	}
+
+	return true;
+}
+
+// Verifies the first length bytes (has to be whole words) through
+// GET_FIRMWARE_CRC without reading the flash. On a mismatch the rows
+// that differ are printed, only these would have to be written again.
+// With aggregate the row CRCs are read in batches (aggregate frames have
+// to be enabled with sim_update_set_spitfp_features).
+bool sim_update_verify_crc(SimMaster *master, const uint8_t *image, const uint32_t length, const bool aggregate) {
+	uint32_t crc;
+	if(!sim_update_get_firmware_crc(master, 0, length, &crc)) {
+		return false;
+	}
+
+	if(crc == sim_update_crc32(image, length)) {
+		return true;
+	}
+
+	uint32_t crcs[SIM_UPDATE_CRC_BATCH];
+	uint8_t count;
+	for(uint32_t pointer = 0; pointer < length; pointer += count*SIM_UPDATE_ROW_SIZE) {
+		if(aggregate) {
+			if(!sim_update_get_row_crcs(master, pointer, length, crcs, &count)) {
+				return false;
+			}
+		} else {
+			if(!sim_update_get_firmware_crc(master, pointer, sim_update_get_row_length(pointer, length), &crcs[0])) {
+				return false;
+			}
+			count = 1;
+		}
+
+		for(uint8_t i = 0; i < count; i++) {
+			const uint32_t row = pointer + i*SIM_UPDATE_ROW_SIZE;
+			if(crcs[i] != sim_update_crc32(&image[row], sim_update_get_row_length(row, length))) {
+				fprintf(stderr, "CRC mismatch in row at %u\n", row);
+			}
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,43 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * sim_update.h: Firmware update sequence of the simulated master
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef SIM_UPDATE_H
+#define SIM_UPDATE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sim_master.h"
+
+#define SIM_UPDATE_CHUNK_SIZE 64
+
+void sim_update_generate_image(uint8_t *image, const uint32_t code_size);
+bool sim_update_load_image(uint8_t *image, const char *path);
+uint8_t sim_update_set_spitfp_features(SimMaster *master, const uint8_t features, const uint8_t send_window_size);
+bool sim_update_check_master_restart(SimMaster *master);
+uint8_t sim_update_get_chunks(const uint8_t features);
+bool sim_update_flash(SimMaster *master, const uint8_t *image, const uint32_t length, const uint8_t chunks, const bool sparse);
+bool sim_update_reboot_to_firmware(SimMaster *master);
+bool sim_update_verify(const uint8_t *image, const uint32_t length);
+bool sim_update_verify_crc(SimMaster *master, const uint8_t *image, const uint32_t length, const bool aggregate);
+
+#endif
@@ -26,10 +26,108 @@
 #include "bricklib2/bootloader/bootloader.h"
 
 #include "dsu_crc32.h"
+#include "nvm_writer.h"
+#include "profile.h"
 
 typedef void (* boot_firmware_start_func_t)(void);
 
-uint32_t boot_calculate_firmware_crc(void) {
+#if BOOTLOADER_FIRMWARE_SLOT_COUNT > 1
+_Static_assert(BOOT_SLOT_START_POS(BOOTLOADER_FIRMWARE_SLOT_COUNT) <= FLASH_ADDR + FLASH_SIZE, "Firmware slots don't fit into flash");
+_Static_assert(BOOTLOADER_FIRMWARE_SLOT_COUNT <= 8, "At most 8 firmware slots are supported");
+
+// Slot that is checked by boot_can_jump_to_firmware and used by
+// boot_jump_to_firmware. Only valid in bootloader.
+static uint8_t boot_firmware_slot = 0;
+#else
+#define boot_firmware_slot 0
+#endif
+
+#ifdef BOOTLOADER_USE_FAST_BOOT
+// The "firmware verified" marker is kept in the NVM user row after the fuses
+// (first 8 bytes). The user row is never erased, a reset between erase and
+// write would leave the fuses (BOOTPROT, WDT, BOD33) erased. A marker slot is
+// only programmed (bits can go from 1 to 0 without erase):
+// * 0xFFFFFFFF: Slot empty
+// * firmware crc: Firmware with this crc was verified
+// * 0x00000000: Marker was invalidated (firmware is being changed)
+// The last slot that is not empty is the current marker. If all slots are
+// used, the full CRC check is done on every boot.
+#define BOOT_MARKER_ADDRESS (NVMCTRL_USER + 8)
+#define BOOT_MARKER_SLOTS   ((NVM_WRITER_PAGE_SIZE - 8)/sizeof(uint32_t))
+#define BOOT_MARKER_EMPTY   0xFFFFFFFF
+#define BOOT_MARKER_INVALID 0x00000000
+
+static const volatile uint32_t *const boot_marker = (const volatile uint32_t *)BOOT_MARKER_ADDRESS;
+
+// Returns index of first empty slot
+static uint8_t boot_marker_get_empty_slot(void) {
+	uint8_t slot = 0;
+	while((slot < BOOT_MARKER_SLOTS) && (boot_marker[slot] != BOOT_MARKER_EMPTY)) {
+		slot++;
+	}
+
+	return slot;
+}
+
+static void boot_marker_write(const uint8_t slot, const uint32_t value) {
+	// The nvm writer may still be busy with the previous page. This is
+	// also called before the nvm writer is initialized, so we only wait.
+	while(!(NVMCTRL->INTFLAG.reg & NVMCTRL_INTFLAG_READY));
+
+	NVMCTRL->CTRLB.reg |= NVMCTRL_CTRLB_MANW;
+
+	// Clear page buffer (all ones), so only the marker slot is programmed
+	NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMD_PBC | NVMCTRL_CTRLA_CMDEX_KEY;
+	while(!(NVMCTRL->INTFLAG.reg & NVMCTRL_INTFLAG_READY));
+
+	// Page buffer only allows 16-bit access
+	volatile uint16_t *const marker = (volatile uint16_t *)&boot_marker[slot];
+	marker[0] = value & 0xFFFF;
+	marker[1] = value >> 16;
+
+	NVMCTRL->ADDR.reg = NVMCTRL_USER / 2;
+	NVMCTRL->CTRLA.reg = NVMCTRL_CTRLA_CMD_WAP | NVMCTRL_CTRLA_CMDEX_KEY;
+	while(!(NVMCTRL->INTFLAG.reg & NVMCTRL_INTFLAG_READY));
+}
+
+static bool boot_is_firmware_verified(const uint32_t firmware_crc) {
+	// Full check after resets that may indicate a problem (e.g. watchdog)
+	if(!(PM->RCAUSE.reg & BOOTLOADER_FAST_BOOT_RCAUSE)) {
+		return false;
+	}
+
+	const uint8_t slot = boot_marker_get_empty_slot();
+	if(slot == 0) {
+		return false;
+	}
+
+	const uint32_t marker = boot_marker[slot - 1];
+	return (marker != BOOT_MARKER_INVALID) && (marker == firmware_crc);
+}
+
+static void boot_set_firmware_verified(const uint32_t crc) {
+	const uint8_t slot = boot_marker_get_empty_slot();
+	if((slot > 0) && (boot_marker[slot - 1] == crc)) {
+		return;
+	}
+
+	// A crc of 0 or all ones can't be used as marker
+	if((slot < BOOT_MARKER_SLOTS) && (crc != BOOT_MARKER_INVALID) && (crc != BOOT_MARKER_EMPTY)) {
+		boot_marker_write(slot, crc);
+	}
+}
+
+// Has to be called before the firmware is changed
+void boot_clear_firmware_verified(void) {
+	const uint8_t slot = boot_marker_get_empty_slot();
+	if((slot > 0) && (boot_marker[slot - 1] != BOOT_MARKER_INVALID)) {
+		boot_marker_write(slot - 1, BOOT_MARKER_INVALID);
+	}
+}
+#endif
+
+// Calculates CRC32 over flash with the DSU
+uint32_t boot_calculate_crc(const uint32_t address, const uint32_t length) {
 	// unlock DSU
 	// equivalent to: system_peripheral_unlock(SYSTEM_PERIPHERAL_ID(DSU), ~SYSTEM_PERIPHERAL_ID(DSU));
 	// saves 50 bytes
@@ -39,34 +137,97 @@ uint32_t boot_calculate_firmware_crc(void) {
 	PM->APBBMASK.reg |= PM_APBBMASK_DSU;
 
 	uint32_t crc = 0xFFFFFFFF;
-	dsu_crc32_cal((const uint32_t)BOOTLOADER_FIRMWARE_START_POS, BOOTLOADER_FIRMWARE_SIZE - BOOTLOADER_FIRMWARE_CRC_SIZE, &crc);
+	dsu_crc32_cal(address, length, &crc);
 
 	return ~crc;
 }
 
-// We use the relevant TFP_COMMON return values here
-uint8_t boot_can_jump_to_firmware(void) {
+uint32_t boot_calculate_firmware_crc(const uint8_t slot) {
+	PROFILE_BEGIN(PROFILE_PROBE_FIRMWARE_CRC);
+	const uint32_t crc = boot_calculate_crc(BOOT_SLOT_START_POS(slot), BOOTLOADER_FIRMWARE_SIZE - BOOTLOADER_FIRMWARE_CRC_SIZE);
+	PROFILE_END(PROFILE_PROBE_FIRMWARE_CRC);
+
+	return crc;
+}
+
+// We use the relevant TFP_COMMON return values here.
+// With use_marker the CRC check is skipped if the firmware was already verified.
+static uint8_t boot_check_slot(const uint8_t slot, const bool use_marker) {
 	// Check first 4 bytes, if in bootloader mode they will be all ones
-	if(BOOTLOADER_FIRMWARE_FIRST_BYTES == BOOTLOADER_FIRMWARE_FIRST_BYTES_DEFAULT) {
+	if(BOOT_SLOT_FIRST_BYTES(slot) == BOOTLOADER_FIRMWARE_FIRST_BYTES_DEFAULT) {
 		return TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_ENTRY_FUNCTION_NOT_PRESENT;
 	}
 
-	if(BOOTLOADER_FIRMWARE_CONFIGURATION_POINTER->device_identifier != BOOTLOADER_DEVICE_IDENTIFIER) {
+	if(BOOT_SLOT_CONFIGURATION_POINTER(slot)->device_identifier != BOOTLOADER_DEVICE_IDENTIFIER) {
 		return TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_DEVICE_IDENTIFIER_INCORRECT;
 	}
 
-	if(BOOTLOADER_FIRMWARE_CONFIGURATION_POINTER->firmware_crc != boot_calculate_firmware_crc()) {
+#ifdef BOOTLOADER_USE_FAST_BOOT
+	if(use_marker && boot_is_firmware_verified(BOOT_SLOT_CONFIGURATION_POINTER(slot)->firmware_crc)) {
+		return TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK;
+	}
+#endif
+
+	const uint32_t crc = boot_calculate_firmware_crc(slot);
+	if(BOOT_SLOT_CONFIGURATION_POINTER(slot)->firmware_crc != crc) {
 		return TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_CRC_MISMATCH;
 	}
 
+#ifdef BOOTLOADER_USE_FAST_BOOT
+	boot_set_firmware_verified(crc);
+#endif
+
 	return TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK;
 }
 
+uint8_t boot_can_jump_to_firmware(const bool use_marker) {
+#if BOOTLOADER_FIRMWARE_SLOT_COUNT > 1
+	// Check the slots from newest to oldest firmware version,
+	// the first valid slot is the one we jump to
+	uint8_t status = TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_ENTRY_FUNCTION_NOT_PRESENT;
+	uint8_t checked = 0;
+	for(uint8_t i = 0; i < BOOTLOADER_FIRMWARE_SLOT_COUNT; i++) {
+		uint8_t newest = BOOTLOADER_FIRMWARE_SLOT_COUNT;
+		for(uint8_t slot = 0; slot < BOOTLOADER_FIRMWARE_SLOT_COUNT; slot++) {
+			if(checked & (1 << slot)) {
+				continue;
+			}
+
+			if((newest == BOOTLOADER_FIRMWARE_SLOT_COUNT) ||
+			   (BOOT_SLOT_CONFIGURATION_POINTER(slot)->firmware_version > BOOT_SLOT_CONFIGURATION_POINTER(newest)->firmware_version)) {
+				newest = slot;
+			}
+		}
+
+		checked |= 1 << newest;
+		status = boot_check_slot(newest, use_marker);
+		if(status == TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK) {
+			boot_firmware_slot = newest;
+			break;
+		}
+	}
+
+	return status;
+#else
+	return boot_check_slot(0, use_marker);
+#endif
+}
+
+// Slot of the firmware that is currently running (0 in bootloader mode)
+uint8_t boot_get_running_slot(void) {
+#if BOOTLOADER_FIRMWARE_SLOT_COUNT > 1
+	if(SCB->VTOR >= BOOTLOADER_FIRMWARE_START_POS) {
+		return (SCB->VTOR - BOOTLOADER_FIRMWARE_START_POS) / BOOTLOADER_FIRMWARE_SIZE;
+	}
+#endif
+
+	return 0;
+}
 
 void boot_jump_to_firmware(void) {
 	register boot_firmware_start_func_t firmware_start_func;
-	const uint32_t stack_pointer_address = BOOTLOADER_FIRMWARE_START_POS;
-	const uint32_t reset_pointer_address = BOOTLOADER_FIRMWARE_START_POS + 4;
+	const uint32_t stack_pointer_address = BOOT_SLOT_START_POS(boot_firmware_slot);
+	const uint32_t reset_pointer_address = BOOT_SLOT_START_POS(boot_firmware_slot) + 4;
 
 	// Set stack pointer with the first word of the run mode program
 	// Vector table's first entry is the stack pointer value
@@ -23,8 +23,25 @@
 #define BOOT_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
-uint8_t boot_can_jump_to_firmware(void);
+#include "configs/config.h"
+#include "bricklib2/bootloader/bootloader.h"
+
+#ifndef BOOTLOADER_FIRMWARE_SLOT_COUNT
+#define BOOTLOADER_FIRMWARE_SLOT_COUNT 1
+#endif
+
+// Each slot has the layout of the single firmware region (firmware with
+// configuration at the end), the slots follow each other directly
+#define BOOT_SLOT_START_POS(slot) (BOOTLOADER_FIRMWARE_START_POS + (slot)*BOOTLOADER_FIRMWARE_SIZE)
+#define BOOT_SLOT_FIRST_BYTES(slot) (*((uint32_t*)BOOT_SLOT_START_POS(slot)))
+#define BOOT_SLOT_CONFIGURATION_POINTER(slot) ((__typeof__(BOOTLOADER_FIRMWARE_CONFIGURATION_POINTER))((uint32_t)BOOTLOADER_FIRMWARE_CONFIGURATION_POINTER + (slot)*BOOTLOADER_FIRMWARE_SIZE))
+
+uint32_t boot_calculate_crc(const uint32_t address, const uint32_t length);
+uint8_t boot_can_jump_to_firmware(const bool use_marker);
+void boot_clear_firmware_verified(void);
+uint8_t boot_get_running_slot(void);
 void boot_jump_to_firmware(void);
 
 #endif
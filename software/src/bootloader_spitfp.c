@@ -55,6 +55,95 @@ Protocol information:
 * Sequence number runs from 0x1 to 0xF (0 is for ACK Packet only)
 * Compared to the SPI stack protocol, this protocol is made for slow SPI clock speeds
 
+Optional sliding window (SPITFP_SEND_WINDOW_SIZE > 1):
+* Master enables it with the SET_SPITFP_CONFIG TFP function, until then
+  the protocol above is used unchanged
+* Slave keeps up to send_window_size data packets unacknowledged
+* All unacknowledged packets are sent back-to-back in one DMA transfer,
+  optionally preceded by an ACK packet
+* ACKs are cumulative: The ACK for sequence number n also acknowledges all
+  packets that were sent before n
+* Only packets that are not yet acknowledged are re-sent, always all of
+  them (go-back-N, there is no selective re-send)
+* Only the sequence number that follows the last sequence number seen is
+  new. Up to send_window_size sequence numbers before it are duplicates
+  and are ACKed again, everything else is dropped without ACK. After a
+  lost packet the following ones are dropped too, until the master
+  re-sends them in order.
+
+Optional CRC checksum (SPITFP_USE_DMAC_CRC):
+* Master enables it with the SET_SPITFP_CONFIG TFP function
+* The one byte checksum is replaced by a CRC-16-CCITT (2 bytes) or
+  IEEE 802.3 CRC-32 (4 bytes), calculated over length, sequence number
+  and payload and transmitted in little endian
+* The length byte includes the bigger checksum, an ACK packet has a
+  length of 4 (CRC-16) or 6 (CRC-32)
+* The response to SET_SPITFP_CONFIG is still sent with the old checksum,
+  everything after it uses the new one
+
+Fallback to the defaults:
+* A master that was restarted does not know the SET_SPITFP_CONFIG
+  features anymore, so the slave goes back to the defaults (Pearson
+  checksum, no send window, no jumbo and aggregate frames) if
+  - a complete frame with the Pearson checksum is received while a CRC
+    checksum is used and the master already sent a frame with it,
+  - a valid frame has 0 as last sequence number seen, after the master
+    had already seen one of our frames or
+  - SPITFP_CONFIG_FALLBACK_ERRORS protocol errors happen without a valid
+    frame in between
+* Frames that are not acknowledged yet are dropped, the restarted master
+  doesn't wait for them
+
+Optional jumbo frames (SPITFP_USE_JUMBO_FRAMES):
+* Master enables it with the SET_SPITFP_CONFIG TFP function, only
+  possible in bootloader mode
+* Messages from master to slave can have up to 200 bytes (TFP header and
+  three 64 byte pages), the slave still only sends normal frames
+* The frame format is unchanged, only the maximum length is bigger
+
+Optional aggregate frames (SPITFP_USE_AGGREGATE_FRAMES):
+* Master enables it with the SET_SPITFP_CONFIG TFP function
+* The payload of a data packet can contain several TFP messages back to
+  back, each one has its length in the TFP header. It is an aggregate
+  frame if the payload is longer than the first message.
+* The responses are collected and sent back to back in one data packet
+  of up to 160 bytes. Messages without response add nothing.
+* A message is only handled if there is still room for a response of
+  maximum size, the rest of the frame is dropped. The master sees this
+  from the missing responses. Everything is handled if the responses to
+  all but the last message fit into 80 bytes.
+* If the lengths of the messages don't add up to the payload length,
+  the frame is only acknowledged
+
+Optional interrupt receive (SPITFP_USE_IRQ_RECEIVE):
+* Frames are parsed in the SERCOM interrupt at the end of every SPI
+  transaction instead of in spitfp_tick
+* Complete frames are put into a single-producer/single-consumer queue,
+  spitfp_tick handles ACKs and messages from the queue
+* If the queue is full, the frame stays in the ringbuffer
+
+Optional send queue (SPITFP_USE_SEND_QUEUE):
+* The firmware can queue messages (e.g. callbacks) with
+  spitfp_enqueue_message instead of waiting for spitfp_is_send_possible
+* spitfp_tick sends queued messages in order whenever the link is free,
+  after the received messages were handled. Responses are not queued,
+  they carry the ACK for the message of the master.
+* With coalesce a queued message with the same UID and FID is replaced,
+  so only the latest value of a callback is sent
+
+Message handling without interrupt receive:
+* A message is handled in place in the ringbuffer, the frame is removed
+  after the handler returned. Handlers must not keep a pointer to it.
+* Only a message that wraps around at the end of the ringbuffer is
+  copied to the stack first
+* The message is not aligned, the TFP structs are packed
+
+Receive ringbuffer (spitfp_ringbuffer.h):
+* SPITFP_RECEIVE_BUFFER_SIZE is a power of two, indices wrap with a mask
+* The parser walks the received data in at most two contiguous spans
+  (up to the end of the buffer and from its beginning). Only after a
+  protocol error it has to go back and gets the spans again.
+
 Optinal Improvement:
 * Master only polls if data available or MISO line is low
 * Slave puts MISO line low if it has data to send
@@ -65,22 +154,83 @@ Optinal Improvement:
 
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #include "io.h"
 #include "tfp_common.h"
+#include "firmware_entry.h"
+#include "profile.h"
+#include "spitfp_ringbuffer.h"
 
 #include "bricklib2/utility/pearson_hash.h"
 #include "bricklib2/logging/logging.h"
 #include "bricklib2/bootloader/tinywdt.h"
 
-#define SPITFP_MIN_TFP_MESSAGE_LENGTH (TFP_MESSAGE_MIN_LENGTH + SPITFP_PROTOCOL_OVERHEAD)
-#define SPITFP_MAX_TFP_MESSAGE_LENGTH (TFP_MESSAGE_MAX_LENGTH + SPITFP_PROTOCOL_OVERHEAD)
-
 static const uint8_t spitfp_dummy_tx_byte = 0x0;
 
 void spitfp_init(SPITFP *st) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	ext->parse_position = 0;
+	ext->config_error_count = 0;
+	ext->master_synchronized = false;
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	ext->config_reset_pending = false;
+#endif
+
+#if SPITFP_SEND_WINDOW_SIZE > 1
+	ext->send_window_size = 1;
+	ext->send_window_frames = 0;
+	ext->send_window_acked = 0;
+	ext->send_window_ack_pending = false;
+#endif
+
+#ifdef SPITFP_USE_DMAC_CRC
+	ext->checksum_size = 1;
+	ext->checksum_size_pending = 1;
+	ext->checksum_confirmed = false;
+#endif
+
+#ifdef SPITFP_USE_JUMBO_FRAMES
+	ext->message_max_length = TFP_MESSAGE_MAX_LENGTH;
+#endif
+
+#ifdef SPITFP_USE_AGGREGATE_FRAMES
+	ext->aggregate_enabled = false;
+	ext->aggregate_collecting = false;
+	ext->aggregate_response_length = 0;
+#endif
+
+#ifdef SPITFP_USE_STATISTICS
+	ext->error_resync = false;
+	spitfp_clear_statistics(st);
+#endif
+
+#ifdef SPITFP_USE_SEND_QUEUE
+	ext->send_queue_head = 0;
+	ext->send_queue_tail = 0;
+#endif
+
+	spitfp_init_hardware(st);
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	// Parse received data in the SERCOM interrupt at the end of
+	// every SPI transaction (TXC is set when slave select goes high)
+	ext->receive_queue_head = 0;
+	ext->receive_queue_tail = 0;
+	st->spi_module.hw->SPI.INTFLAG.reg = SERCOM_SPI_INTFLAG_TXC;
+	st->spi_module.hw->SPI.INTENSET.reg = SERCOM_SPI_INTENSET_TXC;
+	NVIC_EnableIRQ(SPITFP_IRQN);
+#endif
+}
+
+// Initializes the SPITFP struct, the SERCOM and the DMA. The extension is
+// not touched, firmwares without it only use this (see bootloader_spitfp_legacy.c).
+void spitfp_init_hardware(SPITFP *st) {
 	st->last_sequence_number_seen = 0;
 	st->current_sequence_number = 1;
+	st->buffer_send_length = 0;
+	st->state = SPITFP_STATE_START;
 
 	// Configure ring buffer
 	memset(&st->buffer_recv, 0, SPITFP_RECEIVE_BUFFER_SIZE);
@@ -189,56 +339,575 @@ void spitfp_enable_tx_dma(SPITFP *st) {
 	cpu_irq_enable();
 }
 
-void spitfp_send_ack_and_message(SPITFP *st, uint8_t *data, const uint8_t length) {
+uint8_t spitfp_get_protocol_overhead(SPITFP *st) {
+#ifdef SPITFP_USE_DMAC_CRC
+	return SPITFP_PROTOCOL_OVERHEAD - 1 + spitfp_get_extension(st)->checksum_size;
+#else
+	return SPITFP_PROTOCOL_OVERHEAD;
+#endif
+}
+
+uint8_t spitfp_get_message_max_length(SPITFP *st) {
+#ifdef SPITFP_USE_JUMBO_FRAMES
+	return spitfp_get_extension(st)->message_max_length;
+#else
+	return TFP_MESSAGE_MAX_LENGTH;
+#endif
+}
+
+// The TFP header repeats the length of the message. In an aggregate frame
+// it is the length of the first message.
+bool spitfp_is_tfp_length_valid(SPITFP *st, const uint8_t tfp_length, const uint8_t payload_length) {
+#ifdef SPITFP_USE_AGGREGATE_FRAMES
+	if(spitfp_get_extension(st)->aggregate_enabled) {
+		return (tfp_length >= TFP_MESSAGE_MIN_LENGTH) && (tfp_length <= payload_length);
+	}
+#endif
+
+	return tfp_length == payload_length;
+}
+
+#ifdef SPITFP_USE_DMAC_CRC
+// The DMAC CRC engine is used through its I/O interface. The rx and tx
+// channels can't be used as CRC source, since they run continuously
+// (including all NoData bytes). mask is used to wrap around in the ringbuffer.
+uint32_t spitfp_crc_calculate(SPITFP *st, const uint8_t *data, const uint16_t start, const uint8_t length, const uint16_t mask) {
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	// The CRC engine is used from the receive interrupt and from the main loop
+	cpu_irq_disable();
+#endif
+
+	DMAC->CTRL.reg &= ~DMAC_CTRL_CRCENABLE;
+	DMAC->CRCCTRL.reg = DMAC_CRCCTRL_CRCBEATSIZE_BYTE |
+	                    DMAC_CRCCTRL_CRCSRC_IO |
+	                    (spitfp_get_extension(st)->checksum_size == 4 ? DMAC_CRCCTRL_CRCPOLY_CRC32 : DMAC_CRCCTRL_CRCPOLY_CRC16);
+	DMAC->CRCCHKSUM.reg = 0xFFFFFFFF;
+	DMAC->CTRL.reg |= DMAC_CTRL_CRCENABLE;
+
+	for(uint8_t i = 0; i < length; i++) {
+		DMAC->CRCDATAIN.reg = data[(start + i) & mask];
+	}
+
+	while(DMAC->CRCSTATUS.reg & DMAC_CRCSTATUS_CRCBUSY);
+	const uint32_t crc = DMAC->CRCCHKSUM.reg;
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	cpu_irq_enable();
+#endif
+
+	return crc;
+}
+
+// Appends CRC to frame of given length (without checksum)
+void spitfp_crc_append(SPITFP *st, uint8_t *frame, const uint8_t length) {
+	uint32_t crc = spitfp_crc_calculate(st, frame, 0, length, 0xFFFF);
+	for(uint8_t i = 0; i < spitfp_get_extension(st)->checksum_size; i++) {
+		frame[length + i] = crc & 0xFF;
+		crc >>= 8;
+	}
+}
+
+// Checks CRC of the frame at the start of the ringbuffer
+bool spitfp_crc_check(SPITFP *st) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	const uint8_t length = ext->parse_length - ext->checksum_size;
+	const uint16_t start = st->ringbuffer_recv.start;
+	uint32_t crc = spitfp_crc_calculate(st, st->buffer_recv, start, length, SPITFP_RECEIVE_BUFFER_MASK);
+	for(uint8_t i = 0; i < ext->checksum_size; i++) {
+		if(st->buffer_recv[spitfp_ringbuffer_wrap(start + length + i)] != (crc & 0xFF)) {
+			return false;
+		}
+		crc >>= 8;
+	}
+
+	return true;
+}
+
+// Checks if a complete frame with the Pearson checksum is at the start of
+// the ringbuffer, like a restarted master sends it
+bool spitfp_is_pearson_frame(SPITFP *st) {
+	const uint16_t start = st->ringbuffer_recv.start;
+	const uint8_t length = st->buffer_recv[start];
+	if((length != SPITFP_PROTOCOL_OVERHEAD) && ((length < SPITFP_MIN_TFP_MESSAGE_LENGTH) || (length > TFP_MESSAGE_MAX_LENGTH + SPITFP_PROTOCOL_OVERHEAD))) {
+		return false;
+	}
+
+	if(spitfp_ringbuffer_get_used(&st->ringbuffer_recv) < length) {
+		return false;
+	}
+
+	// Only an ACK has no sequence number of its own, a message repeats
+	// its length in the TFP header
+	const uint8_t sequence_number = st->buffer_recv[spitfp_ringbuffer_wrap(start + 1)] & 0x0F;
+	if((length == SPITFP_PROTOCOL_OVERHEAD) != (sequence_number == 0)) {
+		return false;
+	}
+
+	if((length != SPITFP_PROTOCOL_OVERHEAD) &&
+	   (st->buffer_recv[spitfp_ringbuffer_wrap(start + 2 + offsetof(TFPMessageHeader, length))] != length - SPITFP_PROTOCOL_OVERHEAD)) {
+		return false;
+	}
+
 	uint8_t checksum = 0;
-	st->buffer_send_length = length + SPITFP_PROTOCOL_OVERHEAD;
-	st->buffer_send[0] = st->buffer_send_length;
-	PEARSON(checksum, st->buffer_send_length);
+	for(uint8_t i = 0; i < length - 1; i++) {
+		PEARSON(checksum, st->buffer_recv[spitfp_ringbuffer_wrap(start + i)]);
+	}
+
+	return checksum == st->buffer_recv[spitfp_ringbuffer_wrap(start + length - 1)];
+}
+#endif
+
+// Writes ACK to given position, returns length of ACK
+uint8_t spitfp_write_ack(SPITFP *st, uint8_t *ack) {
+	// Set new sequence number and checksum for ACK
+	ack[0] = spitfp_get_protocol_overhead(st);
+	ack[1] = st->last_sequence_number_seen << 4;
 
-	st->buffer_send[1] = spitfp_get_sequence_byte(st, true);
-	PEARSON(checksum, st->buffer_send[1]);
+#ifdef SPITFP_USE_DMAC_CRC
+	if(spitfp_get_extension(st)->checksum_size > 1) {
+		spitfp_crc_append(st, ack, 2);
+		return ack[0];
+	}
+#endif
+
+	ack[2] = pearson_permutation[pearson_permutation[ack[0]] ^ ack[1]];
+	return ack[0];
+}
+
+// The payload of the given length has to be in place at frame + 2 already,
+// length, sequence number and checksum are added around it
+uint8_t spitfp_write_frame(SPITFP *st, uint8_t *frame, const uint8_t length) {
+	frame[0] = length + spitfp_get_protocol_overhead(st);
+	frame[1] = spitfp_get_sequence_byte(st, true);
+
+#ifdef SPITFP_USE_DMAC_CRC
+	if(spitfp_get_extension(st)->checksum_size > 1) {
+		spitfp_crc_append(st, frame, length + 2);
+		return frame[0];
+	}
+#endif
+
+	uint8_t checksum = 0;
+	PEARSON(checksum, frame[0]);
+	PEARSON(checksum, frame[1]);
 
 	for(uint8_t i = 0; i < length; i++) {
-		st->buffer_send[2+i] = data[i];
-		PEARSON(checksum, st->buffer_send[2+i]);
+		PEARSON(checksum, frame[2+i]);
 	}
 
-	st->buffer_send[length + SPITFP_PROTOCOL_OVERHEAD-1] = checksum;
+	frame[length + SPITFP_PROTOCOL_OVERHEAD-1] = checksum;
 
-	st->descriptor_tx.BTCNT.reg = st->buffer_send_length;
-	st->descriptor_tx.SRCADDR.reg = (uint32_t)(st->buffer_send + st->buffer_send_length);
+	return frame[0];
+}
+
+#if SPITFP_SEND_WINDOW_SIZE > 1
+// The tx channel is idle if it loops in the dummy descriptor and no message
+// descriptor is chained anymore. Only then we are allowed to move data
+// around in buffer_send.
+bool spitfp_is_tx_dma_idle(SPITFP *st) {
+	return (st->descriptor_section[TINYDMA_SPITFP_TX_INDEX].DESCADDR.reg == (uint32_t)&st->descriptor_section[TINYDMA_SPITFP_TX_INDEX]) &&
+	       (st->write_back_section[TINYDMA_SPITFP_TX_INDEX].SRCADDR.reg == (uint32_t)&spitfp_dummy_tx_byte);
+}
+
+void spitfp_window_remove_acked(SPITFP *st) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	if(ext->send_window_acked == 0) {
+		return;
+	}
+
+	uint8_t *frames = spitfp_get_send_buffer(st) + SPITFP_MAX_PROTOCOL_OVERHEAD;
+	for(uint8_t pos = 0; pos < ext->send_window_acked; pos += frames[pos]) {
+		ext->send_window_frames--;
+	}
+
+	st->buffer_send_length -= ext->send_window_acked;
+	memmove(frames, frames + ext->send_window_acked, st->buffer_send_length);
+	ext->send_window_acked = 0;
+}
 
-/*	printf("data:");
-	for(uint8_t i = 0; i < st->buffer_send[0]; i++) {
-		if((i % 8) == 0) {
-			printf("\n\r");
+void spitfp_window_handle_ack(SPITFP *st, const uint8_t sequence_number) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	// ACKs are cumulative, everything up to and including the frame
+	// with the given sequence number has been seen by the master
+	const uint8_t *frames = spitfp_get_send_buffer(st) + SPITFP_MAX_PROTOCOL_OVERHEAD;
+	for(uint8_t i = 0, pos = 0; i < ext->send_window_frames; i++) {
+		const uint8_t frame_sequence_number = frames[pos + 1] & 0x0F;
+		pos += frames[pos];
+
+		if((frame_sequence_number == sequence_number) && (pos > ext->send_window_acked)) {
+			ext->send_window_acked = pos;
 		}
-		printf("%d ", st->buffer_send[i]);
 	}
-	printf("\n\r");*/
+}
+
+// Only call if tx dma is idle
+void spitfp_window_transmit(SPITFP *st) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	spitfp_window_remove_acked(st);
+
+	uint8_t *start = spitfp_get_send_buffer(st) + SPITFP_MAX_PROTOCOL_OVERHEAD;
+	uint8_t *end   = start + st->buffer_send_length;
+	if(ext->send_window_ack_pending) {
+		// The ACK is put directly in front of the first frame
+		ext->send_window_ack_pending = false;
+		start -= spitfp_get_protocol_overhead(st);
+		spitfp_write_ack(st, start);
+	}
+
+	if(start == end) {
+		return;
+	}
+
+	SPITFP_STATISTICS_ADD(st, bytes_sent, end - start);
+	st->descriptor_tx.BTCNT.reg = end - start;
+	st->descriptor_tx.SRCADDR.reg = (uint32_t)end;
 
 	spitfp_enable_tx_dma(st);
 }
+#endif
+
+// Returns where the payload of the next frame goes in buffer_send. A message
+// can be built there directly and sent with spitfp_send_message.
+// Only valid if spitfp_is_send_possible returns true.
+uint8_t *spitfp_get_send_message(SPITFP *st) {
+#if SPITFP_SEND_WINDOW_SIZE > 1
+	if(spitfp_get_extension(st)->send_window_size > 1) {
+		// The frame is appended behind the unacknowledged frames
+		return spitfp_get_send_buffer(st) + SPITFP_MAX_PROTOCOL_OVERHEAD + st->buffer_send_length + 2;
+	}
+#endif
+
+#ifdef SPITFP_USE_AGGREGATE_FRAMES
+	if(spitfp_get_extension(st)->aggregate_collecting) {
+		// Behind the responses to the previous messages of the aggregate frame
+		return spitfp_get_send_buffer(st) + 2 + spitfp_get_extension(st)->aggregate_response_length;
+	}
+#endif
+
+	return spitfp_get_send_buffer(st) + 2;
+}
+
+// Sends the message of the given length that was built at spitfp_get_send_message
+void spitfp_send_message(SPITFP *st, const uint8_t length) {
+#if SPITFP_SEND_WINDOW_SIZE > 1
+	if(spitfp_get_extension(st)->send_window_size > 1) {
+		// Append the frame behind the unacknowledged frames. This part of the
+		// buffer is not touched by a running DMA transfer. The frame carries
+		// our newest ACK, so a separate ACK is not necessary anymore.
+		st->buffer_send_length += spitfp_write_frame(st, spitfp_get_send_buffer(st) + SPITFP_MAX_PROTOCOL_OVERHEAD + st->buffer_send_length, length);
+		spitfp_get_extension(st)->send_window_frames++;
+		spitfp_get_extension(st)->send_window_ack_pending = false;
+		SPITFP_STATISTICS_ADD(st, frames_sent, 1);
+
+		if(spitfp_is_tx_dma_idle(st)) {
+			spitfp_window_transmit(st);
+		}
+		return;
+	}
+#endif
+
+#ifdef SPITFP_USE_AGGREGATE_FRAMES
+	if(spitfp_get_extension(st)->aggregate_collecting) {
+		// Sent together with the other responses, see spitfp_handle_aggregate
+		spitfp_get_extension(st)->aggregate_response_length += length;
+		return;
+	}
+#endif
+
+	st->buffer_send_length = spitfp_write_frame(st, spitfp_get_send_buffer(st), length);
+	SPITFP_STATISTICS_ADD(st, frames_sent, 1);
+	SPITFP_STATISTICS_ADD(st, bytes_sent, st->buffer_send_length);
+
+	st->descriptor_tx.BTCNT.reg = st->buffer_send_length;
+	st->descriptor_tx.SRCADDR.reg = (uint32_t)(spitfp_get_send_buffer(st) + st->buffer_send_length);
+
+	spitfp_enable_tx_dma(st);
+}
+
+void spitfp_send_ack_and_message(SPITFP *st, uint8_t *data, const uint8_t length) {
+	memcpy(spitfp_get_send_message(st), data, length);
+	spitfp_send_message(st, length);
+}
 
 void spitfp_send_ack(SPITFP *st) {
-	// Set new sequence number and checksum for ACK
-	st->buffer_send[0] = SPITFP_PROTOCOL_OVERHEAD;
-	st->buffer_send[1] = st->last_sequence_number_seen << 4;
-	st->buffer_send[2] = pearson_permutation[pearson_permutation[st->buffer_send[0]] ^ st->buffer_send[1]];
+#if SPITFP_SEND_WINDOW_SIZE > 1
+	if(spitfp_get_extension(st)->send_window_size > 1) {
+		// The ACK is put in front of the unacknowledged frames with the next transfer
+		spitfp_get_extension(st)->send_window_ack_pending = true;
 
-	st->descriptor_tx.BTCNT.reg = SPITFP_PROTOCOL_OVERHEAD;
-	st->descriptor_tx.SRCADDR.reg = (uint32_t)(st->buffer_send + SPITFP_PROTOCOL_OVERHEAD);
+		if(spitfp_is_tx_dma_idle(st)) {
+			spitfp_window_transmit(st);
+		}
+		return;
+	}
+#endif
+
+#ifdef SPITFP_USE_AGGREGATE_FRAMES
+	if(spitfp_get_extension(st)->aggregate_collecting) {
+		// The frame with the responses (or an ACK) is sent afterwards
+		return;
+	}
+#endif
+
+	const uint8_t length = spitfp_write_ack(st, spitfp_get_send_buffer(st));
+	SPITFP_STATISTICS_ADD(st, bytes_sent, length);
+
+	st->descriptor_tx.BTCNT.reg = length;
+	st->descriptor_tx.SRCADDR.reg = (uint32_t)(spitfp_get_send_buffer(st) + length);
 
 	spitfp_enable_tx_dma(st);
 }
 
 bool spitfp_is_send_possible(SPITFP *st) {
+#if SPITFP_SEND_WINDOW_SIZE > 1
+	if(spitfp_get_extension(st)->send_window_size > 1) {
+		return spitfp_get_extension(st)->send_window_frames < spitfp_get_extension(st)->send_window_size;
+	}
+#endif
+
 	return (st->descriptor_section[TINYDMA_SPITFP_TX_INDEX].DESCADDR.reg == (uint32_t)&st->descriptor_section[TINYDMA_SPITFP_TX_INDEX]) &&
 	       (st->buffer_send_length == 0);
 }
 
+uint8_t spitfp_set_config(SPITFP *st, const uint8_t features, uint8_t *send_window_size) {
+	uint8_t used_features = 0;
+
+	// The layout of buffer_send and the frame format can only be changed
+	// if no frame is pending. Otherwise we keep the current configuration.
+#if SPITFP_SEND_WINDOW_SIZE > 1
+	if(st->buffer_send_length == 0) {
+		if((features & SPITFP_FEATURE_SEND_WINDOW) && (*send_window_size > SPITFP_SEND_WINDOW_SIZE)) {
+			spitfp_get_extension(st)->send_window_size = SPITFP_SEND_WINDOW_SIZE;
+		} else if((features & SPITFP_FEATURE_SEND_WINDOW) && (*send_window_size > 1)) {
+			spitfp_get_extension(st)->send_window_size = *send_window_size;
+		} else {
+			spitfp_get_extension(st)->send_window_size = 1;
+		}
+	}
+
+	*send_window_size = spitfp_get_extension(st)->send_window_size;
+	if(spitfp_get_extension(st)->send_window_size > 1) {
+		used_features |= SPITFP_FEATURE_SEND_WINDOW;
+	}
+#else
+	*send_window_size = 1;
+#endif
+
+#ifdef SPITFP_USE_DMAC_CRC
+	// The new checksum is used after the response to this message
+	// was handed to the DMA, see spitfp_tick.
+	if(st->buffer_send_length == 0) {
+		if(features & SPITFP_FEATURE_CRC32) {
+			spitfp_get_extension(st)->checksum_size_pending = 4;
+		} else if(features & SPITFP_FEATURE_CRC16) {
+			spitfp_get_extension(st)->checksum_size_pending = 2;
+		} else {
+			spitfp_get_extension(st)->checksum_size_pending = 1;
+		}
+	}
+
+	if(spitfp_get_extension(st)->checksum_size_pending == 4) {
+		used_features |= SPITFP_FEATURE_CRC32;
+	} else if(spitfp_get_extension(st)->checksum_size_pending == 2) {
+		used_features |= SPITFP_FEATURE_CRC16;
+	}
+#endif
+
+#ifdef SPITFP_USE_JUMBO_FRAMES
+	// Only affects what we accept, the master sends the first jumbo frame
+	// after it got the response. The caller has to remove the feature
+	// in firmware mode.
+	if(features & SPITFP_FEATURE_JUMBO) {
+		spitfp_get_extension(st)->message_max_length = SPITFP_JUMBO_TFP_MESSAGE_MAX_LENGTH;
+		used_features |= SPITFP_FEATURE_JUMBO;
+	} else {
+		spitfp_get_extension(st)->message_max_length = TFP_MESSAGE_MAX_LENGTH;
+	}
+#endif
+
+#ifdef SPITFP_USE_AGGREGATE_FRAMES
+	// Like jumbo frames this only affects what we accept, the responses
+	// are only aggregated if the master sent an aggregate frame
+	spitfp_get_extension(st)->aggregate_enabled = (features & SPITFP_FEATURE_AGGREGATE) != 0;
+	if(spitfp_get_extension(st)->aggregate_enabled) {
+		used_features |= SPITFP_FEATURE_AGGREGATE;
+	}
+#endif
+
+	return used_features;
+}
+
+bool spitfp_is_checksum_valid(SPITFP *st, const uint8_t checksum) {
+#ifdef SPITFP_USE_DMAC_CRC
+	if(spitfp_get_extension(st)->checksum_size > 1) {
+		if(!spitfp_crc_check(st)) {
+			return false;
+		}
+
+		// From now on a frame with the Pearson checksum means that the
+		// master was restarted, see spitfp_check_config_fallback
+		spitfp_get_extension(st)->checksum_confirmed = true;
+		return true;
+	}
+#endif
+
+	return spitfp_get_extension(st)->parse_checksum == checksum;
+}
+
+// Returns true if nothing was changed with SET_SPITFP_CONFIG
+bool spitfp_is_config_default(SPITFP *st) {
+	bool is_default = true;
+#if SPITFP_SEND_WINDOW_SIZE > 1
+	is_default &= spitfp_get_extension(st)->send_window_size == 1;
+#endif
+#ifdef SPITFP_USE_DMAC_CRC
+	is_default &= (spitfp_get_extension(st)->checksum_size == 1) && (spitfp_get_extension(st)->checksum_size_pending == 1);
+#endif
+#ifdef SPITFP_USE_JUMBO_FRAMES
+	is_default &= spitfp_get_extension(st)->message_max_length == TFP_MESSAGE_MAX_LENGTH;
+#endif
+#ifdef SPITFP_USE_AGGREGATE_FRAMES
+	is_default &= !spitfp_get_extension(st)->aggregate_enabled;
+#endif
+
+	return is_default;
+}
+
+// The part of the configuration that is used by the parser
+void spitfp_reset_receive_config(SPITFP *st) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	ext->config_error_count = 0;
+	ext->master_synchronized = false;
+
+#ifdef SPITFP_USE_DMAC_CRC
+	ext->checksum_size = 1;
+	ext->checksum_size_pending = 1;
+	ext->checksum_confirmed = false;
+#endif
+
+#ifdef SPITFP_USE_JUMBO_FRAMES
+	ext->message_max_length = TFP_MESSAGE_MAX_LENGTH;
+#endif
+
+#ifdef SPITFP_USE_AGGREGATE_FRAMES
+	ext->aggregate_enabled = false;
+#endif
+}
+
+// The part of the configuration that is used for sending, only call
+// from the main loop. A pending frame was built with the old
+// configuration, it is dropped.
+void spitfp_reset_send_config(SPITFP *st) {
+	st->buffer_send_length = 0;
+
+#if SPITFP_SEND_WINDOW_SIZE > 1
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	ext->send_window_size = 1;
+	ext->send_window_frames = 0;
+	ext->send_window_acked = 0;
+	ext->send_window_ack_pending = false;
+#endif
+}
+
+// Called by the parser for every protocol error. Returns true if the
+// configuration was reset, the frame at the start of the ringbuffer is
+// then parsed again with the defaults.
+bool spitfp_check_config_fallback(SPITFP *st) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	if(spitfp_is_config_default(st)) {
+		return false;
+	}
+
+	ext->config_error_count++;
+	bool fallback = ext->config_error_count >= SPITFP_CONFIG_FALLBACK_ERRORS;
+#ifdef SPITFP_USE_DMAC_CRC
+	// Until the master got the response to SET_SPITFP_CONFIG it still
+	// sends frames with the Pearson checksum
+	fallback |= (ext->checksum_size > 1) && ext->checksum_confirmed && spitfp_is_pearson_frame(st);
+#endif
+
+	if(!fallback) {
+		return false;
+	}
+
+	spitfp_reset_receive_config(st);
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	// The send side belongs to spitfp_tick
+	ext->config_reset_pending = true;
+#else
+	spitfp_reset_send_config(st);
+#endif
+
+	st->state = SPITFP_STATE_START;
+	ext->parse_position = 0;
+
+	return true;
+}
+
+void spitfp_handle_ack(SPITFP *st, const uint8_t sequence_byte) {
+	const uint8_t last_sequence_number_seen_by_master = (sequence_byte & 0xF0) >> 4;
+
+	// Sequence numbers start at 1, the master only sends 0 as long as it
+	// has not seen any of our frames. If it does so afterwards, it was
+	// restarted.
+	if(last_sequence_number_seen_by_master == 0) {
+		if(spitfp_get_extension(st)->master_synchronized && !spitfp_is_config_default(st)) {
+			spitfp_reset_receive_config(st);
+			spitfp_reset_send_config(st);
+		}
+		spitfp_get_extension(st)->master_synchronized = false;
+	} else {
+		spitfp_get_extension(st)->master_synchronized = true;
+	}
+
+#if SPITFP_SEND_WINDOW_SIZE > 1
+	if(spitfp_get_extension(st)->send_window_size > 1) {
+		spitfp_window_handle_ack(st, last_sequence_number_seen_by_master);
+		return;
+	}
+#endif
+
+	if(last_sequence_number_seen_by_master == st->current_sequence_number) {
+		st->buffer_send_length = 0;
+	}
+}
+
+uint8_t spitfp_check_sequence_number(SPITFP *st, const uint8_t sequence_number) {
+#if SPITFP_SEND_WINDOW_SIZE > 1
+	// The master may have several frames in flight too. Frames have to be
+	// handled in order, a frame behind a lost one is not new. Re-sent frames
+	// can be up to send_window_size older than the last one we have seen.
+	if((spitfp_get_extension(st)->send_window_size > 1) && (st->last_sequence_number_seen != 0)) {
+		int8_t distance = sequence_number - st->last_sequence_number_seen;
+		if(distance <= 0) {
+			distance += 0xF;
+		}
+
+		if(distance == 1) {
+			return SPITFP_SEQUENCE_NUMBER_NEW;
+		}
+
+		if(distance > 0xF - spitfp_get_extension(st)->send_window_size) {
+			return SPITFP_SEQUENCE_NUMBER_DUPLICATE;
+		}
+
+		return SPITFP_SEQUENCE_NUMBER_OUT_OF_ORDER;
+	}
+#endif
+
+	if(sequence_number != st->last_sequence_number_seen) {
+		return SPITFP_SEQUENCE_NUMBER_NEW;
+	}
+
+	return SPITFP_SEQUENCE_NUMBER_DUPLICATE;
+}
+
 void spitfp_handle_spi_errors(SPITFP *st) {
 	if(st->spi_module.hw->SPI.INTFLAG.bit.ERROR) {
+		// In slave mode the only error is a buffer overflow (BUFOVF),
+		// the master clocked in a byte before the last one was read
+		SPITFP_STATISTICS_ADD(st, error_count_overflow, 1);
+
 		// Atmel has a #define ENABLE 1 somewhere in the configs,
 		// we need to undef it to use the ENABLE bit
 #undef ENABLE
@@ -250,164 +919,626 @@ void spitfp_handle_spi_errors(SPITFP *st) {
 	}
 }
 
-void spitfp_check_message_send_timeout(SPITFP *st) {
+#ifdef SPITFP_USE_STATISTICS
+// The routine re-sends while the master has not polled the frame and ACKed
+// it yet are not errors. Only if the oldest frame was clocked out completely
+// and is still not ACKed after SPITFP_RESEND_TIMEOUT ms the frames are
+// counted as re-sent. Only call if tx dma is idle.
+void spitfp_count_resend(SPITFP *st, const uint8_t *oldest_frame, const uint8_t frames, const uint32_t tick) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	const uint8_t sequence_number = (frames > 0) ? (oldest_frame[1] & 0x0F) : 0;
+	if(sequence_number != ext->resend_sequence_number) {
+		ext->resend_sequence_number = sequence_number;
+		ext->resend_time = tick;
+	} else if((sequence_number != 0) && ((uint32_t)(tick - ext->resend_time) >= SPITFP_RESEND_TIMEOUT)) {
+		ext->resend_count += frames;
+		ext->resend_time = tick;
+	}
+}
+#endif
+
+void spitfp_check_message_send_timeout(SPITFP *st, const uint32_t tick) {
 	// We use a timeout of 0 here, since the master is polling us anyway and it
 	// can handle duplicates through the sequence number we loose nothing by
 	// immediately re-sending the message.
-	if((st->descriptor_section[TINYDMA_SPITFP_TX_INDEX].DESCADDR.reg == (uint32_t)&st->descriptor_section[TINYDMA_SPITFP_TX_INDEX]) && (st->buffer_send_length > 0)) {
-		// We leave the old message the same and try again
-		st->descriptor_tx.BTCNT.reg = st->buffer_send_length;
-		st->descriptor_tx.SRCADDR.reg = (uint32_t)(st->buffer_send + st->buffer_send_length);
-
-		spitfp_enable_tx_dma(st);
+#if SPITFP_SEND_WINDOW_SIZE > 1
+	if(spitfp_get_extension(st)->send_window_size > 1) {
+		// Re-send all frames that are not acknowledged yet. Frames that were
+		// appended while the DMA was busy go out here for the first time.
+		if(spitfp_is_tx_dma_idle(st)) {
+#ifdef SPITFP_USE_STATISTICS
+			spitfp_window_remove_acked(st);
+			spitfp_count_resend(st, spitfp_get_send_buffer(st) + SPITFP_MAX_PROTOCOL_OVERHEAD, spitfp_get_extension(st)->send_window_frames, tick);
+#endif
+			spitfp_window_transmit(st);
+		}
+		return;
+	}
+#endif
+
+	if(st->descriptor_section[TINYDMA_SPITFP_TX_INDEX].DESCADDR.reg == (uint32_t)&st->descriptor_section[TINYDMA_SPITFP_TX_INDEX]) {
+#ifdef SPITFP_USE_STATISTICS
+		spitfp_count_resend(st, spitfp_get_send_buffer(st), (st->buffer_send_length > 0) ? 1 : 0, tick);
+#endif
+		if(st->buffer_send_length > 0) {
+			// We leave the old message the same and try again
+			SPITFP_STATISTICS_ADD(st, bytes_sent, st->buffer_send_length);
+			st->descriptor_tx.BTCNT.reg = st->buffer_send_length;
+			st->descriptor_tx.SRCADDR.reg = (uint32_t)(spitfp_get_send_buffer(st) + st->buffer_send_length);
+
+			spitfp_enable_tx_dma(st);
+		}
 	}
 }
 
+// In case of error we only drop the first byte of the current frame and
+// search for the next frame start in the bytes after it. A frame start is
+// only accepted if length, sequence byte and checksum are plausible, so
+// valid frames behind a corrupted one survive and the master only has to
+// re-send the corrupted one. The bytes after the first one were already
+// parsed, the caller has to parse them again.
 void spitfp_handle_protocol_error(SPITFP *st) {
-	// In case of error we completely empty the ringbuffer
-	uint8_t data;
-	while(ringbuffer_get(&st->ringbuffer_recv, &data));
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	spitfp_ringbuffer_remove(&st->ringbuffer_recv, 1);
 	st->state = SPITFP_STATE_START;
+	ext->parse_position = 0;
+
+#ifdef SPITFP_USE_STATISTICS
+	ext->error_resync = true;
+#endif
 }
 
-void spitfp_tick(BootloaderStatus *bootloader_status) {
+#ifdef SPITFP_USE_STATISTICS
+void spitfp_clear_statistics(SPITFP *st) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	// The receive counters are written in the SERCOM interrupt
+	cpu_irq_disable();
+#endif
+
+	ext->error_count_ack_checksum = 0;
+	ext->error_count_message_checksum = 0;
+	ext->error_count_frame = 0;
+	ext->error_count_overflow = 0;
+	ext->resend_count = 0;
+	ext->resend_time = 0;
+	ext->resend_sequence_number = 0;
+	ext->bytes_received = 0;
+	ext->bytes_sent = 0;
+	ext->frames_received = 0;
+	ext->frames_sent = 0;
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	cpu_irq_enable();
+#endif
+}
+#endif
+
+void spitfp_remove_parsed_frame(SPITFP *st) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	if(ext->parse_position > 1) {
+		ext->config_error_count = 0;
+	}
+
+#ifdef SPITFP_USE_STATISTICS
+	// Everything but NoData bytes is a valid frame, the resynchronisation
+	// after an error is complete
+	if(ext->parse_position > 1) {
+		ext->bytes_received += ext->parse_position;
+		ext->error_resync = false;
+	}
+#endif
+
+	spitfp_ringbuffer_remove(&st->ringbuffer_recv, ext->parse_position);
+	ext->parse_position = 0;
+}
+
+// Copies the payload of the frame at the start of the ringbuffer,
+// it is at most two spans
+void spitfp_copy_payload(SPITFP *st, uint8_t *message, const uint8_t length) {
+	uint8_t copied = 0;
+	while(copied < length) {
+		uint16_t span_length;
+		const uint8_t *span = spitfp_ringbuffer_get_span(&st->ringbuffer_recv, 2 + copied, &span_length);
+		if(span_length > length - copied) {
+			span_length = length - copied;
+		}
+
+		memcpy(&message[copied], span, span_length);
+		copied += span_length;
+	}
+}
+
+// Handles one TFP message, the response is built directly in buffer_send
+void spitfp_handle_tfp_message(BootloaderStatus *bootloader_status, const uint8_t *message, const uint8_t length) {
 	SPITFP *st = &bootloader_status->st;
-//	tinywdt_reset();
+	uint8_t *return_message = spitfp_get_send_message(st);
+
+	if(tfp_common_handle_message(message, length, return_message, true, bootloader_status)) {
+		const uint8_t return_length = tfp_get_length_from_message(return_message);
+#if SPITFP_SEND_WINDOW_SIZE > 1
+		// SET_SPITFP_CONFIG can switch the send window on or off, the
+		// response then has to move to where the new frame layout wants it.
+		// Nothing is pending in this case, see spitfp_set_config.
+		uint8_t *send_message = spitfp_get_send_message(st);
+		if(send_message != return_message) {
+			memmove(send_message, return_message, return_length);
+		}
+#endif
+		spitfp_send_message(st, return_length);
+	} else {
+		spitfp_send_ack(st);
+	}
+}
 
-	// Is this necessary here? We already handle this in case of NVMCTRL
-	tfp_common_handle_reset(bootloader_status);
+#ifdef SPITFP_USE_AGGREGATE_FRAMES
+// Handles the messages of an aggregate frame and sends the collected
+// responses as one frame. If the response space runs out, the remaining
+// messages are dropped.
+void spitfp_handle_aggregate(BootloaderStatus *bootloader_status, const uint8_t *message, const uint8_t length) {
+	SPITFP *st = &bootloader_status->st;
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	uint8_t offset = 0;
+
+	// The checksum only protects the frame, the master could still
+	// have put together messages that don't add up to the payload
+	while(offset < length) {
+		if(length - offset < TFP_MESSAGE_MIN_LENGTH) {
+			break;
+		}
 
-	spitfp_handle_spi_errors(st);
-	spitfp_check_message_send_timeout(st);
+		const uint8_t message_length = message[offset + offsetof(TFPMessageHeader, length)];
+		if((message_length < TFP_MESSAGE_MIN_LENGTH) || (message_length > length - offset)) {
+			break;
+		}
+		offset += message_length;
+	}
 
-	uint8_t message[TFP_MESSAGE_MAX_LENGTH] = {0};
-	uint8_t message_position = 0;
-	uint16_t num_to_remove_from_ringbuffer = 0;
-	uint8_t checksum = 0;
+	if(offset != length) {
+		SPITFP_STATISTICS_ADD(st, error_count_frame, 1);
+		spitfp_send_ack(st);
+		return;
+	}
 
-	uint8_t data_sequence_number = 0;
-	uint8_t data_length = 0;
+	offset = 0;
+	ext->aggregate_collecting = true;
+	ext->aggregate_response_length = 0;
+	while((offset < length) && (ext->aggregate_response_length <= SPITFP_AGGREGATE_RESPONSE_MAX_LENGTH - TFP_MESSAGE_MAX_LENGTH)) {
+		const uint8_t message_length = message[offset + offsetof(TFPMessageHeader, length)];
+		spitfp_handle_tfp_message(bootloader_status, &message[offset], message_length);
+		offset += message_length;
+	}
+	ext->aggregate_collecting = false;
 
-	spitfp_update_ringbuffer_pointer(st);
-	uint16_t used = ringbuffer_get_used(&st->ringbuffer_recv);
-	uint16_t start = st->ringbuffer_recv.start;
-	for(uint16_t i = start; i < start+used; i++) {
-		const uint16_t index = i % SPITFP_RECEIVE_BUFFER_SIZE;
-		const uint8_t data = st->buffer_recv[index];
-		num_to_remove_from_ringbuffer++;
-
-		switch(st->state) {
-			case SPITFP_STATE_START: {
-				checksum = 0;
-				message_position = 0;
-
-				if(data == SPITFP_PROTOCOL_OVERHEAD) {
-					st->state = SPITFP_STATE_ACK_SEQUENCE_NUMBER;
-				} else if(data >= SPITFP_MIN_TFP_MESSAGE_LENGTH && data <= SPITFP_MAX_TFP_MESSAGE_LENGTH) {
-					st->state = SPITFP_STATE_MESSAGE_SEQUENCE_NUMBER;
-				} else if(data == 0) {
-					ringbuffer_remove(&st->ringbuffer_recv, 1);
-					num_to_remove_from_ringbuffer--;
-					break;
-				} else {
-					// If the length is not PROTOCOL_OVERHEAD or within [MIN_TFP_MESSAGE_LENGTH, MAX_TFP_MESSAGE_LENGTH]
-					// or 0, something has gone wrong!
-					spitfp_handle_protocol_error(st);
-					return;
-				}
+	if(ext->aggregate_response_length > 0) {
+		spitfp_send_message(st, ext->aggregate_response_length);
+	} else {
+		spitfp_send_ack(st);
+	}
+}
+#endif
+
+void spitfp_handle_message(BootloaderStatus *bootloader_status, const uint8_t *message, const uint8_t length) {
+	PROFILE_BEGIN(PROFILE_PROBE_HANDLE_MESSAGE);
+#ifdef SPITFP_USE_AGGREGATE_FRAMES
+	if(length > tfp_get_length_from_message(message)) {
+		spitfp_handle_aggregate(bootloader_status, message, length);
+	} else {
+		spitfp_handle_tfp_message(bootloader_status, message, length);
+	}
+#else
+	spitfp_handle_tfp_message(bootloader_status, message, length);
+#endif
+	PROFILE_END(PROFILE_PROBE_HANDLE_MESSAGE);
+}
+
+// Handles a complete and valid message frame. Returns true if the
+// frame format was changed through SET_SPITFP_CONFIG.
+bool spitfp_dispatch_message(BootloaderStatus *bootloader_status, const uint8_t sequence_byte, const uint8_t *message, const uint8_t length) {
+	SPITFP *st = &bootloader_status->st;
+	SPITFP_STATISTICS_ADD(st, frames_received, 1);
+
+	// If sequence number is new, we can handle the message.
+	// Otherwise we only ACK the already handled message again.
+	// A message behind a lost one is dropped, the master re-sends it.
+	const uint8_t message_sequence_number = sequence_byte & 0x0F;
+	const uint8_t sequence_number_check = spitfp_check_sequence_number(st, message_sequence_number);
+	if(sequence_number_check == SPITFP_SEQUENCE_NUMBER_NEW) {
+		st->last_sequence_number_seen = message_sequence_number;
+		// The handle message function will send an ACK for the message
+		// if it can handle the message at the current moment.
+		// Otherwise it return false. In that case the SPI master
+		// will send the message again and we can handle it then.
+		spitfp_handle_message(bootloader_status, message, length);
+	} else if(sequence_number_check == SPITFP_SEQUENCE_NUMBER_DUPLICATE) {
+		spitfp_send_ack(st);
+	}
+
+#ifdef SPITFP_USE_DMAC_CRC
+	// A checksum change requested with SET_SPITFP_CONFIG is used after
+	// the response is built. Everything the master sends from now on
+	// uses the new checksum.
+	if(spitfp_get_extension(st)->checksum_size != spitfp_get_extension(st)->checksum_size_pending) {
+		spitfp_get_extension(st)->checksum_size = spitfp_get_extension(st)->checksum_size_pending;
+		spitfp_get_extension(st)->checksum_confirmed = false;
+		return true;
+	}
+#endif
+
+	return false;
+}
+
+#ifndef SPITFP_USE_IRQ_RECEIVE
+// Only used for a message that wraps around at the end of the ringbuffer.
+// It is not inlined, so the stack for the copy is only used in this case.
+__attribute__((noinline)) bool spitfp_dispatch_message_copy(BootloaderStatus *bootloader_status, const uint8_t length) {
+	uint8_t message[SPITFP_MAX_RECEIVE_TFP_MESSAGE_LENGTH];
+	spitfp_copy_payload(&bootloader_status->st, message, length);
+
+	return spitfp_dispatch_message(bootloader_status, spitfp_get_extension(&bootloader_status->st)->parse_sequence_number, message, length);
+}
+#endif
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+// Single-producer/single-consumer queue: Only the interrupt handler
+// writes receive_queue_head and only spitfp_tick writes receive_queue_tail.
+// Both are free running, the slot is the index modulo queue size.
+bool spitfp_receive_queue_push(SPITFP *st, const uint8_t length) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	const uint8_t head = ext->receive_queue_head;
+	if((uint8_t)(head - ext->receive_queue_tail) >= SPITFP_RECEIVE_QUEUE_SIZE) {
+		return false;
+	}
+
+	const uint8_t slot = head & (SPITFP_RECEIVE_QUEUE_SIZE - 1);
+	ext->receive_queue_sequence_byte[slot] = ext->parse_sequence_number;
+	ext->receive_queue_length[slot] = length;
+	spitfp_copy_payload(st, ext->receive_queue_data[slot], length);
+
+	// Slot has to be complete before it becomes visible to the consumer
+	__DMB();
+	ext->receive_queue_head = head + 1;
+
+	return true;
+}
+
+void spitfp_handle_receive_queue(BootloaderStatus *bootloader_status) {
+	SPITFP *st = &bootloader_status->st;
+	SPITFPExtension *ext = spitfp_get_extension(st);
 
-				data_length = data;
-				PEARSON(checksum, data_length);
+	while(ext->receive_queue_tail != ext->receive_queue_head) {
+		const uint8_t tail = ext->receive_queue_tail;
+		const uint8_t slot = tail & (SPITFP_RECEIVE_QUEUE_SIZE - 1);
 
-				break;
+		spitfp_handle_ack(st, ext->receive_queue_sequence_byte[slot]);
+
+		// Length 0 is an ACK packet, otherwise we handle the message directly
+		// from the queue. We can only do this if we can answer it, otherwise
+		// it stays in the queue until the next tick.
+		if(ext->receive_queue_length[slot] > 0) {
+			if(!spitfp_is_send_possible(st)) {
+				return;
 			}
 
-			case SPITFP_STATE_ACK_SEQUENCE_NUMBER: {
-				data_sequence_number = data;
-				PEARSON(checksum, data_sequence_number);
-				st->state = SPITFP_STATE_ACK_CHECKSUM;
-				break;
+			spitfp_dispatch_message(bootloader_status, ext->receive_queue_sequence_byte[slot], ext->receive_queue_data[slot], ext->receive_queue_length[slot]);
+		}
+
+		const bool was_full = (uint8_t)(ext->receive_queue_head - tail) >= SPITFP_RECEIVE_QUEUE_SIZE;
+
+		__DMB();
+		ext->receive_queue_tail = tail + 1;
+
+		// The parser stops if the queue is full, so we have to restart it
+		if(was_full) {
+			NVIC_SetPendingIRQ(SPITFP_IRQN);
+		}
+	}
+}
+#endif
+
+#ifdef SPITFP_USE_SEND_QUEUE
+// The send queue uses free running indices like the receive queue. It is
+// only used from the main loop, don't call this from an interrupt.
+// Returns false if the queue is full and nothing could be coalesced.
+bool spitfp_enqueue_message(SPITFP *st, const uint8_t *data, const uint8_t length, const bool coalesce) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	if(length > TFP_MESSAGE_MAX_LENGTH) {
+		return false;
+	}
+
+	uint8_t slot;
+	if(coalesce) {
+		// Replace a queued message of the same callback
+		const TFPMessageHeader *header = (const TFPMessageHeader *)data;
+		for(uint8_t i = ext->send_queue_tail; i != ext->send_queue_head; i++) {
+			slot = i & (SPITFP_SEND_QUEUE_SIZE - 1);
+			const TFPMessageHeader *queued_header = (const TFPMessageHeader *)ext->send_queue_data[slot];
+			if((queued_header->uid == header->uid) && (queued_header->fid == header->fid)) {
+				memcpy(ext->send_queue_data[slot], data, length);
+				ext->send_queue_length[slot] = length;
+				return true;
 			}
+		}
+	}
+
+	if((uint8_t)(ext->send_queue_head - ext->send_queue_tail) >= SPITFP_SEND_QUEUE_SIZE) {
+		return false;
+	}
+
+	slot = ext->send_queue_head & (SPITFP_SEND_QUEUE_SIZE - 1);
+	memcpy(ext->send_queue_data[slot], data, length);
+	ext->send_queue_length[slot] = length;
+	ext->send_queue_head++;
+
+	return true;
+}
+
+void spitfp_handle_send_queue(SPITFP *st) {
+	SPITFPExtension *ext = spitfp_get_extension(st);
+	// In window mode several queued messages can go out at once
+	while((ext->send_queue_tail != ext->send_queue_head) && spitfp_is_send_possible(st)) {
+		const uint8_t slot = ext->send_queue_tail & (SPITFP_SEND_QUEUE_SIZE - 1);
+		spitfp_send_ack_and_message(st, ext->send_queue_data[slot], ext->send_queue_length[slot]);
+		ext->send_queue_tail++;
+	}
+}
+#endif
+
+#ifdef SPITFP_USE_DMAC_CRC
+// With CRC the checksum is calculated over the complete frame by
+// spitfp_crc_check, the Pearson hash is only needed with checksum size 1
+#define SPITFP_PARSE_PEARSON(ext, data) do { \
+	if((ext)->checksum_size == 1) { \
+		PEARSON((ext)->parse_checksum, (data)); \
+	} \
+} while(0)
+#else
+#define SPITFP_PARSE_PEARSON(ext, data) PEARSON((ext)->parse_checksum, (data))
+#endif
+
+void spitfp_parse(BootloaderStatus *bootloader_status) {
+	SPITFP *st = &bootloader_status->st;
+	SPITFPExtension *ext = spitfp_get_extension(st);
+
+	// The parser state (position, checksum, length and sequence number of the
+	// current frame) is kept in st between ticks. A frame always starts at the
+	// beginning of the ringbuffer and parse_position bytes of it have already
+	// been parsed, so we continue with the first byte that is new.
+	const uint8_t overhead = spitfp_get_protocol_overhead(st);
+	const uint8_t message_max_length = spitfp_get_message_max_length(st);
+
+	// The unparsed data is walked in contiguous spans. Removing a frame
+	// moves the start of the ringbuffer to the next byte of the span, so
+	// we can just continue. Only after a protocol error the bytes after the
+	// first one have to be parsed again and we get the spans again.
+	spitfp_update_ringbuffer_pointer(st);
+	uint16_t span_length;
+	const uint8_t *span;
+	while((span = spitfp_ringbuffer_get_span(&st->ringbuffer_recv, ext->parse_position, &span_length)) != NULL) {
+		for(uint16_t i = 0; i < span_length; i++) {
+			const uint8_t data = span[i];
+			ext->parse_position++;
+
+			switch(st->state) {
+				case SPITFP_STATE_START: {
+					ext->parse_checksum = 0;
+
+					if(data == overhead) {
+						st->state = SPITFP_STATE_ACK_SEQUENCE_NUMBER;
+					} else if(data >= TFP_MESSAGE_MIN_LENGTH + overhead && data <= message_max_length + overhead) {
+						st->state = SPITFP_STATE_MESSAGE_SEQUENCE_NUMBER;
+					} else if(data == 0) {
+						spitfp_remove_parsed_frame(st);
+						break;
+					} else {
+						// If the length is not PROTOCOL_OVERHEAD or within [MIN_TFP_MESSAGE_LENGTH, MAX_TFP_MESSAGE_LENGTH]
+						// or 0, something has gone wrong!
+						SPITFP_STATISTICS_ADD_ERROR(st, error_count_frame);
+						goto protocol_error;
+					}
 
-			case SPITFP_STATE_ACK_CHECKSUM: {
-				// Whatever happens here, we will go to start again and remove
-				// data from ringbuffer
-				st->state = SPITFP_STATE_START;
-				ringbuffer_remove(&st->ringbuffer_recv, num_to_remove_from_ringbuffer);
-				num_to_remove_from_ringbuffer = 0;
+					ext->parse_length = data;
+					SPITFP_PARSE_PEARSON(ext, ext->parse_length);
 
-				if(checksum != data) {
-					spitfp_handle_protocol_error(st);
-					return;
+					break;
 				}
 
-				uint8_t last_sequence_number_seen_by_master = (data_sequence_number & 0xF0) >> 4;
-				if(last_sequence_number_seen_by_master == st->current_sequence_number) {
-					st->buffer_send_length = 0;
+				case SPITFP_STATE_ACK_SEQUENCE_NUMBER: {
+					// An ACK has no sequence number of its own
+					if((data & 0x0F) != 0) {
+						SPITFP_STATISTICS_ADD_ERROR(st, error_count_frame);
+						goto protocol_error;
+					}
+
+					ext->parse_sequence_number = data;
+					SPITFP_PARSE_PEARSON(ext, ext->parse_sequence_number);
+					st->state = SPITFP_STATE_ACK_CHECKSUM;
+					break;
 				}
 
-				break;
-			}
+				case SPITFP_STATE_ACK_CHECKSUM: {
+					// Wait for the last checksum byte (only necessary with CRC)
+					if(ext->parse_position < ext->parse_length) {
+						break;
+					}
 
-			case SPITFP_STATE_MESSAGE_SEQUENCE_NUMBER: {
-				data_sequence_number = data;
-				PEARSON(checksum, data_sequence_number);
-				st->state = SPITFP_STATE_MESSAGE_DATA;
-				break;
-			}
+					if(!spitfp_is_checksum_valid(st, data)) {
+						SPITFP_STATISTICS_ADD_ERROR(st, error_count_ack_checksum);
+						goto protocol_error;
+					}
 
-			case SPITFP_STATE_MESSAGE_DATA: {
-				message[message_position] = data;
-				message_position++;
+#ifdef SPITFP_USE_IRQ_RECEIVE
+					if(!spitfp_receive_queue_push(st, 0)) {
+						// Queue is full, look at the checksum byte again later
+						ext->parse_position--;
+						return;
+					}
+#else
+					spitfp_handle_ack(st, ext->parse_sequence_number);
+#endif
 
-				PEARSON(checksum, data);
+					// Go to start again and remove data from ringbuffer
+					st->state = SPITFP_STATE_START;
+					spitfp_remove_parsed_frame(st);
 
-				if(message_position == data_length - SPITFP_PROTOCOL_OVERHEAD) {
-					st->state = SPITFP_STATE_MESSAGE_CHECKSUM;
+					break;
 				}
-				break;
-			}
 
-			case SPITFP_STATE_MESSAGE_CHECKSUM: {
-				// Whatever happens here, we will go to start again
-				st->state = SPITFP_STATE_START;
+				case SPITFP_STATE_MESSAGE_SEQUENCE_NUMBER: {
+					// Sequence numbers of messages are in [1, 15]
+					if((data & 0x0F) == 0) {
+						SPITFP_STATISTICS_ADD_ERROR(st, error_count_frame);
+						goto protocol_error;
+					}
 
-				if(checksum != data) {
-					spitfp_handle_protocol_error(st);
-					return;
+					ext->parse_sequence_number = data;
+					SPITFP_PARSE_PEARSON(ext, ext->parse_sequence_number);
+					st->state = SPITFP_STATE_MESSAGE_DATA;
+					break;
 				}
 
-				uint8_t last_sequence_number_seen_by_master = (data_sequence_number & 0xF0) >> 4;
-				if(last_sequence_number_seen_by_master == st->current_sequence_number) {
-					st->buffer_send_length = 0;
+				case SPITFP_STATE_MESSAGE_DATA: {
+					// The payload stays in the ringbuffer until the frame is complete,
+					// we only need to hash it here (Pearson, CRC is calculated over the
+					// complete frame). parse_position includes the length and sequence
+					// number bytes.
+					SPITFP_PARSE_PEARSON(ext, data);
+
+					// The TFP header repeats the length of the message. This rejects
+					// wrong frame starts during a resynchronisation early and with
+					// far more certainty than the 8 bit checksum alone.
+					if((ext->parse_position == 2 + offsetof(TFPMessageHeader, length) + 1) && !spitfp_is_tfp_length_valid(st, data, ext->parse_length - overhead)) {
+						SPITFP_STATISTICS_ADD_ERROR(st, error_count_frame);
+						goto protocol_error;
+					}
+
+					if(ext->parse_position == ext->parse_length - (overhead - 2)) {
+						st->state = SPITFP_STATE_MESSAGE_CHECKSUM;
+					}
+					break;
 				}
 
-				const uint8_t message_sequence_number = data_sequence_number & 0x0F;
-
-				if(spitfp_is_send_possible(st)) {
-					// If we can currently send a message, we can now definitely remove
-					// the data from ring buffer.
-					ringbuffer_remove(&st->ringbuffer_recv, num_to_remove_from_ringbuffer);
-					num_to_remove_from_ringbuffer = 0;
-
-					// If sequence number is new, we can handle the message.
-					// Otherwise we only ACK the already handled message again.
-					if(message_sequence_number != st->last_sequence_number_seen) {
-						st->last_sequence_number_seen = message_sequence_number;
-						// The handle message function will send an ACK for the message
-						// if it can handle the message at the current moment.
-						// Otherwise it return false. In that case the SPI master
-						// will send the message again and we can handle it then.
-						tfp_common_handle_message(message, message_position, bootloader_status);
+				case SPITFP_STATE_MESSAGE_CHECKSUM: {
+					// Wait for the last checksum byte (only necessary with CRC)
+					if(ext->parse_position < ext->parse_length) {
+						break;
+					}
+
+					if(!spitfp_is_checksum_valid(st, data)) {
+						SPITFP_STATISTICS_ADD_ERROR(st, error_count_message_checksum);
+						goto protocol_error;
+					}
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+					// In interrupt mode the message is put into the receive queue,
+					// ACK and message are handled from spitfp_tick.
+					if(!spitfp_receive_queue_push(st, ext->parse_length - overhead)) {
+						// Queue is full. The frame stays in the ringbuffer and we only
+						// look at its checksum byte again with the next interrupt.
+						ext->parse_position--;
+						return;
+					}
+
+					st->state = SPITFP_STATE_START;
+					spitfp_remove_parsed_frame(st);
+#else
+					spitfp_handle_ack(st, ext->parse_sequence_number);
+
+					if(!spitfp_is_send_possible(st)) {
+						// We can't answer right now. The frame stays in the ringbuffer
+						// and we only look at its checksum byte again with the next tick.
+						// The master may already have sent the next frames, so we can't
+						// continue parsing here, the frames have to be handled in order.
+						ext->parse_position--;
+						return;
+					}
+
+					// The payload starts after the length and sequence number bytes.
+					// If it does not wrap around in the ringbuffer, the message is
+					// handled in place. The frame is removed afterwards.
+					const uint8_t message_length = ext->parse_length - overhead;
+					uint16_t message_span_length;
+					const uint8_t *message = spitfp_ringbuffer_get_span(&st->ringbuffer_recv, 2, &message_span_length);
+					bool config_changed;
+					if(message_span_length >= message_length) {
+						config_changed = spitfp_dispatch_message(bootloader_status, ext->parse_sequence_number, message, message_length);
 					} else {
-						spitfp_send_ack(st);
+						config_changed = spitfp_dispatch_message_copy(bootloader_status, message_length);
 					}
+
+					st->state = SPITFP_STATE_START;
+					spitfp_remove_parsed_frame(st);
+
+					if(config_changed) {
+						// The frame format changed, parse the rest with the next tick
+						return;
+					}
+#endif
+
+					break;
 				}
+			}
+
+			continue;
 
-				break;
+protocol_error:
+			if(spitfp_check_config_fallback(st)) {
+				// The frame format changed, parse again with the next tick
+				return;
 			}
+
+			// The bytes after the first one are parsed again,
+			// they start with a new span
+			spitfp_handle_protocol_error(st);
+			break;
 		}
 	}
+}
 
-	st->state = SPITFP_STATE_START;
+#ifdef SPITFP_USE_IRQ_RECEIVE
+// Has to be called from the SERCOM interrupt handler of the SPITFP SPI module
+void spitfp_irq_handler(BootloaderStatus *bootloader_status) {
+	// In slave mode TXC is set when the master releases slave select,
+	// so we parse the received data after every SPI transaction
+	bootloader_status->st.spi_module.hw->SPI.INTFLAG.reg = SERCOM_SPI_INTFLAG_TXC;
+
+	PROFILE_BEGIN(PROFILE_PROBE_SPITFP_PARSE);
+	spitfp_parse(bootloader_status);
+	PROFILE_END(PROFILE_PROBE_SPITFP_PARSE);
+}
+#endif
+
+void spitfp_tick(BootloaderStatus *bootloader_status) {
+	SPITFP *st = &bootloader_status->st;
+//	tinywdt_reset();
+
+	// Is this necessary here? We already handle this in case of NVMCTRL
+	tfp_common_handle_reset(bootloader_status);
+
+	spitfp_handle_spi_errors(st);
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	// The parser went back to the defaults, see spitfp_check_config_fallback
+	if(spitfp_get_extension(st)->config_reset_pending) {
+		spitfp_get_extension(st)->config_reset_pending = false;
+		spitfp_reset_send_config(st);
+	}
+#endif
+
+	spitfp_check_message_send_timeout(st, bootloader_get_system_timer_tick(bootloader_status));
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	// Frames are parsed in the SERCOM interrupt
+	spitfp_handle_receive_queue(bootloader_status);
+#else
+	PROFILE_BEGIN(PROFILE_PROBE_SPITFP_PARSE);
+	spitfp_parse(bootloader_status);
+	PROFILE_END(PROFILE_PROBE_SPITFP_PARSE);
+#endif
+
+#ifdef SPITFP_USE_SEND_QUEUE
+	// Received messages first, their responses don't have to wait
+	// behind the queued messages
+	spitfp_handle_send_queue(st);
+#endif
 }
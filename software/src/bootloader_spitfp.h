@@ -22,6 +22,8 @@
 #ifndef BOOTLOADER_SPITFP_H
 #define BOOTLOADER_SPITFP_H
 
+#include <stddef.h>
+
 #include "configs/config.h"
 
 #include "spi.h"
@@ -31,10 +33,237 @@
 #include "bricklib2/bootloader/tinydma.h"
 #include "bricklib2/bootloader/bootloader.h"
 
+#ifndef SPITFP_SEND_WINDOW_SIZE
+#define SPITFP_SEND_WINDOW_SIZE 1
+#endif
+
+#if SPITFP_SEND_WINDOW_SIZE < 1 || SPITFP_SEND_WINDOW_SIZE > 3
+#error "SPITFP_SEND_WINDOW_SIZE has to be in [1, 3]"
+#endif
+
+// With SPITFP_USE_DMAC_CRC the one byte Pearson checksum can be replaced
+// by a CRC-16 or CRC-32 that is calculated by the DMAC CRC engine
+#ifdef SPITFP_USE_DMAC_CRC
+#define SPITFP_MAX_CHECKSUM_SIZE 4
+#else
+#define SPITFP_MAX_CHECKSUM_SIZE 1
+#endif
+
+#define SPITFP_MAX_PROTOCOL_OVERHEAD (SPITFP_PROTOCOL_OVERHEAD - 1 + SPITFP_MAX_CHECKSUM_SIZE)
+
+// With SPITFP_USE_JUMBO_FRAMES the master can enable bigger messages from
+// master to slave in bootloader mode: A TFP header and three 64 byte pages.
+// With a CRC-32 such a frame still fits the 8 bit length byte.
+#ifdef SPITFP_USE_JUMBO_FRAMES
+#define SPITFP_JUMBO_TFP_MESSAGE_MAX_LENGTH 200
+#define SPITFP_MAX_RECEIVE_TFP_MESSAGE_LENGTH SPITFP_JUMBO_TFP_MESSAGE_MAX_LENGTH
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+#error "SPITFP_USE_JUMBO_FRAMES can't be used with SPITFP_USE_IRQ_RECEIVE (receive queue is sized for TFP_MESSAGE_MAX_LENGTH)"
+#endif
+#else
+#define SPITFP_MAX_RECEIVE_TFP_MESSAGE_LENGTH TFP_MESSAGE_MAX_LENGTH
+#endif
+
+#define SPITFP_MIN_TFP_MESSAGE_LENGTH (TFP_MESSAGE_MIN_LENGTH + SPITFP_PROTOCOL_OVERHEAD)
+#define SPITFP_MAX_TFP_MESSAGE_LENGTH (TFP_MESSAGE_MAX_LENGTH + SPITFP_MAX_PROTOCOL_OVERHEAD)
+
+// With SPITFP_USE_AGGREGATE_FRAMES the master can enable frames with several
+// TFP messages. The responses are collected in one frame of up to
+// SPITFP_AGGREGATE_RESPONSE_MAX_LENGTH bytes. A message is only handled if
+// a response of TFP_MESSAGE_MAX_LENGTH still fits.
+#ifdef SPITFP_USE_AGGREGATE_FRAMES
+#define SPITFP_AGGREGATE_RESPONSE_MAX_LENGTH (2*TFP_MESSAGE_MAX_LENGTH)
+
+#if SPITFP_SEND_WINDOW_SIZE > 1
+#error "SPITFP_USE_AGGREGATE_FRAMES can't be used with SPITFP_SEND_WINDOW_SIZE > 1"
+#endif
+
+#define SPITFP_SEND_BUFFER_SIZE (SPITFP_MAX_PROTOCOL_OVERHEAD + SPITFP_AGGREGATE_RESPONSE_MAX_LENGTH + SPITFP_MAX_PROTOCOL_OVERHEAD)
+#elif SPITFP_SEND_WINDOW_SIZE > 1
+// In window mode the first SPITFP_MAX_PROTOCOL_OVERHEAD bytes are reserved
+// for an ACK, the unacknowledged frames follow back-to-back.
+#define SPITFP_SEND_BUFFER_SIZE (SPITFP_MAX_PROTOCOL_OVERHEAD + SPITFP_SEND_WINDOW_SIZE*SPITFP_MAX_TFP_MESSAGE_LENGTH)
+#else
+#define SPITFP_SEND_BUFFER_SIZE SPITFP_MAX_TFP_MESSAGE_LENGTH
+#endif
+
+// Size of SPITFP.buffer_send in bricklib2. If SPITFP_SEND_BUFFER_SIZE is
+// bigger, the send buffer is in SPITFPExtension instead.
+#define SPITFP_BASE_SEND_BUFFER_SIZE (TFP_MESSAGE_MAX_LENGTH + SPITFP_PROTOCOL_OVERHEAD*2)
+
+#if SPITFP_SEND_BUFFER_SIZE > 255
+#error "SPITFP_SEND_BUFFER_SIZE has to fit into buffer_send_length, reduce SPITFP_SEND_WINDOW_SIZE"
+#endif
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+#ifndef SPITFP_RECEIVE_QUEUE_SIZE
+#define SPITFP_RECEIVE_QUEUE_SIZE 2
+#endif
+
+#if (SPITFP_RECEIVE_QUEUE_SIZE & (SPITFP_RECEIVE_QUEUE_SIZE - 1)) != 0
+#error "SPITFP_RECEIVE_QUEUE_SIZE has to be a power of two"
+#endif
+
+#ifndef SPITFP_IRQN
+#define SPITFP_IRQN SERCOM0_IRQn
+#endif
+#endif
+
+#ifdef SPITFP_USE_SEND_QUEUE
+#ifndef SPITFP_SEND_QUEUE_SIZE
+#define SPITFP_SEND_QUEUE_SIZE 2
+#endif
+
+#if (SPITFP_SEND_QUEUE_SIZE & (SPITFP_SEND_QUEUE_SIZE - 1)) != 0
+#error "SPITFP_SEND_QUEUE_SIZE has to be a power of two"
+#endif
+#endif
+
+#define SPITFP_FEATURE_SEND_WINDOW (1 << 0)
+#define SPITFP_FEATURE_CRC16       (1 << 1)
+#define SPITFP_FEATURE_CRC32       (1 << 2)
+#define SPITFP_FEATURE_JUMBO       (1 << 3)
+#define SPITFP_FEATURE_AGGREGATE   (1 << 4)
+
+// Result of spitfp_check_sequence_number for a received message
+#define SPITFP_SEQUENCE_NUMBER_NEW          0
+#define SPITFP_SEQUENCE_NUMBER_DUPLICATE    1
+#define SPITFP_SEQUENCE_NUMBER_OUT_OF_ORDER 2
+
+// A restarted master talks without the SET_SPITFP_CONFIG features again.
+// After this many protocol errors without a valid frame in between we go
+// back to the defaults too. During the resynchronisation after a corrupted
+// frame every byte of it can be counted, so this has to be well above two
+// frames of maximum length.
+#ifndef SPITFP_CONFIG_FALLBACK_ERRORS
+#define SPITFP_CONFIG_FALLBACK_ERRORS 512
+#endif
+
+// With SPITFP_USE_STATISTICS the link errors and the throughput are counted
+// in SPITFP. The error counts are read with GET_SPITFP_ERROR_COUNT.
+// Errors are counted once per corrupted frame, not for every frame start
+// that is rejected during the resynchronisation after it.
+// Frames are re-sent whenever the DMA is idle. A re-send is only counted if
+// the oldest frame was clocked out completely and is not ACKed after
+// SPITFP_RESEND_TIMEOUT ms, then again every SPITFP_RESEND_TIMEOUT ms.
+#ifndef SPITFP_RESEND_TIMEOUT
+#define SPITFP_RESEND_TIMEOUT 10
+#endif
+
+#ifdef SPITFP_USE_STATISTICS
+#define SPITFP_STATISTICS_ADD(st, counter, value) do { spitfp_get_extension(st)->counter += (value); } while(0)
+#define SPITFP_STATISTICS_ADD_ERROR(st, counter) do { if(!spitfp_get_extension(st)->error_resync) { spitfp_get_extension(st)->counter++; } } while(0)
+#else
+#define SPITFP_STATISTICS_ADD(st, counter, value)
+#define SPITFP_STATISTICS_ADD_ERROR(st, counter)
+#endif
+
+// SPITFP state that is not part of the SPITFP struct of bricklib2. The
+// layout of SPITFP (and BootloaderStatus) is shared with firmwares that
+// were built against older bricklib2 versions, so it can't change. The
+// extension is at the start of BootloaderStatus.extension, only the
+// bootloader knows its layout (see firmware_entry.h).
+typedef struct {
+	// Parser state of the frame at the start of the ringbuffer, see spitfp_parse
+	uint16_t parse_position;
+	uint8_t parse_checksum;
+	uint8_t parse_length;
+	uint8_t parse_sequence_number;
+
+	// Fallback to the defaults after a restart of the master, see spitfp_check_config_fallback
+	uint16_t config_error_count;
+	bool master_synchronized;
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	volatile bool config_reset_pending;
+#endif
+
+#if SPITFP_SEND_WINDOW_SIZE > 1
+	uint8_t send_window_size;
+	uint8_t send_window_frames;
+	uint8_t send_window_acked;
+	bool send_window_ack_pending;
+#endif
+
+#ifdef SPITFP_USE_DMAC_CRC
+	uint8_t checksum_size;
+	uint8_t checksum_size_pending;
+	bool checksum_confirmed; // The master sent a valid frame with checksum_size
+#endif
+
+#ifdef SPITFP_USE_JUMBO_FRAMES
+	uint8_t message_max_length;
+#endif
+
+#ifdef SPITFP_USE_AGGREGATE_FRAMES
+	bool aggregate_enabled;
+	bool aggregate_collecting;
+	uint8_t aggregate_response_length;
+#endif
+
+#ifdef SPITFP_USE_STATISTICS
+	bool error_resync;
+	uint32_t error_count_ack_checksum;
+	uint32_t error_count_message_checksum;
+	uint32_t error_count_frame;
+	uint32_t error_count_overflow;
+	uint32_t resend_count;
+	uint32_t resend_time;           // Oldest frame clocked out or counted as re-sent
+	uint8_t resend_sequence_number; // Of the oldest frame, 0 if nothing is pending
+	uint32_t bytes_received;
+	uint32_t bytes_sent;
+	uint32_t frames_received;
+	uint32_t frames_sent;
+#endif
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+	uint8_t receive_queue_data[SPITFP_RECEIVE_QUEUE_SIZE][TFP_MESSAGE_MAX_LENGTH];
+	uint8_t receive_queue_length[SPITFP_RECEIVE_QUEUE_SIZE];
+	uint8_t receive_queue_sequence_byte[SPITFP_RECEIVE_QUEUE_SIZE];
+	volatile uint8_t receive_queue_head;
+	volatile uint8_t receive_queue_tail;
+#endif
+
+#ifdef SPITFP_USE_SEND_QUEUE
+	uint8_t send_queue_data[SPITFP_SEND_QUEUE_SIZE][TFP_MESSAGE_MAX_LENGTH];
+	uint8_t send_queue_length[SPITFP_SEND_QUEUE_SIZE];
+	uint8_t send_queue_head;
+	uint8_t send_queue_tail;
+#endif
+
+#if SPITFP_SEND_BUFFER_SIZE > SPITFP_BASE_SEND_BUFFER_SIZE
+	uint8_t buffer_send[SPITFP_SEND_BUFFER_SIZE];
+#endif
+} SPITFPExtension;
+
+static inline SPITFPExtension *spitfp_get_extension(SPITFP *st) {
+	BootloaderStatus *bs = (BootloaderStatus *)((uint8_t *)st - offsetof(BootloaderStatus, st));
+	return (SPITFPExtension *)bs->extension;
+}
+
+static inline uint8_t *spitfp_get_send_buffer(SPITFP *st) {
+#if SPITFP_SEND_BUFFER_SIZE > SPITFP_BASE_SEND_BUFFER_SIZE
+	return spitfp_get_extension(st)->buffer_send;
+#else
+	return st->buffer_send;
+#endif
+}
+
 void spitfp_init(SPITFP *st);
+void spitfp_init_hardware(SPITFP *st);
+void spitfp_update_ringbuffer_pointer(SPITFP *st);
+uint8_t spitfp_get_sequence_byte(SPITFP *st, const bool increase);
+void spitfp_enable_tx_dma(SPITFP *st);
 void spitfp_tick(BootloaderStatus *bootloader_status);
 bool spitfp_is_send_possible(SPITFP *st);
 void spitfp_send_ack_and_message(SPITFP *st, uint8_t *data, const uint8_t length);
+uint8_t *spitfp_get_send_message(SPITFP *st);
+void spitfp_send_message(SPITFP *st, const uint8_t length);
 void spitfp_send_ack(SPITFP *st);
+uint8_t spitfp_set_config(SPITFP *st, const uint8_t features, uint8_t *send_window_size);
+bool spitfp_is_config_default(SPITFP *st);
+void spitfp_irq_handler(BootloaderStatus *bootloader_status);
+bool spitfp_enqueue_message(SPITFP *st, const uint8_t *data, const uint8_t length, const bool coalesce);
+void spitfp_clear_statistics(SPITFP *st);
 
 #endif
@@ -0,0 +1,264 @@
+/* brickletboot
+ * Copyright (C) 2010 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * bootloader_spitfp_legacy.c: SPITFP for firmwares without extension
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+
+Firmwares that were built before BootloaderStatus had an extension (or
+that don't reserve it) only have the SPITFP struct of bricklib2. This is
+the original SPITFP implementation, it only uses that struct:
+* Stop-and-wait with the one byte Pearson checksum, no SET_SPITFP_CONFIG
+* The frame is parsed from the start of the ringbuffer in every tick
+* In case of error the complete ringbuffer is emptied
+* The message is copied to the stack, the response is built on the stack
+  and copied to buffer_send
+
+*/
+
+#include "bootloader_spitfp_legacy.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#include "io.h"
+#include "tfp_common.h"
+
+#include "bricklib2/utility/pearson_hash.h"
+
+static void spitfp_legacy_send_ack(SPITFP *st) {
+	// Set new sequence number and checksum for ACK
+	st->buffer_send[0] = SPITFP_PROTOCOL_OVERHEAD;
+	st->buffer_send[1] = st->last_sequence_number_seen << 4;
+	st->buffer_send[2] = pearson_permutation[pearson_permutation[st->buffer_send[0]] ^ st->buffer_send[1]];
+
+	st->descriptor_tx.BTCNT.reg = SPITFP_PROTOCOL_OVERHEAD;
+	st->descriptor_tx.SRCADDR.reg = (uint32_t)(st->buffer_send + SPITFP_PROTOCOL_OVERHEAD);
+
+	spitfp_enable_tx_dma(st);
+}
+
+void spitfp_legacy_send_ack_and_message(SPITFP *st, uint8_t *data, const uint8_t length) {
+	uint8_t checksum = 0;
+	st->buffer_send_length = length + SPITFP_PROTOCOL_OVERHEAD;
+	st->buffer_send[0] = st->buffer_send_length;
+	PEARSON(checksum, st->buffer_send_length);
+
+	st->buffer_send[1] = spitfp_get_sequence_byte(st, true);
+	PEARSON(checksum, st->buffer_send[1]);
+
+	for(uint8_t i = 0; i < length; i++) {
+		st->buffer_send[2+i] = data[i];
+		PEARSON(checksum, st->buffer_send[2+i]);
+	}
+
+	st->buffer_send[length + SPITFP_PROTOCOL_OVERHEAD-1] = checksum;
+
+	st->descriptor_tx.BTCNT.reg = st->buffer_send_length;
+	st->descriptor_tx.SRCADDR.reg = (uint32_t)(st->buffer_send + st->buffer_send_length);
+
+	spitfp_enable_tx_dma(st);
+}
+
+bool spitfp_legacy_is_send_possible(SPITFP *st) {
+	return (st->descriptor_section[TINYDMA_SPITFP_TX_INDEX].DESCADDR.reg == (uint32_t)&st->descriptor_section[TINYDMA_SPITFP_TX_INDEX]) &&
+	       (st->buffer_send_length == 0);
+}
+
+static void spitfp_legacy_handle_spi_errors(SPITFP *st) {
+	if(st->spi_module.hw->SPI.INTFLAG.bit.ERROR) {
+		// Atmel has a #define ENABLE 1 somewhere in the configs,
+		// we need to undef it to use the ENABLE bit
+#undef ENABLE
+		st->spi_module.hw->SPI.CTRLA.bit.ENABLE = 0;
+		while(st->spi_module.hw->SPI.SYNCBUSY.bit.ENABLE);
+		st->spi_module.hw->SPI.CTRLA.bit.ENABLE = 1;
+		while(st->spi_module.hw->SPI.SYNCBUSY.bit.ENABLE);
+#define ENABLE 1
+	}
+}
+
+static void spitfp_legacy_check_message_send_timeout(SPITFP *st) {
+	// We use a timeout of 0 here, since the master is polling us anyway and it
+	// can handle duplicates through the sequence number we loose nothing by
+	// immediately re-sending the message.
+	if((st->descriptor_section[TINYDMA_SPITFP_TX_INDEX].DESCADDR.reg == (uint32_t)&st->descriptor_section[TINYDMA_SPITFP_TX_INDEX]) && (st->buffer_send_length > 0)) {
+		// We leave the old message the same and try again
+		st->descriptor_tx.BTCNT.reg = st->buffer_send_length;
+		st->descriptor_tx.SRCADDR.reg = (uint32_t)(st->buffer_send + st->buffer_send_length);
+
+		spitfp_enable_tx_dma(st);
+	}
+}
+
+static void spitfp_legacy_handle_protocol_error(SPITFP *st) {
+	// In case of error we completely empty the ringbuffer
+	uint8_t data;
+	while(ringbuffer_get(&st->ringbuffer_recv, &data));
+	st->state = SPITFP_STATE_START;
+}
+
+static void spitfp_legacy_handle_message(BootloaderStatus *bootloader_status, const uint8_t *message, const uint8_t length) {
+	SPITFP *st = &bootloader_status->st;
+	uint8_t return_message[TFP_MESSAGE_MAX_LENGTH];
+
+	if(tfp_common_handle_message(message, length, return_message, false, bootloader_status)) {
+		spitfp_legacy_send_ack_and_message(st, return_message, tfp_get_length_from_message(return_message));
+	} else {
+		spitfp_legacy_send_ack(st);
+	}
+}
+
+void spitfp_legacy_tick(BootloaderStatus *bootloader_status) {
+	SPITFP *st = &bootloader_status->st;
+
+	// RESET and SET_BOOTLOADER_MODE only set the boot mode, the reset
+	// (and erase) happens here
+	tfp_common_handle_reset(bootloader_status);
+
+	spitfp_legacy_handle_spi_errors(st);
+	spitfp_legacy_check_message_send_timeout(st);
+
+	uint8_t message[TFP_MESSAGE_MAX_LENGTH] = {0};
+	uint8_t message_position = 0;
+	uint16_t num_to_remove_from_ringbuffer = 0;
+	uint8_t checksum = 0;
+
+	uint8_t data_sequence_number = 0;
+	uint8_t data_length = 0;
+
+	spitfp_update_ringbuffer_pointer(st);
+	uint16_t used = ringbuffer_get_used(&st->ringbuffer_recv);
+	uint16_t start = st->ringbuffer_recv.start;
+	for(uint16_t i = start; i < start+used; i++) {
+		const uint16_t index = i % SPITFP_RECEIVE_BUFFER_SIZE;
+		const uint8_t data = st->buffer_recv[index];
+		num_to_remove_from_ringbuffer++;
+
+		switch(st->state) {
+			case SPITFP_STATE_START: {
+				checksum = 0;
+				message_position = 0;
+
+				if(data == SPITFP_PROTOCOL_OVERHEAD) {
+					st->state = SPITFP_STATE_ACK_SEQUENCE_NUMBER;
+				} else if(data >= SPITFP_MIN_TFP_MESSAGE_LENGTH && data <= TFP_MESSAGE_MAX_LENGTH + SPITFP_PROTOCOL_OVERHEAD) {
+					st->state = SPITFP_STATE_MESSAGE_SEQUENCE_NUMBER;
+				} else if(data == 0) {
+					ringbuffer_remove(&st->ringbuffer_recv, 1);
+					num_to_remove_from_ringbuffer--;
+					break;
+				} else {
+					// If the length is not PROTOCOL_OVERHEAD or within [MIN_TFP_MESSAGE_LENGTH, MAX_TFP_MESSAGE_LENGTH]
+					// or 0, something has gone wrong!
+					spitfp_legacy_handle_protocol_error(st);
+					return;
+				}
+
+				data_length = data;
+				PEARSON(checksum, data_length);
+
+				break;
+			}
+
+			case SPITFP_STATE_ACK_SEQUENCE_NUMBER: {
+				data_sequence_number = data;
+				PEARSON(checksum, data_sequence_number);
+				st->state = SPITFP_STATE_ACK_CHECKSUM;
+				break;
+			}
+
+			case SPITFP_STATE_ACK_CHECKSUM: {
+				// Whatever happens here, we will go to start again and remove
+				// data from ringbuffer
+				st->state = SPITFP_STATE_START;
+				ringbuffer_remove(&st->ringbuffer_recv, num_to_remove_from_ringbuffer);
+				num_to_remove_from_ringbuffer = 0;
+
+				if(checksum != data) {
+					spitfp_legacy_handle_protocol_error(st);
+					return;
+				}
+
+				uint8_t last_sequence_number_seen_by_master = (data_sequence_number & 0xF0) >> 4;
+				if(last_sequence_number_seen_by_master == st->current_sequence_number) {
+					st->buffer_send_length = 0;
+				}
+
+				break;
+			}
+
+			case SPITFP_STATE_MESSAGE_SEQUENCE_NUMBER: {
+				data_sequence_number = data;
+				PEARSON(checksum, data_sequence_number);
+				st->state = SPITFP_STATE_MESSAGE_DATA;
+				break;
+			}
+
+			case SPITFP_STATE_MESSAGE_DATA: {
+				message[message_position] = data;
+				message_position++;
+
+				PEARSON(checksum, data);
+
+				if(message_position == data_length - SPITFP_PROTOCOL_OVERHEAD) {
+					st->state = SPITFP_STATE_MESSAGE_CHECKSUM;
+				}
+				break;
+			}
+
+			case SPITFP_STATE_MESSAGE_CHECKSUM: {
+				// Whatever happens here, we will go to start again
+				st->state = SPITFP_STATE_START;
+
+				if(checksum != data) {
+					spitfp_legacy_handle_protocol_error(st);
+					return;
+				}
+
+				uint8_t last_sequence_number_seen_by_master = (data_sequence_number & 0xF0) >> 4;
+				if(last_sequence_number_seen_by_master == st->current_sequence_number) {
+					st->buffer_send_length = 0;
+				}
+
+				const uint8_t message_sequence_number = data_sequence_number & 0x0F;
+
+				if(spitfp_legacy_is_send_possible(st)) {
+					// If we can currently send a message, we can now definitely remove
+					// the data from ring buffer.
+					ringbuffer_remove(&st->ringbuffer_recv, num_to_remove_from_ringbuffer);
+					num_to_remove_from_ringbuffer = 0;
+
+					// If sequence number is new, we can handle the message.
+					// Otherwise we only ACK the already handled message again.
+					if(message_sequence_number != st->last_sequence_number_seen) {
+						st->last_sequence_number_seen = message_sequence_number;
+						spitfp_legacy_handle_message(bootloader_status, message, message_position);
+					} else {
+						spitfp_legacy_send_ack(st);
+					}
+				}
+
+				break;
+			}
+		}
+	}
+
+	st->state = SPITFP_STATE_START;
+}
@@ -0,0 +1,32 @@
+/* brickletboot
+ * Copyright (C) 2010 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * bootloader_spitfp_legacy.h: SPITFP for firmwares without extension
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef BOOTLOADER_SPITFP_LEGACY_H
+#define BOOTLOADER_SPITFP_LEGACY_H
+
+#include "bootloader_spitfp.h"
+
+// Only uses the SPITFP struct of bricklib2, initialized with spitfp_init_hardware
+void spitfp_legacy_tick(BootloaderStatus *bootloader_status);
+bool spitfp_legacy_is_send_possible(SPITFP *st);
+void spitfp_legacy_send_ack_and_message(SPITFP *st, uint8_t *data, const uint8_t length);
+
+#endif
@@ -29,6 +29,42 @@
 #define BOOTLOADER_HW_VERSION_MINOR    0
 #define BOOTLOADER_HW_VERSION_REVISION 0
 
+// Adds WRITE_FIRMWARE_COMPRESSED (LZ compressed firmware, see firmware_lz.c).
+// Uses FIRMWARE_LZ_WINDOW_SIZE bytes of additional RAM.
+//#define BOOTLOADER_USE_COMPRESSED_FIRMWARE
+
+// Adds GET_ROW_DIGESTS and only erases/writes rows whose content changes.
+// Uses 192 bytes of additional RAM for the row buffer.
+//#define BOOTLOADER_USE_DIFFERENTIAL_WRITE
+
+// Adds ERASE_FIRMWARE: Erases firmware rows in the background, afterwards the
+// master only sends pages that are not completely erased (0xFF). Uses 2 bits
+// per firmware row and 1 bit per firmware page of additional RAM (24 bytes for
+// 8 KB), can't be used with BOOTLOADER_USE_DIFFERENTIAL_WRITE.
+//#define BOOTLOADER_USE_BULK_ERASE
+
+// Adds GET_FIRMWARE_CRC: CRC32 (DSU) of a range of the firmware, the master
+// can verify what it has written without a reboot or reading it back.
+//#define BOOTLOADER_USE_RANGE_CRC
+
+// Skips the firmware CRC check on boot if the firmware was verified before
+// (marker in NVM user row). The marker is only used after the reset causes
+// in BOOTLOADER_FAST_BOOT_RCAUSE, otherwise the full check is done. The user
+// row has room for 14 markers (one per firmware update) and is never erased,
+// afterwards the full check is done on every boot.
+//#define BOOTLOADER_USE_FAST_BOOT
+#define BOOTLOADER_FAST_BOOT_RCAUSE (PM_RCAUSE_POR | PM_RCAUSE_EXT | PM_RCAUSE_SYST)
+
+// Adds SysTick cycle count probes around SPITFP parsing, message handling,
+// NVM erase/write and the firmware CRC check. They are read with
+// GET_PROFILE_PROBE. Uses about 130 bytes of additional RAM.
+//#define BOOTLOADER_USE_PROFILING
+
+// Number of firmware slots (only > 1 on parts with enough flash). In firmware
+// mode a new firmware is written to the next slot while the running firmware
+// keeps working, on boot the valid slot with the newest version is used.
+#define BOOTLOADER_FIRMWARE_SLOT_COUNT 1
+
 
 
 
@@ -44,8 +80,52 @@
 #define SPITFP_PERIPHERAL_TRIGGER_TX  SERCOM0_DMAC_ID_TX
 #define SPITFP_PERIPHERAL_TRIGGER_RX  SERCOM0_DMAC_ID_RX
 
+// Has to be a power of two (see spitfp_ringbuffer.h)
 #define SPITFP_RECEIVE_BUFFER_SIZE    1024
 
+// Maximum number of unacknowledged frames in flight (1 = stop-and-wait).
+// The window is only used if the master enables it with SET_SPITFP_CONFIG.
+// Bigger windows put the send buffer (SPITFP_SEND_BUFFER_SIZE bytes) in the
+// BootloaderExtension (see firmware_entry.h).
+#define SPITFP_SEND_WINDOW_SIZE       1
+
+// Adds CRC-16/CRC-32 frame checksums (calculated by the DMAC CRC engine).
+// The checksum is only used if the master enables it with SET_SPITFP_CONFIG.
+//#define SPITFP_USE_DMAC_CRC
+
+// Adds jumbo frames: In bootloader mode the master can send messages with up
+// to 200 bytes (WRITE_FIRMWARE with three pages). Only used if the master
+// enables it with SET_SPITFP_CONFIG, can't be used with SPITFP_USE_IRQ_RECEIVE.
+//#define SPITFP_USE_JUMBO_FRAMES
+
+// Adds aggregate frames: Several TFP messages in one frame, the responses are
+// sent back in one frame as well. Only used if the master enables it with
+// SET_SPITFP_CONFIG. The send buffer (172 bytes with CRC-32) is in the
+// BootloaderExtension, can't be used with SPITFP_SEND_WINDOW_SIZE > 1.
+//#define SPITFP_USE_AGGREGATE_FRAMES
+
+// Parses received frames in the SERCOM interrupt and queues them for
+// spitfp_tick. The queue needs SPITFP_RECEIVE_QUEUE_SIZE (power of two)
+// times TFP_MESSAGE_MAX_LENGTH bytes in the BootloaderExtension.
+//#define SPITFP_USE_IRQ_RECEIVE
+#define SPITFP_RECEIVE_QUEUE_SIZE     2
+#define SPITFP_IRQN                   SERCOM0_IRQn
+#define SPITFP_IRQ_HANDLER            SERCOM0_Handler
+
+// Adds a queue for outgoing messages (spitfp_enqueue_message), so the firmware
+// doesn't have to wait for spitfp_is_send_possible, e.g. for callbacks.
+// The queue needs SPITFP_SEND_QUEUE_SIZE (power of two) times
+// TFP_MESSAGE_MAX_LENGTH bytes in the BootloaderExtension.
+//#define SPITFP_USE_SEND_QUEUE
+#define SPITFP_SEND_QUEUE_SIZE        2
+
+// Counts checksum errors, frame errors, SPI overflows, re-sends and the
+// bytes/frames in both directions. The error counts are read with the
+// get_spitfp_error_count call of the Bricklet API (FID 234) in bootloader
+// mode, in firmware mode the call is handled by the firmware. Uses 40 bytes
+// of additional RAM in the BootloaderExtension.
+//#define SPITFP_USE_STATISTICS
+
 
 
 // --- TINYDMA ---
@@ -61,6 +141,8 @@
 
 // define bootloader functions to put them into the BootloaderFunctions struct
 // These functions are in the bootloader code and can be used from the firmware
+// The firmware sees which ones are available through the capabilities in
+// BootloaderFunctions (see firmware_entry.h)
 
 
 // Available defines:
@@ -68,6 +150,8 @@
 #define BOOTLOADER_FUNCTION_SPITFP_TICK
 #define BOOTLOADER_FUNCTION_SEND_ACK_AND_MESSAGE
 #define BOOTLOADER_FUNCTION_SPITFP_IS_SEND_POSSIBLE
+#define BOOTLOADER_FUNCTION_SPITFP_IRQ_HANDLER
+#define BOOTLOADER_FUNCTION_SPITFP_ENQUEUE_MESSAGE
 #define BOOTLOADER_FUNCTION_DSU_CRC32_CAL
 #define BOOTLOADER_FUNCTION_SPI_INIT
 #define BOOTLOADER_FUNCTION_TINYDMA_GET_CHANNEL_CONFIG_DEFAULTS
@@ -88,6 +172,9 @@
 #define SYSTEM_CLOCK_SOURCE_XOSC32K_FREQUENCY 0
 #define SYSTEM_CLOCK_SOURCE_DPLL_FREQUENCY 0
 
+// CPU clock, used for the 1ms SysTick (bootloader_status.system_timer_tick)
+#define BOOTLOADER_SYSTEM_TIMER_CLOCK_FREQUENCY 48000000
+
 
 #define SYSCTRL_FUSES_OSC32K_ADDR   (NVMCTRL_OTP4 + 4)
 #define SYSCTRL_FUSES_OSC32K_Pos    6
@@ -19,10 +19,16 @@
  * Boston, MA 02111-1307, USA.
  */
 
+#include "firmware_entry.h"
+
+#include <stddef.h>
+
 #include "bricklib2/bootloader/bootloader.h"
 
 #include "dsu_crc32.h"
 #include "bootloader_spitfp.h"
+#include "bootloader_spitfp_legacy.h"
+#include "tfp_common.h"
 #include "spi.h"
 
 #ifdef BOOTLOADER_FUNCTION_AEABI_IDIV
@@ -41,68 +47,119 @@ uint64_t __aeabi_idivmod(int a, int b);
 uint64_t __aeabi_uidivmod(unsigned int a, unsigned int b);
 #endif
 
+// The original functions are always there
+#define FIRMWARE_ENTRY_SET_FUNCTION(member, function, capability) \
+	bf->member = function; \
+	capabilities |= capability;
+
+// Without the extension the original SPITFP functions get the
+// implementation that only uses the original structs
+#define FIRMWARE_ENTRY_SET_SPITFP_FUNCTION(member, function, legacy_function, capability) \
+	bf->member = extension ? function : legacy_function; \
+	capabilities |= capability;
+
+// Functions behind the header need the extension and are only filled in if
+// they are completely within the struct of the firmware
+#define FIRMWARE_ENTRY_SET_EXTENSION_FUNCTION(member, function, capability) \
+	if(extension && (offsetof(BootloaderFunctions, member) + sizeof(bf->member) <= size)) { \
+		bf->member = function; \
+		capabilities |= capability; \
+	}
+
 void firmware_entry_handle(BootloaderFunctions *bf, BootloaderStatus *bs) {
+	// A firmware that was built against the original BootloaderFunctions
+	// has no header, it ends with the original functions. The marker is
+	// checked first, the header is only read if the struct has one.
+	const bool header = ((uintptr_t)bf->spitfp_tick == BOOTLOADER_FUNCTIONS_MAGIC) &&
+	                    (bf->size >= offsetof(BootloaderFunctions, status_size) + sizeof(bf->status_size));
+	const uint16_t size = !header ? 0 : ((bf->size < sizeof(BootloaderFunctions)) ? bf->size : sizeof(BootloaderFunctions));
+	const bool extension = header && (bf->status_size >= offsetof(BootloaderStatus, extension) + sizeof(BootloaderExtension));
+	uint32_t capabilities = extension ? BOOTLOADER_FUNCTIONS_CAPABILITY_EXTENSION : 0;
+
+	// The marker is never left in place of a function
+	if(header) {
+		bf->spitfp_tick = NULL;
+	}
+
 #ifdef BOOTLOADER_FUNCTION_SPITFP_TICK
-	bf->spitfp_tick = spitfp_tick;
+	FIRMWARE_ENTRY_SET_SPITFP_FUNCTION(spitfp_tick, spitfp_tick, spitfp_legacy_tick, BOOTLOADER_FUNCTIONS_CAPABILITY_SPITFP_TICK);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_SEND_ACK_AND_MESSAGE
-	bf->spitfp_send_ack_and_message = spitfp_send_ack_and_message;
+	FIRMWARE_ENTRY_SET_SPITFP_FUNCTION(spitfp_send_ack_and_message, spitfp_send_ack_and_message, spitfp_legacy_send_ack_and_message, BOOTLOADER_FUNCTIONS_CAPABILITY_SEND_ACK_AND_MESSAGE);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_SPITFP_IS_SEND_POSSIBLE
-	bf->spitfp_is_send_possible = spitfp_is_send_possible;
+	FIRMWARE_ENTRY_SET_SPITFP_FUNCTION(spitfp_is_send_possible, spitfp_is_send_possible, spitfp_legacy_is_send_possible, BOOTLOADER_FUNCTIONS_CAPABILITY_SPITFP_IS_SEND_POSSIBLE);
+#endif
+
+#if defined(BOOTLOADER_FUNCTION_SPITFP_IRQ_HANDLER) && defined(SPITFP_USE_IRQ_RECEIVE)
+	FIRMWARE_ENTRY_SET_EXTENSION_FUNCTION(spitfp_irq_handler, spitfp_irq_handler, BOOTLOADER_FUNCTIONS_CAPABILITY_SPITFP_IRQ_HANDLER);
+#endif
+
+#if defined(BOOTLOADER_FUNCTION_SPITFP_ENQUEUE_MESSAGE) && defined(SPITFP_USE_SEND_QUEUE)
+	FIRMWARE_ENTRY_SET_EXTENSION_FUNCTION(spitfp_enqueue_message, spitfp_enqueue_message, BOOTLOADER_FUNCTIONS_CAPABILITY_SPITFP_ENQUEUE_MESSAGE);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_DSU_CRC32_CAL
-	bf->dsu_crc32_cal = dsu_crc32_cal;
+	FIRMWARE_ENTRY_SET_FUNCTION(dsu_crc32_cal, dsu_crc32_cal, BOOTLOADER_FUNCTIONS_CAPABILITY_DSU_CRC32_CAL);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_SPI_INIT
-	bf->spi_init = spi_init;
+	FIRMWARE_ENTRY_SET_FUNCTION(spi_init, spi_init, BOOTLOADER_FUNCTIONS_CAPABILITY_SPI_INIT);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_TINYDMA_GET_CHANNEL_CONFIG_DEFAULTS
-	bf->tinydma_get_channel_config_defaults = tinydma_get_channel_config_defaults;
+	FIRMWARE_ENTRY_SET_FUNCTION(tinydma_get_channel_config_defaults, tinydma_get_channel_config_defaults, BOOTLOADER_FUNCTIONS_CAPABILITY_TINYDMA_GET_CHANNEL_CONFIG_DEFAULTS);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_TINYDMA_INIT
-	bf->tinydma_init = tinydma_init;
+	FIRMWARE_ENTRY_SET_FUNCTION(tinydma_init, tinydma_init, BOOTLOADER_FUNCTIONS_CAPABILITY_TINYDMA_INIT);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_TINYDMA_START_TRANSFER
-	bf->tinydma_start_transfer = tinydma_start_transfer;
+	FIRMWARE_ENTRY_SET_FUNCTION(tinydma_start_transfer, tinydma_start_transfer, BOOTLOADER_FUNCTIONS_CAPABILITY_TINYDMA_START_TRANSFER);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_TINYDMA_DESCRIPTOR_GET_CONFIG_DEFAULTS
-	bf->tinydma_descriptor_get_config_defaults = tinydma_descriptor_get_config_defaults;
+	FIRMWARE_ENTRY_SET_FUNCTION(tinydma_descriptor_get_config_defaults, tinydma_descriptor_get_config_defaults, BOOTLOADER_FUNCTIONS_CAPABILITY_TINYDMA_DESCRIPTOR_GET_CONFIG_DEFAULTS);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_TINYDMA_DESCRIPTOR_INIT
-	bf->tinydma_descriptor_init = tinydma_descriptor_init;
+	FIRMWARE_ENTRY_SET_FUNCTION(tinydma_descriptor_init, tinydma_descriptor_init, BOOTLOADER_FUNCTIONS_CAPABILITY_TINYDMA_DESCRIPTOR_INIT);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_TINYDMA_CHANNEL_INIT
-	bf->tinydma_channel_init = tinydma_channel_init;
+	FIRMWARE_ENTRY_SET_FUNCTION(tinydma_channel_init, tinydma_channel_init, BOOTLOADER_FUNCTIONS_CAPABILITY_TINYDMA_CHANNEL_INIT);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_AEABI_IDIV
-	bf->__aeabi_idiv = __aeabi_idiv;
+	FIRMWARE_ENTRY_SET_FUNCTION(__aeabi_idiv, __aeabi_idiv, BOOTLOADER_FUNCTIONS_CAPABILITY_AEABI_IDIV);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_AEABI_UIDIV
-	bf->__aeabi_uidiv = __aeabi_uidiv;
+	FIRMWARE_ENTRY_SET_FUNCTION(__aeabi_uidiv, __aeabi_uidiv, BOOTLOADER_FUNCTIONS_CAPABILITY_AEABI_UIDIV);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_AEABI_IDIVMOD
-	bf->__aeabi_idivmod = __aeabi_idivmod;
+	FIRMWARE_ENTRY_SET_FUNCTION(__aeabi_idivmod, __aeabi_idivmod, BOOTLOADER_FUNCTIONS_CAPABILITY_AEABI_IDIVMOD);
 #endif
 
 #ifdef BOOTLOADER_FUNCTION_AEABI_UIDIVMOD
-	bf->__aeabi_uidivmod = __aeabi_uidivmod;
+	FIRMWARE_ENTRY_SET_FUNCTION(__aeabi_uidivmod, __aeabi_uidivmod, BOOTLOADER_FUNCTIONS_CAPABILITY_AEABI_UIDIVMOD);
 #endif
 
-	spitfp_init(&bs->st);
+	if(header) {
+		bf->size = size;
+		bf->version = BOOTLOADER_FUNCTIONS_VERSION;
+		bf->capabilities = capabilities;
+	}
+
+	if(extension) {
+		spitfp_init(&bs->st);
+	} else {
+		spitfp_init_hardware(&bs->st);
+	}
 }
 
 // Sets functions that can be used by firmware and initializes spitfp state machine
@@ -0,0 +1,86 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * firmware_entry.h: BootloaderFunctions ABI between bootloader and firmware
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef FIRMWARE_ENTRY_H
+#define FIRMWARE_ENTRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "configs/config.h"
+#include "bricklib2/bootloader/bootloader.h"
+#include "bootloader_spitfp.h"
+
+// Bootloader state that is not part of the bricklib2 BootloaderStatus. It
+// is at BootloaderStatus.extension, only the bootloader knows its layout.
+// A firmware reserves it by defining BOOTLOADER_STATUS_EXTENSION_SIZE in
+// its config to at least sizeof(BootloaderExtension) of the bootloader.
+typedef struct {
+	SPITFPExtension st; // Has to be first, see spitfp_get_extension
+#if BOOTLOADER_FIRMWARE_SLOT_COUNT > 1
+	uint32_t firmware_write_pointer;
+#endif
+} BootloaderExtension;
+
+_Static_assert(offsetof(BootloaderExtension, st) == 0, "SPITFPExtension has to be at the start of BootloaderExtension");
+
+// The BootloaderStatus of the bootloader itself, with the extension behind it
+typedef struct {
+	BootloaderStatus status;
+	BootloaderExtension extension;
+} BootloaderStatusStorage;
+
+_Static_assert(offsetof(BootloaderStatusStorage, extension) == offsetof(BootloaderStatus, extension), "BootloaderExtension has to be at BootloaderStatus.extension");
+
+static inline BootloaderExtension *bootloader_get_extension(BootloaderStatus *bs) {
+	return (BootloaderExtension *)bs->extension;
+}
+
+// system_timer_tick is incremented by the SysTick interrupt in bootloader
+// mode (and by the timer of the firmware in firmware mode). bricklib2 does
+// not declare it volatile, so it is always read through this.
+static inline uint32_t bootloader_get_system_timer_tick(const BootloaderStatus *bs) {
+	return *(const volatile uint32_t *)&bs->system_timer_tick;
+}
+
+// The firmware calls firmware_entry with its BootloaderFunctions. The
+// original functions keep their place. Behind them, bricklib2 (see
+// bricklib2/bootloader/bootloader.h) has a header (size, version,
+// capabilities, status_size) and the functions that were added later.
+// bootloader_functions_init and bootloader_functions_has are there as well,
+// next to the BOOTLOADER_FUNCTIONS_* defines, so firmware and bootloader
+// share them.
+//
+// A firmware that was built against the original struct ends with the
+// original functions, so nothing behind them may be read. A firmware with
+// the header marks it inside the original struct: Before firmware_entry,
+// spitfp_tick holds BOOTLOADER_FUNCTIONS_MAGIC instead of a function. Only
+// then does the bootloader read the header and fill it in. Without the
+// marker it only fills in the original functions, with the implementations
+// that only use the original BootloaderStatus and SPITFP
+// (bootloader_spitfp_legacy.c).
+#ifndef BOOTLOADER_FUNCTIONS_MAGIC
+#error "bricklib2 without BootloaderFunctions header, see README.rst"
+#endif
+
+void firmware_entry_handle(BootloaderFunctions *bf, BootloaderStatus *bs);
+
+#endif
@@ -0,0 +1,163 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * firmware_lz.c: Decompresses LZ compressed firmware into flash
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+
+---- Compressed firmware stream ----
+
+The stream is a byte-oriented LZ77 variant with a 256 byte window. It is
+made by software/compress_firmware.py and consists of tokens:
+
+ Literal run (control byte 0x00-0x7F):
+  * Byte 0: n
+  * Bytes 1-(n+1): n+1 literal bytes
+
+ Match (control byte 0x80-0xFF):
+  * Byte 0: 0x80 | (length - 3), length is 3 to 130
+  * Byte 1: distance - 1, distance is 1 to 256
+
+A match copies length bytes starting distance bytes back in the output,
+the source may overlap the destination (distance 1 is a run of one byte).
+
+Tokens may be split across WRITE_FIRMWARE_COMPRESSED messages, the decoder
+state is kept between messages. A stream starts at the position given
+with SET_WRITE_FIRMWARE_POINTER (has to be page aligned) and its
+decompressed length has to be a multiple of the page size.
+
+The window doubles as page buffer: Since the window size is a multiple of
+the page size, every complete page is in one piece in the window and
+is handed to the nvm writer from there.
+
+Only use this in bootloader mode, the state is kept in bootloader RAM.
+
+*/
+
+#include "firmware_lz.h"
+
+#include <stdbool.h>
+
+#include "configs/config.h"
+#include "nvm_writer.h"
+#include "bricklib2/bootloader/bootloader.h"
+
+#define FIRMWARE_LZ_MIN_MATCH_LENGTH 3
+
+#define FIRMWARE_LZ_STATE_CONTROL  0
+#define FIRMWARE_LZ_STATE_LITERAL  1
+#define FIRMWARE_LZ_STATE_DISTANCE 2
+#define FIRMWARE_LZ_STATE_ERROR    3
+
+typedef struct {
+	uint8_t window[FIRMWARE_LZ_WINDOW_SIZE];
+	uint32_t pointer;  // Firmware pointer of the start of the stream
+	uint32_t position; // Number of bytes decompressed
+	uint8_t count;     // Remaining literal bytes or match length
+	uint8_t state;
+} FirmwareLZ;
+
+static FirmwareLZ firmware_lz;
+
+void firmware_lz_init(const uint32_t pointer) {
+	firmware_lz.pointer  = pointer;
+	firmware_lz.position = 0;
+	firmware_lz.count    = 0;
+	firmware_lz.state    = FIRMWARE_LZ_STATE_CONTROL;
+}
+
+static uint8_t firmware_lz_put(const uint8_t data) {
+	firmware_lz.window[firmware_lz.position % FIRMWARE_LZ_WINDOW_SIZE] = data;
+	firmware_lz.position++;
+
+	if((firmware_lz.position % NVM_WRITER_PAGE_SIZE) == 0) {
+		const uint32_t page_pointer = firmware_lz.pointer + firmware_lz.position - NVM_WRITER_PAGE_SIZE;
+		if((page_pointer > (BOOTLOADER_FIRMWARE_SIZE-NVM_WRITER_PAGE_SIZE)) ||
+		   ((page_pointer % NVM_WRITER_PAGE_SIZE) != 0)) {
+			return FIRMWARE_LZ_STATUS_INVALID_POINTER;
+		}
+
+		nvm_writer_write_page(BOOTLOADER_FIRMWARE_START_POS + page_pointer,
+		                      &firmware_lz.window[(firmware_lz.position - NVM_WRITER_PAGE_SIZE) % FIRMWARE_LZ_WINDOW_SIZE]);
+	}
+
+	return FIRMWARE_LZ_STATUS_OK;
+}
+
+static uint8_t firmware_lz_copy_match(const uint16_t distance) {
+	// Distance can't point to before the start of the stream
+	if(distance > firmware_lz.position) {
+		return FIRMWARE_LZ_STATUS_INVALID_DATA;
+	}
+
+	for(; firmware_lz.count > 0; firmware_lz.count--) {
+		const uint8_t status = firmware_lz_put(firmware_lz.window[(firmware_lz.position - distance) % FIRMWARE_LZ_WINDOW_SIZE]);
+		if(status != FIRMWARE_LZ_STATUS_OK) {
+			return status;
+		}
+	}
+
+	return FIRMWARE_LZ_STATUS_OK;
+}
+
+uint8_t firmware_lz_write(const uint8_t *data, const uint8_t length) {
+	// After an error the stream has to be restarted with firmware_lz_init
+	if(firmware_lz.state == FIRMWARE_LZ_STATE_ERROR) {
+		return FIRMWARE_LZ_STATUS_INVALID_DATA;
+	}
+
+	for(uint8_t i = 0; i < length; i++) {
+		uint8_t status = FIRMWARE_LZ_STATUS_OK;
+
+		switch(firmware_lz.state) {
+			case FIRMWARE_LZ_STATE_CONTROL: {
+				if(data[i] & 0x80) {
+					firmware_lz.count = (data[i] & 0x7F) + FIRMWARE_LZ_MIN_MATCH_LENGTH;
+					firmware_lz.state = FIRMWARE_LZ_STATE_DISTANCE;
+				} else {
+					firmware_lz.count = data[i] + 1;
+					firmware_lz.state = FIRMWARE_LZ_STATE_LITERAL;
+				}
+				break;
+			}
+
+			case FIRMWARE_LZ_STATE_LITERAL: {
+				status = firmware_lz_put(data[i]);
+				firmware_lz.count--;
+				if(firmware_lz.count == 0) {
+					firmware_lz.state = FIRMWARE_LZ_STATE_CONTROL;
+				}
+				break;
+			}
+
+			case FIRMWARE_LZ_STATE_DISTANCE: {
+				status = firmware_lz_copy_match(data[i] + 1);
+				firmware_lz.state = FIRMWARE_LZ_STATE_CONTROL;
+				break;
+			}
+		}
+
+		if(status != FIRMWARE_LZ_STATUS_OK) {
+			firmware_lz.state = FIRMWARE_LZ_STATE_ERROR;
+			return status;
+		}
+	}
+
+	return FIRMWARE_LZ_STATUS_OK;
+}
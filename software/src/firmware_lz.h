@@ -0,0 +1,36 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * firmware_lz.h: Decompresses LZ compressed firmware into flash
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef FIRMWARE_LZ_H
+#define FIRMWARE_LZ_H
+
+#include <stdint.h>
+
+#define FIRMWARE_LZ_WINDOW_SIZE 256
+
+#define FIRMWARE_LZ_STATUS_OK              0
+#define FIRMWARE_LZ_STATUS_INVALID_POINTER 1
+#define FIRMWARE_LZ_STATUS_INVALID_DATA    2
+
+void firmware_lz_init(const uint32_t pointer);
+uint8_t firmware_lz_write(const uint8_t *data, const uint8_t length);
+
+#endif
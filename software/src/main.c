@@ -36,6 +36,9 @@ For Bricklets with co-processor we use the following flash memory map
 | 2000-3ff4     | 3ff4-3ff8             | 3ff8-3ffc    | 3ffc-4000         |
 ----------------------------------------------------------------------------
 
+With BOOTLOADER_FIRMWARE_SLOT_COUNT > 1 (parts with more flash), further
+firmware slots with the same layout follow directly after the first one.
+
 */
 
 #include <stdio.h>
@@ -48,6 +51,9 @@ For Bricklets with co-processor we use the following flash memory map
 #include "bootloader_spitfp.h"
 #include "boot.h"
 #include "tfp_common.h"
+#include "firmware_entry.h"
+#include "nvm_writer.h"
+#include "profile.h"
 
 #include "bricklib2/bootloader/tinydma.h"
 #include "bricklib2/bootloader/tinywdt.h"
@@ -109,12 +115,41 @@ void system_init(void) {
 	//_system_divas_init();
 }
 
-BootloaderStatus bootloader_status;
+// The extension is reserved behind the BootloaderStatus, see firmware_entry.h
+BootloaderStatusStorage bootloader_status_storage;
+BootloaderStatus *const bootloader_status = &bootloader_status_storage.status;
+
+// SysTick is only used in bootloader mode. The bootloader does not keep the
+// timebase running in firmware mode: SysTick is left in reset state for the
+// firmware, which owns the vector table and has to count
+// bootloader_status->system_timer_tick itself with its own timer.
+void SysTick_Handler(void) {
+	bootloader_status->system_timer_tick++;
+}
+
+static void system_timer_init(void) {
+	// 1ms tick, independent of how often the main loop runs
+	SysTick_Config(BOOTLOADER_SYSTEM_TIMER_CLOCK_FREQUENCY/1000);
+}
+
+#ifdef SPITFP_USE_IRQ_RECEIVE
+void SPITFP_IRQ_HANDLER(void) {
+	spitfp_irq_handler(bootloader_status);
+}
+#endif
+
 int main() {
+#ifdef BOOTLOADER_USE_PROFILING
+	profile_init(&bootloader_status->system_timer_tick);
+#endif
+
 	// Jump to firmware if we can
-	const uint8_t can_jump_to_firmware = boot_can_jump_to_firmware();
+	const uint8_t can_jump_to_firmware = boot_can_jump_to_firmware(true);
 	if(can_jump_to_firmware == TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK) {
 		PORT->Group[0].OUTCLR.reg = (1 << BOOTLOADER_STATUS_LED_PIN); // Turn LED on by default for firmware
+#ifdef BOOTLOADER_USE_PROFILING
+		profile_deinit();
+#endif
 		boot_jump_to_firmware();
 	}
 
@@ -128,29 +163,31 @@ int main() {
 #endif
 
 	// We can't jump to firmware, so lets enter bootloader mode
-	bootloader_status.boot_mode = BOOT_MODE_BOOTLOADER;
-	bootloader_status.status_led_config = 0;
-	bootloader_status.st.descriptor_section = tinydma_get_descriptor_section();
-	bootloader_status.st.write_back_section = tinydma_get_write_back_section();
-	bootloader_status.system_timer_tick = 0;
+	bootloader_status->boot_mode = BOOT_MODE_BOOTLOADER;
+	bootloader_status->status_led_config = 0;
+	bootloader_status->st.descriptor_section = tinydma_get_descriptor_section();
+	bootloader_status->st.write_back_section = tinydma_get_write_back_section();
+	bootloader_status->system_timer_tick = 0;
 
 	tinynvm_init();
+	nvm_writer_init();
+
+	spitfp_init(&bootloader_status->st);
+	tfp_common_init();
 
-	spitfp_init(&bootloader_status.st);
+	system_timer_init();
 
-	uint8_t tick_counter = 0;
 	while(true) {
-		tick_counter++;;
-		if(tick_counter >= 40) { // We call spitfp_tick aprox. 40 times per ms
-			bootloader_status.system_timer_tick++;
-			if(bootloader_status.system_timer_tick % 2 == 0) {
-				PORT->Group[0].OUTSET.reg = (1 << BOOTLOADER_STATUS_LED_PIN);
-			} else {
-				PORT->Group[0].OUTCLR.reg = (1 << BOOTLOADER_STATUS_LED_PIN);
-			};
-			tick_counter = 0;
+		// Toggle status LED every ms (LED on = low)
+		if(bootloader_get_system_timer_tick(bootloader_status) % 2 == 0) {
+			PORT->Group[0].OUTSET.reg = (1 << BOOTLOADER_STATUS_LED_PIN);
+		} else {
+			PORT->Group[0].OUTCLR.reg = (1 << BOOTLOADER_STATUS_LED_PIN);
 		}
 
-		spitfp_tick(&bootloader_status);
+		spitfp_tick(bootloader_status);
+
+		// Start NVM commands after the response was handed to the DMA
+		nvm_writer_tick();
 	}
 }
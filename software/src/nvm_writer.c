@@ -0,0 +1,469 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * nvm_writer.c: Non-blocking flash page writer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+
+The nvm writer takes one page at a time and returns immediately. The NVM
+commands are issued from nvm_writer_tick, which is called from the main loop
+after spitfp_tick. This way the response for a WRITE_FIRMWARE message is
+already on its way to the master (through DMA) while the page is programmed
+and the master can send the next page in the meantime.
+
+Rows are erased when the first page of a row is written. If the firmware is
+written in ascending order, the next row is erased ahead of time right after
+the first page of the current row was written.
+
+With BOOTLOADER_USE_DIFFERENTIAL_WRITE a row is only erased and written if
+its content changes. The pages of a row are collected in a row buffer and
+compared with the flash. As long as all pages match, nothing is written.
+With the first page that differs the row is erased and the pages that were
+skipped until then are written from the row buffer. Rows are never erased
+ahead of time in this mode, since the next row may be unchanged.
+
+With BOOTLOADER_USE_BULK_ERASE the master can erase a range of firmware rows
+up front (nvm_writer_erase_rows). The rows are erased one by one in the
+background while the master is already sending pages. A page for a row
+that the bulk erase did not reach yet erases this row first (out of order),
+so a page never waits for more than one erase. Pages of bulk erased rows are
+written without erasing their row again, so the master can skip pages that
+are completely erased (0xFF) and a row does not have to start with its first
+page. Flash can only be programmed once after an erase, so the written pages
+of bulk erased rows are recorded. If a page is written again (e.g. the
+master repeats a WRITE_FIRMWARE), its row is erased and the pages written
+so far are written again together with the new page.
+
+Errors reported by NVMCTRL are latched and can be read with
+nvm_writer_get_and_clear_error.
+
+With BOOTLOADER_USE_PROFILING the time from issuing an erase/write command
+until NVMCTRL is ready again is recorded. Since we don't wait for NVMCTRL,
+this includes up to one main loop iteration.
+
+Only use this in bootloader mode, the state is kept in bootloader RAM.
+
+*/
+
+#include "nvm_writer.h"
+
+#include <string.h>
+
+#include "profile.h"
+#include "configs/config.h"
+#include "bricklib2/bootloader/bootloader.h"
+
+#define NVM_WRITER_ROW_SIZE   (NVMCTRL_ROW_PAGES*NVM_WRITER_PAGE_SIZE)
+#define NVM_WRITER_MEMORY     ((volatile uint16_t *)FLASH_ADDR)
+#define NVM_WRITER_NO_ADDRESS 0xFFFFFFFF
+
+#ifdef BOOTLOADER_USE_BULK_ERASE
+#define NVM_WRITER_FIRMWARE_ROWS    (BOOTLOADER_FIRMWARE_SIZE/NVM_WRITER_ROW_SIZE)
+#define NVM_WRITER_FIRMWARE_PAGES   (BOOTLOADER_FIRMWARE_SIZE/NVM_WRITER_PAGE_SIZE)
+#define NVM_WRITER_BITMAP_SIZE(num) (((num) + 31)/32)
+#endif
+
+typedef struct {
+#ifdef BOOTLOADER_USE_DIFFERENTIAL_WRITE
+	uint8_t row[NVM_WRITER_ROW_SIZE]; // First member, we access it 16-bit wise
+	uint32_t row_address;    // Row the pages in the row buffer belong to
+	uint8_t row_skipped;     // Bitmask of pages that matched the flash and were not written
+	bool row_erased;         // Row was changed and erased
+#else
+	uint8_t page[NVM_WRITER_PAGE_SIZE]; // First member, we access it 16-bit wise
+	uint32_t erase_address;  // Row to erase ahead of time or NVM_WRITER_NO_ADDRESS
+	uint32_t erased_address; // Row that was erased and has no page written yet
+	uint32_t end_address;    // Highest address written + 1
+#endif
+#ifdef BOOTLOADER_USE_BULK_ERASE
+	// Firmware rows (bit n = row n) the bulk erase still has to erase
+	uint32_t bulk_erase_rows[NVM_WRITER_BITMAP_SIZE(NVM_WRITER_FIRMWARE_ROWS)];
+	// Firmware rows of the bulk erase, pages are written without erase
+	uint32_t bulk_erased_rows[NVM_WRITER_BITMAP_SIZE(NVM_WRITER_FIRMWARE_ROWS)];
+	// Firmware pages (bit n = page n) written since the bulk erase
+	uint32_t bulk_written_pages[NVM_WRITER_BITMAP_SIZE(NVM_WRITER_FIRMWARE_PAGES)];
+#endif
+	uint32_t page_address;   // Address of pending page or NVM_WRITER_NO_ADDRESS
+	bool error;
+#ifdef BOOTLOADER_USE_PROFILING
+	uint32_t command_begin;  // Cycles when the running command was issued
+	uint8_t command_probe;   // Probe of the running command or PROFILE_PROBE_COUNT
+#endif
+} NVMWriter;
+
+static NVMWriter nvm_writer __attribute__((aligned(4)));
+
+static bool nvm_writer_is_ready(void) {
+	const bool ready = NVMCTRL->INTFLAG.reg & NVMCTRL_INTFLAG_READY;
+
+#ifdef BOOTLOADER_USE_PROFILING
+	if(ready && (nvm_writer.command_probe != PROFILE_PROBE_COUNT)) {
+		profile_add(nvm_writer.command_probe, nvm_writer.command_begin);
+		nvm_writer.command_probe = PROFILE_PROBE_COUNT;
+	}
+#endif
+
+	return ready;
+}
+
+static void nvm_writer_check_error(void) {
+	if(NVMCTRL->STATUS.reg & (NVMCTRL_STATUS_PROGE | NVMCTRL_STATUS_LOCKE | NVMCTRL_STATUS_NVME)) {
+		nvm_writer.error = true;
+	}
+
+	NVMCTRL->STATUS.reg = NVMCTRL_STATUS_MASK;
+}
+
+// Only call if NVMCTRL is ready
+static void nvm_writer_command(const uint32_t address, const uint32_t command) {
+	nvm_writer_check_error();
+
+	// ADDR is given in 16-bit words
+	NVMCTRL->ADDR.reg = address / 2;
+	NVMCTRL->CTRLA.reg = command | NVMCTRL_CTRLA_CMDEX_KEY;
+
+#ifdef BOOTLOADER_USE_PROFILING
+	nvm_writer.command_probe = (command == NVMCTRL_CTRLA_CMD_ER) ? PROFILE_PROBE_NVM_ERASE_ROW : PROFILE_PROBE_NVM_WRITE_PAGE;
+	nvm_writer.command_begin = profile_get_cycles();
+#endif
+}
+
+#ifdef BOOTLOADER_USE_BULK_ERASE
+static inline bool nvm_writer_bitmap_get(const uint32_t *bitmap, const uint16_t index) {
+	return (bitmap[index / 32] & ((uint32_t)1 << (index % 32))) != 0;
+}
+
+static inline void nvm_writer_bitmap_set(uint32_t *bitmap, const uint16_t index) {
+	bitmap[index / 32] |= (uint32_t)1 << (index % 32);
+}
+
+static inline void nvm_writer_bitmap_clear(uint32_t *bitmap, const uint16_t index) {
+	bitmap[index / 32] &= ~((uint32_t)1 << (index % 32));
+}
+
+// Returns firmware row of row_address or NVM_WRITER_FIRMWARE_ROWS if it is
+// not in the firmware
+static uint16_t nvm_writer_get_row(const uint32_t row_address) {
+	if((row_address < BOOTLOADER_FIRMWARE_START_POS) ||
+	   (row_address >= BOOTLOADER_FIRMWARE_START_POS + BOOTLOADER_FIRMWARE_SIZE)) {
+		return NVM_WRITER_FIRMWARE_ROWS;
+	}
+
+	return (row_address - BOOTLOADER_FIRMWARE_START_POS) / NVM_WRITER_ROW_SIZE;
+}
+
+// Returns first row the bulk erase still has to erase or NVM_WRITER_FIRMWARE_ROWS
+static uint16_t nvm_writer_get_bulk_erase_row(void) {
+	for(uint16_t i = 0; i < NVM_WRITER_BITMAP_SIZE(NVM_WRITER_FIRMWARE_ROWS); i++) {
+		if(nvm_writer.bulk_erase_rows[i] != 0) {
+			uint16_t row = i*32;
+			while(!nvm_writer_bitmap_get(nvm_writer.bulk_erase_rows, row)) {
+				row++;
+			}
+
+			return row;
+		}
+	}
+
+	return NVM_WRITER_FIRMWARE_ROWS;
+}
+#endif
+
+// Pages of rows in a bulk erase don't need an erase of their own
+static inline bool nvm_writer_is_bulk_erased(const uint32_t row_address) {
+#ifdef BOOTLOADER_USE_BULK_ERASE
+	const uint16_t row = nvm_writer_get_row(row_address);
+	return (row < NVM_WRITER_FIRMWARE_ROWS) && nvm_writer_bitmap_get(nvm_writer.bulk_erased_rows, row);
+#else
+	return false;
+#endif
+}
+
+static void nvm_writer_fill_page_buffer(const uint32_t address, const uint8_t *data) {
+	// Fill page buffer (16-bit access only)
+	const uint16_t *page = (const uint16_t *)data;
+	volatile uint16_t *nvm = &NVM_WRITER_MEMORY[address / 2];
+	for(uint8_t i = 0; i < NVM_WRITER_PAGE_SIZE/2; i++) {
+		nvm[i] = page[i];
+	}
+}
+
+void nvm_writer_init(void) {
+	nvm_writer.page_address   = NVM_WRITER_NO_ADDRESS;
+#ifdef BOOTLOADER_USE_DIFFERENTIAL_WRITE
+	nvm_writer.row_address    = NVM_WRITER_NO_ADDRESS;
+	nvm_writer.row_skipped    = 0;
+	nvm_writer.row_erased     = false;
+#else
+	nvm_writer.erase_address  = NVM_WRITER_NO_ADDRESS;
+	nvm_writer.erased_address = NVM_WRITER_NO_ADDRESS;
+	nvm_writer.end_address    = 0;
+#endif
+#ifdef BOOTLOADER_USE_BULK_ERASE
+	memset(nvm_writer.bulk_erase_rows,    0, sizeof(nvm_writer.bulk_erase_rows));
+	memset(nvm_writer.bulk_erased_rows,   0, sizeof(nvm_writer.bulk_erased_rows));
+	memset(nvm_writer.bulk_written_pages, 0, sizeof(nvm_writer.bulk_written_pages));
+#endif
+	nvm_writer.error          = false;
+#ifdef BOOTLOADER_USE_PROFILING
+	nvm_writer.command_probe  = PROFILE_PROBE_COUNT;
+#endif
+}
+
+#ifdef BOOTLOADER_USE_DIFFERENTIAL_WRITE
+void nvm_writer_tick(void) {
+	if(!nvm_writer_is_ready()) {
+		return;
+	}
+
+	// The row was erased, write the pages that were skipped before
+	if(nvm_writer.row_erased && (nvm_writer.row_skipped != 0)) {
+		uint8_t index = 0;
+		while(!(nvm_writer.row_skipped & (1 << index))) {
+			index++;
+		}
+
+		nvm_writer.row_skipped &= ~(1 << index);
+
+		const uint32_t address = nvm_writer.row_address + index*NVM_WRITER_PAGE_SIZE;
+		nvm_writer_fill_page_buffer(address, &nvm_writer.row[index*NVM_WRITER_PAGE_SIZE]);
+		nvm_writer_command(address, NVMCTRL_CTRLA_CMD_WP);
+		return;
+	}
+
+	if(nvm_writer.page_address == NVM_WRITER_NO_ADDRESS) {
+		return;
+	}
+
+	const uint8_t index = (nvm_writer.page_address - nvm_writer.row_address) / NVM_WRITER_PAGE_SIZE;
+	const uint8_t *page = &nvm_writer.row[index*NVM_WRITER_PAGE_SIZE];
+
+	if(!nvm_writer.row_erased) {
+		if(memcmp((const void *)nvm_writer.page_address, page, NVM_WRITER_PAGE_SIZE) == 0) {
+			// Page is unchanged, only write it if the row turns out to be changed
+			nvm_writer.row_skipped |= (1 << index);
+			nvm_writer.page_address = NVM_WRITER_NO_ADDRESS;
+			return;
+		}
+
+		// Page is changed, erase row first. The page stays pending.
+		nvm_writer.row_erased = true;
+		nvm_writer_command(nvm_writer.row_address, NVMCTRL_CTRLA_CMD_ER);
+		return;
+	}
+
+	nvm_writer_fill_page_buffer(nvm_writer.page_address, page);
+	nvm_writer_command(nvm_writer.page_address, NVMCTRL_CTRLA_CMD_WP);
+	nvm_writer.page_address = NVM_WRITER_NO_ADDRESS;
+}
+
+void nvm_writer_write_page(const uint32_t address, const uint8_t *data) {
+	// Only one page can be pending and the row buffer has to be written
+	// completely before a new row can start
+	while((nvm_writer.page_address != NVM_WRITER_NO_ADDRESS) ||
+	      (nvm_writer.row_erased && (nvm_writer.row_skipped != 0))) {
+		nvm_writer_tick();
+	}
+
+	const uint32_t row_address = address & ~(NVM_WRITER_ROW_SIZE - 1);
+	if(row_address != nvm_writer.row_address) {
+		nvm_writer.row_address = row_address;
+		nvm_writer.row_skipped = 0;
+		nvm_writer.row_erased  = false;
+	} else if((address == row_address) && nvm_writer.row_erased) {
+		// First page of an already written row is sent again, start over
+		nvm_writer.row_skipped = 0;
+		nvm_writer.row_erased  = false;
+	}
+
+	memcpy(&nvm_writer.row[address - row_address], data, NVM_WRITER_PAGE_SIZE);
+	nvm_writer.page_address = address;
+}
+
+bool nvm_writer_is_idle(void) {
+	return (nvm_writer.page_address == NVM_WRITER_NO_ADDRESS) &&
+	       !(nvm_writer.row_erased && (nvm_writer.row_skipped != 0)) &&
+	       nvm_writer_is_ready();
+}
+#else
+#ifdef BOOTLOADER_USE_BULK_ERASE
+// The pending page was already written since the bulk erase of its row.
+// Erase the row and write the pages written so far (read back from flash)
+// together with the new page. This only happens if the master repeats a
+// page, so we wait for NVMCTRL here. Not inlined, so the stack for the row
+// copy is only used in this case.
+__attribute__((noinline)) static void nvm_writer_rewrite_row(const uint32_t row_address, const uint16_t row) {
+	uint8_t buffer[NVM_WRITER_ROW_SIZE] __attribute__((aligned(4)));
+	memcpy(buffer, (const void *)row_address, NVM_WRITER_ROW_SIZE);
+	memcpy(&buffer[nvm_writer.page_address - row_address], nvm_writer.page, NVM_WRITER_PAGE_SIZE);
+	nvm_writer.page_address = NVM_WRITER_NO_ADDRESS;
+
+	nvm_writer_command(row_address, NVMCTRL_CTRLA_CMD_ER);
+
+	for(uint8_t i = 0; i < NVMCTRL_ROW_PAGES; i++) {
+		if(nvm_writer_bitmap_get(nvm_writer.bulk_written_pages, row*NVMCTRL_ROW_PAGES + i)) {
+			while(!nvm_writer_is_ready());
+			nvm_writer_fill_page_buffer(row_address + i*NVM_WRITER_PAGE_SIZE, &buffer[i*NVM_WRITER_PAGE_SIZE]);
+			nvm_writer_command(row_address + i*NVM_WRITER_PAGE_SIZE, NVMCTRL_CTRLA_CMD_WP);
+		}
+	}
+}
+#endif
+
+void nvm_writer_tick(void) {
+	if(!nvm_writer_is_ready()) {
+		return;
+	}
+
+	if(nvm_writer.page_address != NVM_WRITER_NO_ADDRESS) {
+		const uint32_t row_address = nvm_writer.page_address & ~(NVM_WRITER_ROW_SIZE - 1);
+
+#ifdef BOOTLOADER_USE_BULK_ERASE
+		const uint16_t row = nvm_writer_get_row(row_address);
+		if((row < NVM_WRITER_FIRMWARE_ROWS) && nvm_writer_bitmap_get(nvm_writer.bulk_erased_rows, row)) {
+			// The bulk erase did not reach this row yet, erase it now
+			if(nvm_writer_bitmap_get(nvm_writer.bulk_erase_rows, row)) {
+				nvm_writer_bitmap_clear(nvm_writer.bulk_erase_rows, row);
+				nvm_writer_command(row_address, NVMCTRL_CTRLA_CMD_ER);
+				return;
+			}
+
+			const uint16_t page = (nvm_writer.page_address - BOOTLOADER_FIRMWARE_START_POS) / NVM_WRITER_PAGE_SIZE;
+			if(nvm_writer_bitmap_get(nvm_writer.bulk_written_pages, page)) {
+				nvm_writer_rewrite_row(row_address, row);
+				return;
+			}
+
+			nvm_writer_bitmap_set(nvm_writer.bulk_written_pages, page);
+		}
+#endif
+
+		if((nvm_writer.page_address == row_address) && !nvm_writer_is_bulk_erased(row_address)) {
+			// First page of a row: Erase the row first, if it was not erased ahead of time
+			if(nvm_writer.erased_address != row_address) {
+				if(nvm_writer.erase_address == row_address) {
+					nvm_writer.erase_address = NVM_WRITER_NO_ADDRESS;
+				}
+
+				nvm_writer.erased_address = row_address;
+				nvm_writer_command(row_address, NVMCTRL_CTRLA_CMD_ER);
+				return;
+			}
+
+			nvm_writer.erased_address = NVM_WRITER_NO_ADDRESS;
+
+			// If we are writing in ascending order the next row is erased
+			// while the master sends the remaining pages of this row
+			const uint32_t next_row_address = row_address + NVM_WRITER_ROW_SIZE;
+			if((next_row_address >= nvm_writer.end_address) &&
+			   (next_row_address < BOOTLOADER_FIRMWARE_START_POS + BOOTLOADER_FIRMWARE_SIZE) &&
+			   !nvm_writer_is_bulk_erased(next_row_address)) {
+				nvm_writer.erase_address = next_row_address;
+			}
+		}
+
+		nvm_writer_fill_page_buffer(nvm_writer.page_address, nvm_writer.page);
+		nvm_writer_command(nvm_writer.page_address, NVMCTRL_CTRLA_CMD_WP);
+
+		if(nvm_writer.page_address + NVM_WRITER_PAGE_SIZE > nvm_writer.end_address) {
+			nvm_writer.end_address = nvm_writer.page_address + NVM_WRITER_PAGE_SIZE;
+		}
+		nvm_writer.page_address = NVM_WRITER_NO_ADDRESS;
+		return;
+	}
+
+	if(nvm_writer.erase_address != NVM_WRITER_NO_ADDRESS) {
+		nvm_writer.erased_address = nvm_writer.erase_address;
+		nvm_writer.erase_address  = NVM_WRITER_NO_ADDRESS;
+		nvm_writer_command(nvm_writer.erased_address, NVMCTRL_CTRLA_CMD_ER);
+		return;
+	}
+
+#ifdef BOOTLOADER_USE_BULK_ERASE
+	const uint16_t row = nvm_writer_get_bulk_erase_row();
+	if(row < NVM_WRITER_FIRMWARE_ROWS) {
+		nvm_writer_bitmap_clear(nvm_writer.bulk_erase_rows, row);
+		nvm_writer_command(BOOTLOADER_FIRMWARE_START_POS + row*NVM_WRITER_ROW_SIZE, NVMCTRL_CTRLA_CMD_ER);
+	}
+#endif
+}
+
+void nvm_writer_write_page(const uint32_t address, const uint8_t *data) {
+	// Only one page can be pending. Normally the previous page was already
+	// written while the master was sending this one.
+	while(nvm_writer.page_address != NVM_WRITER_NO_ADDRESS) {
+		nvm_writer_tick();
+	}
+
+	memcpy(nvm_writer.page, data, NVM_WRITER_PAGE_SIZE);
+	nvm_writer.page_address = address;
+}
+
+bool nvm_writer_is_idle(void) {
+	return (nvm_writer.page_address == NVM_WRITER_NO_ADDRESS) &&
+	       (nvm_writer.erase_address == NVM_WRITER_NO_ADDRESS) &&
+#ifdef BOOTLOADER_USE_BULK_ERASE
+	       (nvm_writer_get_bulk_erase_row() == NVM_WRITER_FIRMWARE_ROWS) &&
+#endif
+	       nvm_writer_is_ready();
+}
+
+#ifdef BOOTLOADER_USE_BULK_ERASE
+// Erases row_count rows starting at address (has to be the start of a
+// firmware row) in the background. A pending page is written before.
+void nvm_writer_erase_rows(const uint32_t address, const uint16_t row_count) {
+	while(nvm_writer.page_address != NVM_WRITER_NO_ADDRESS) {
+		nvm_writer_tick();
+	}
+
+	const uint16_t first_row = (address - BOOTLOADER_FIRMWARE_START_POS) / NVM_WRITER_ROW_SIZE;
+	for(uint16_t row = first_row; row < first_row + row_count; row++) {
+		nvm_writer_bitmap_set(nvm_writer.bulk_erase_rows, row);
+	}
+	memcpy(nvm_writer.bulk_erased_rows, nvm_writer.bulk_erase_rows, sizeof(nvm_writer.bulk_erased_rows));
+
+	// All rows of the bulk erase are still to be erased, none of their
+	// pages is written yet
+	memset(nvm_writer.bulk_written_pages, 0, sizeof(nvm_writer.bulk_written_pages));
+
+	// The lazy erase state is not valid anymore, a row that is erased
+	// ahead of time could already have pages from the master
+	nvm_writer.erase_address  = NVM_WRITER_NO_ADDRESS;
+	nvm_writer.erased_address = NVM_WRITER_NO_ADDRESS;
+	nvm_writer.end_address    = 0;
+}
+#endif
+#endif
+
+void nvm_writer_flush(void) {
+	while(!nvm_writer_is_idle()) {
+		nvm_writer_tick();
+	}
+}
+
+bool nvm_writer_get_and_clear_error(void) {
+	if(nvm_writer_is_ready()) {
+		nvm_writer_check_error();
+	}
+
+	const bool error = nvm_writer.error;
+	nvm_writer.error = false;
+
+	return error;
+}
@@ -0,0 +1,46 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * nvm_writer.h: Non-blocking flash page writer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef NVM_WRITER_H
+#define NVM_WRITER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "configs/config.h"
+
+#define NVM_WRITER_PAGE_SIZE 64 // = page size of samd* processors
+
+#if defined(BOOTLOADER_USE_BULK_ERASE) && defined(BOOTLOADER_USE_DIFFERENTIAL_WRITE)
+#error "BOOTLOADER_USE_BULK_ERASE can't be used with BOOTLOADER_USE_DIFFERENTIAL_WRITE (it would erase the unchanged rows)"
+#endif
+
+void nvm_writer_init(void);
+void nvm_writer_tick(void);
+void nvm_writer_write_page(const uint32_t address, const uint8_t *data);
+void nvm_writer_flush(void);
+bool nvm_writer_is_idle(void);
+bool nvm_writer_get_and_clear_error(void);
+#ifdef BOOTLOADER_USE_BULK_ERASE
+void nvm_writer_erase_rows(const uint32_t address, const uint16_t row_count);
+#endif
+
+#endif
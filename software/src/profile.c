@@ -0,0 +1,129 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * profile.c: SysTick cycle count probes for hot paths
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+/*
+
+The probes measure CPU cycles with SysTick, the serial logger is much too
+slow for this. SysTick counts down from LOAD to 0:
+
+* At start-up (before system_timer_init) profile_init lets it run freely
+  over 24 bit without interrupt, this is enough for the firmware CRC
+  check on boot (~350ms at 48MHz).
+* In bootloader mode it wraps every 1ms and the SysTick interrupt counts
+  system_timer_tick. The cycle count is system_timer_tick*(LOAD+1) plus
+  the cycles of the current period, a wrap whose interrupt is still
+  pending (interrupts disabled) is taken into account with PENDSTSET.
+
+The cycle count wraps after 2^32 cycles (~89s at 48MHz), a single
+measurement has to be shorter than that.
+
+The results are read with GET_PROFILE_PROBE. In firmware mode the
+bootloader RAM belongs to the firmware and SysTick is configured by the
+firmware, so nothing is recorded there (probes check SCB->VTOR).
+
+*/
+
+#include "profile.h"
+
+#ifdef BOOTLOADER_USE_PROFILING
+
+#include <string.h>
+#include <stdbool.h>
+
+#include "configs/config.h"
+#include "bricklib2/bootloader/bootloader.h"
+
+static ProfileProbe profile_probes[PROFILE_PROBE_COUNT];
+static const volatile uint32_t *profile_system_timer_tick;
+
+// Has to be called first in main, before any probe
+void profile_init(const volatile uint32_t *system_timer_tick) {
+	profile_system_timer_tick = system_timer_tick;
+	memset(profile_probes, 0, sizeof(profile_probes));
+
+	// Free running until system_timer_init configures the 1ms tick
+	SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+	SysTick->VAL  = 0;
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+static bool profile_is_bootloader_mode(void) {
+	return SCB->VTOR < BOOTLOADER_FIRMWARE_START_POS;
+}
+
+uint32_t profile_get_cycles(void) {
+	if(!profile_is_bootloader_mode()) {
+		return 0;
+	}
+
+	const uint32_t load = SysTick->LOAD;
+	uint32_t tick;
+	uint32_t value;
+	bool pending;
+
+	// The tick may change while we read the counter
+	do {
+		tick    = *profile_system_timer_tick;
+		value   = SysTick->VAL;
+		pending = SCB->ICSR & SCB_ICSR_PENDSTSET_Msk;
+	} while(tick != *profile_system_timer_tick);
+
+	// Counter already wrapped, but the interrupt did not run yet
+	if(pending && (value > load/2)) {
+		tick++;
+	}
+
+	return tick*(load + 1) + (load - value);
+}
+
+void profile_add(const ProfileProbeID probe, const uint32_t begin) {
+	if(!profile_is_bootloader_mode()) {
+		return;
+	}
+
+	const uint32_t cycles = profile_get_cycles() - begin;
+	ProfileProbe *p = &profile_probes[probe];
+
+	if((p->count == 0) || (cycles < p->min)) {
+		p->min = cycles;
+	}
+	if(cycles > p->max) {
+		p->max = cycles;
+	}
+	p->total += cycles;
+	p->count++;
+}
+
+const ProfileProbe *profile_get(const ProfileProbeID probe) {
+	return &profile_probes[probe];
+}
+
+void profile_clear(const ProfileProbeID probe) {
+	memset(&profile_probes[probe], 0, sizeof(ProfileProbe));
+}
+
+// The firmware gets SysTick in reset state
+void profile_deinit(void) {
+	SysTick->CTRL = 0;
+}
+
+#endif
@@ -0,0 +1,62 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * profile.h: SysTick cycle count probes for hot paths
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+#include "configs/config.h"
+
+typedef enum {
+	PROFILE_PROBE_SPITFP_PARSE = 0,   // Includes HANDLE_MESSAGE without SPITFP_USE_IRQ_RECEIVE
+	PROFILE_PROBE_HANDLE_MESSAGE,
+	PROFILE_PROBE_NVM_ERASE_ROW,
+	PROFILE_PROBE_NVM_WRITE_PAGE,
+	PROFILE_PROBE_FIRMWARE_CRC,
+	PROFILE_PROBE_COUNT
+} ProfileProbeID;
+
+typedef struct {
+	uint32_t count;
+	uint32_t min;   // in CPU cycles
+	uint32_t max;
+	uint64_t total;
+} ProfileProbe;
+
+#ifdef BOOTLOADER_USE_PROFILING
+// Probes only record in bootloader mode, they cost ~50 cycles each
+#define PROFILE_BEGIN(probe) const uint32_t profile_begin_##probe = profile_get_cycles()
+#define PROFILE_END(probe)   profile_add(probe, profile_begin_##probe)
+
+void profile_init(const volatile uint32_t *system_timer_tick);
+uint32_t profile_get_cycles(void);
+void profile_add(const ProfileProbeID probe, const uint32_t begin);
+const ProfileProbe *profile_get(const ProfileProbeID probe);
+void profile_clear(const ProfileProbeID probe);
+void profile_deinit(void);
+#else
+#define PROFILE_BEGIN(probe)
+#define PROFILE_END(probe)
+#endif
+
+#endif
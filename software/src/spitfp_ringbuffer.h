@@ -0,0 +1,79 @@
+/* brickletboot
+ * Copyright (C) 2016 Olaf Lüke <olaf@tinkerforge.com>
+ *
+ * spitfp_ringbuffer.h: SPITFP receive ringbuffer access specialised
+ *                      for SPITFP_RECEIVE_BUFFER_SIZE
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef SPITFP_RINGBUFFER_H
+#define SPITFP_RINGBUFFER_H
+
+#include <stdint.h>
+
+#include "configs/config.h"
+#include "bricklib2/utility/ringbuffer.h"
+
+// The receive ringbuffer is filled by the DMAC and only its start and end
+// are kept in a bricklib2 Ringbuffer. The generic ringbuffer functions
+// work with any size and wrap with a compare (or a modulo in the callers).
+// The Cortex-M0+ has no hardware divide, so here the size is a compile time
+// power of two and every wrap around is a mask.
+//
+// Instead of single bytes the parser gets contiguous spans: The readable
+// data is at most two spans (before and after the end of the buffer),
+// within a span it can walk the memory linearly.
+
+#if (SPITFP_RECEIVE_BUFFER_SIZE & (SPITFP_RECEIVE_BUFFER_SIZE - 1)) != 0
+#error "SPITFP_RECEIVE_BUFFER_SIZE has to be a power of two"
+#endif
+
+#define SPITFP_RECEIVE_BUFFER_MASK (SPITFP_RECEIVE_BUFFER_SIZE - 1)
+
+static inline uint16_t spitfp_ringbuffer_wrap(const uint16_t index) {
+	return index & SPITFP_RECEIVE_BUFFER_MASK;
+}
+
+static inline uint16_t spitfp_ringbuffer_get_used(const Ringbuffer *rb) {
+	return (rb->end - rb->start) & SPITFP_RECEIVE_BUFFER_MASK;
+}
+
+static inline void spitfp_ringbuffer_remove(Ringbuffer *rb, const uint16_t num) {
+	rb->start = (rb->start + num) & SPITFP_RECEIVE_BUFFER_MASK;
+}
+
+// Returns the contiguous readable span that begins offset bytes after start
+// and writes its length to length. Returns NULL if there is nothing to read
+// after offset. The span ends at end or at the end of the buffer, whichever
+// comes first. A second call with offset + length gives the rest.
+static inline const uint8_t *spitfp_ringbuffer_get_span(const Ringbuffer *rb, const uint16_t offset, uint16_t *length) {
+	const uint16_t used = spitfp_ringbuffer_get_used(rb);
+	if(offset >= used) {
+		*length = 0;
+		return NULL;
+	}
+
+	const uint16_t index = spitfp_ringbuffer_wrap(rb->start + offset);
+	*length = used - offset;
+	if(*length > SPITFP_RECEIVE_BUFFER_SIZE - index) {
+		*length = SPITFP_RECEIVE_BUFFER_SIZE - index;
+	}
+
+	return &rb->buffer[index];
+}
+
+#endif
@@ -24,12 +24,24 @@
 #include <string.h>
 
 #include "boot.h"
+#include "nvm_writer.h"
+#include "firmware_lz.h"
+#include "profile.h"
+#include "firmware_entry.h"
 
 #include "configs/config.h"
 
 #include "bricklib2/protocols/tfp/tfp.h"
 #include "bricklib2/bootloader/tinynvm.h"
 
+#define TFP_COMMON_FID_GET_FIRMWARE_CRC 220
+#define TFP_COMMON_FID_ERASE_FIRMWARE 221
+#define TFP_COMMON_FID_GET_PROFILE_PROBE 222
+#define TFP_COMMON_FID_GET_WRITE_FIRMWARE_SLOT 223
+#define TFP_COMMON_FID_GET_ROW_DIGESTS 224
+#define TFP_COMMON_FID_WRITE_FIRMWARE_COMPRESSED 225
+#define TFP_COMMON_FID_SET_SPITFP_CONFIG 226
+#define TFP_COMMON_FID_GET_SPITFP_ERROR_COUNT 234 // firmware, bootloader mode with SPITFP_USE_STATISTICS
 #define TFP_COMMON_FID_SET_BOOTLOADER_MODE 235
 #define TFP_COMMON_FID_GET_BOOTLOADER_MODE 236
 #define TFP_COMMON_FID_SET_WRITE_FIRMWARE_POINTER 237
@@ -46,9 +58,29 @@
 #define TFP_COMMON_FID_ENUMERATE 254
 #define TFP_COMMON_FID_GET_IDENTITY 255
 
+// Lowest and highest FID in tfp_common_functions
+#define TFP_COMMON_FID_FIRST TFP_COMMON_FID_GET_FIRMWARE_CRC
+#define TFP_COMMON_FID_LAST  TFP_COMMON_FID_GET_IDENTITY
+
+// First FID of the original bootloader, lower FIDs always go to firmwares
+// without extension
+#define TFP_COMMON_FID_LEGACY_FIRST TFP_COMMON_FID_SET_BOOTLOADER_MODE
+
+_Static_assert(TFP_COMMON_FID_FIRST >= TFP_COMMON_FID_RESERVED_FIRST, "Bootloader FIDs have to be in the reserved range (see tfp_common.h)");
+_Static_assert(TFP_COMMON_FID_SET_SPITFP_CONFIG <= TFP_COMMON_FID_RESERVED_LAST, "Bootloader FIDs have to be in the reserved range (see tfp_common.h)");
+
 #define TFP_COMMON_ENUMERATE_CALLBACK_UID_LENGTH 8
 #define TFP_COMMON_ENUMERATE_CALLBACK_VERSION_LENGTH 3
-#define TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE 64 // = page size of samd* processors
+#define TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE NVM_WRITER_PAGE_SIZE
+
+// With jumbo frames WRITE_FIRMWARE can carry several pages
+#ifdef SPITFP_USE_JUMBO_FRAMES
+#define TFP_COMMON_WRITE_FIRMWARE_MAX_CHUNKS ((SPITFP_JUMBO_TFP_MESSAGE_MAX_LENGTH - sizeof(TFPMessageHeader)) / TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE)
+#else
+#define TFP_COMMON_WRITE_FIRMWARE_MAX_CHUNKS 1
+#endif
+#define TFP_COMMON_BOOTLOADER_ROW_SIZE (NVMCTRL_ROW_PAGES*NVM_WRITER_PAGE_SIZE)
+#define TFP_COMMON_ROW_DIGESTS_MAX 16
 
 #define TFP_COMMON_ENUMERATE_TYPE_AVAILABLE 0
 #define TFP_COMMON_ENUMERATE_TYPE_ADDED     1
@@ -60,11 +92,25 @@
 
 #define TFP_COMMON_WRITE_FIRMWARE_STATUS_OK              0
 #define TFP_COMMON_WRITE_FIRMWARE_STATUS_INVALID_POINTER 1
+#define TFP_COMMON_WRITE_FIRMWARE_STATUS_WRITE_ERROR     2
+#define TFP_COMMON_WRITE_FIRMWARE_STATUS_INVALID_DATA    3
 
 #define TFP_COMMON_NVM_MEMORY ((volatile uint16_t *)FLASH_ADDR)
 
 #define TFP_COMMON_WAIT_BEFORE_RESET 250 // in ms
 
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t features;
+	uint8_t send_window_size;
+} __attribute__((__packed__)) TFPCommonSetSPITFPConfig;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t features;
+	uint8_t send_window_size;
+} __attribute__((__packed__)) TFPCommonSetSPITFPConfigReturn;
+
 typedef struct {
 	TFPMessageHeader header;
 	uint8_t mode;
@@ -91,7 +137,7 @@ typedef struct {
 
 typedef struct {
 	TFPMessageHeader header;
-	uint8_t data[TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE];
+	uint8_t data[TFP_COMMON_WRITE_FIRMWARE_MAX_CHUNKS*TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE];
 } __attribute__((__packed__)) TFPCommonWriteFirmware;
 
 typedef struct {
@@ -99,6 +145,85 @@ typedef struct {
 	uint8_t status;
 } __attribute__((__packed__)) TFPCommonWriteFirmwareReturn;
 
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t length;
+	uint8_t data[TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE];
+} __attribute__((__packed__)) TFPCommonWriteFirmwareCompressed;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t status;
+} __attribute__((__packed__)) TFPCommonWriteFirmwareCompressedReturn;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t pointer;
+	uint8_t row_count;
+} __attribute__((__packed__)) TFPCommonGetRowDigests;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t pointer;
+	uint8_t row_count;
+} __attribute__((__packed__)) TFPCommonEraseFirmware;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t status;
+} __attribute__((__packed__)) TFPCommonEraseFirmwareReturn;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t pointer;
+	uint32_t length;
+} __attribute__((__packed__)) TFPCommonGetFirmwareCRC;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t crc;
+} __attribute__((__packed__)) TFPCommonGetFirmwareCRCReturn;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t digests[TFP_COMMON_ROW_DIGESTS_MAX];
+} __attribute__((__packed__)) TFPCommonGetRowDigestsReturn;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t probe;
+	bool clear;
+} __attribute__((__packed__)) TFPCommonGetProfileProbe;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t total;
+} __attribute__((__packed__)) TFPCommonGetProfileProbeReturn;
+
+typedef struct {
+	TFPMessageHeader header;
+} __attribute__((__packed__)) TFPCommonGetSPITFPErrorCount;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint32_t error_count_ack_checksum;
+	uint32_t error_count_message_checksum;
+	uint32_t error_count_frame;
+	uint32_t error_count_overflow;
+} __attribute__((__packed__)) TFPCommonGetSPITFPErrorCountReturn;
+
+typedef struct {
+	TFPMessageHeader header;
+} __attribute__((__packed__)) TFPCommonGetWriteFirmwareSlot;
+
+typedef struct {
+	TFPMessageHeader header;
+	uint8_t slot;
+} __attribute__((__packed__)) TFPCommonGetWriteFirmwareSlotReturn;
+
 typedef struct {
 	TFPMessageHeader header;
 	uint8_t config;
@@ -135,14 +260,20 @@ typedef struct {
 	TFPMessageHeader header;
 } __attribute__((packed)) TFPCommonCoMCUEnumerate;
 
+// Payload of GET_IDENTITY and of the enumerate callback. It only changes
+// with the firmware, so in bootloader mode it is built once in tfp_common_init.
 typedef struct {
-	TFPMessageHeader header;
 	char uid[TFP_COMMON_ENUMERATE_CALLBACK_UID_LENGTH];
 	char connected_uid[TFP_COMMON_ENUMERATE_CALLBACK_UID_LENGTH];
 	char position;
 	uint8_t version_hw[TFP_COMMON_ENUMERATE_CALLBACK_VERSION_LENGTH];
 	uint8_t version_fw[TFP_COMMON_ENUMERATE_CALLBACK_VERSION_LENGTH];
 	uint16_t device_identifier;
+} __attribute__((__packed__)) TFPCommonIdentity;
+
+typedef struct {
+	TFPMessageHeader header;
+	TFPCommonIdentity identity;
 	uint8_t enumeration_type;
 } __attribute__((__packed__)) TFPCommonEnumerateCallback;
 
@@ -156,15 +287,12 @@ typedef struct {
 
 typedef struct {
 	TFPMessageHeader header;
-	char uid[TFP_COMMON_ENUMERATE_CALLBACK_UID_LENGTH];
-	char connected_uid[TFP_COMMON_ENUMERATE_CALLBACK_UID_LENGTH];
-	char position;
-	uint8_t version_hw[TFP_COMMON_ENUMERATE_CALLBACK_VERSION_LENGTH];
-	uint8_t version_fw[TFP_COMMON_ENUMERATE_CALLBACK_VERSION_LENGTH];
-	uint16_t device_identifier;
+	TFPCommonIdentity identity;
 } __attribute__((__packed__)) TFPCommonGetIdentityReturn;
 
-#define TFP_COMMON_RETURN_MESSAGE_LENGTH 80
+// This is not available if called from outside of bootloader, in firmware
+// mode the identity is built for every request instead.
+static TFPCommonIdentity tfp_common_identity;
 
 
 // This is not available if called from outside of bootloader, make sure that
@@ -182,6 +310,25 @@ uint32_t tfp_common_get_uid(void) {
 	return (serial_number[0] | (1 << 29)) & ~(0b11 << 30);
 }
 
+BootloaderHandleMessageReturn tfp_common_set_spitfp_config(const TFPCommonSetSPITFPConfig *data, void *_return_message, BootloaderStatus *bs) {
+	TFPCommonSetSPITFPConfigReturn *sscr = _return_message;
+	sscr->header = data->header;
+	sscr->header.length = sizeof(TFPCommonSetSPITFPConfigReturn);
+
+	// Returns the features that are actually used. A master that does not know
+	// this function never calls it, so it will always see the default protocol.
+	uint8_t features = data->features;
+	if(bs->boot_mode != BOOT_MODE_BOOTLOADER) {
+		// The firmware only handles messages up to TFP_MESSAGE_MAX_LENGTH
+		features &= ~SPITFP_FEATURE_JUMBO;
+	}
+
+	sscr->send_window_size = data->send_window_size;
+	sscr->features = spitfp_set_config(&bs->st, features, &sscr->send_window_size);
+
+	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
+}
+
 BootloaderHandleMessageReturn tfp_common_set_bootloader_mode(const TFPCommonSetBootloaderMode *data, void *_return_message, BootloaderStatus *bs) {
 	TFPCommonSetBootloaderModeReturn *sbmr = _return_message;
 	sbmr->header = data->header;
@@ -196,13 +343,14 @@ BootloaderHandleMessageReturn tfp_common_set_bootloader_mode(const TFPCommonSetB
 		sbmr->status = TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK;
 
 		bs->boot_mode = BOOT_MODE_FIRMWARE_WAIT_FOR_ERASE_AND_REBOOT;
-		bs->reboot_started_at = bs->system_timer_tick;
+		bs->reboot_started_at = bootloader_get_system_timer_tick(bs);
 	} else if(data->mode == BOOT_MODE_FIRMWARE) {
 		// From Bootloader to Firmware
-		sbmr->status = boot_can_jump_to_firmware();
+		nvm_writer_flush();
+		sbmr->status = boot_can_jump_to_firmware(false);
 		if(sbmr->status == TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_OK) {
 			bs->boot_mode = BOOT_MODE_BOOTLOADER_WAIT_FOR_REBOOT;
-			bs->reboot_started_at = bs->system_timer_tick;
+			bs->reboot_started_at = bootloader_get_system_timer_tick(bs);
 		}
 	}
 
@@ -220,42 +368,301 @@ BootloaderHandleMessageReturn tfp_common_get_bootloader_mode(const TFPCommonGetB
 	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
 }
 
+#if BOOTLOADER_FIRMWARE_SLOT_COUNT > 1
+// In firmware mode the next slot after the running one is written, while the
+// firmware keeps running. In bootloader mode slot 0 is written.
+static uint8_t tfp_common_get_write_slot(BootloaderStatus *bs) {
+	if(bs->boot_mode == BOOT_MODE_FIRMWARE) {
+		return (boot_get_running_slot() + 1) % BOOTLOADER_FIRMWARE_SLOT_COUNT;
+	}
+
+	return 0;
+}
+
+BootloaderHandleMessageReturn tfp_common_get_write_firmware_slot(const TFPCommonGetWriteFirmwareSlot *data, void *_return_message, BootloaderStatus *bs) {
+	TFPCommonGetWriteFirmwareSlotReturn *gwfsr = _return_message;
+	gwfsr->header = data->header;
+	gwfsr->header.length = sizeof(TFPCommonGetWriteFirmwareSlotReturn);
+
+	// The master needs the firmware that is linked for this slot
+	gwfsr->slot = tfp_common_get_write_slot(bs);
+
+	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
+}
+
+// The nvm writer is not available in firmware mode (bootloader RAM),
+// so the page is written directly. The firmware is blocked meanwhile.
+BootloaderHandleMessageReturn tfp_common_write_firmware_slot(const TFPCommonWriteFirmware *data, void *_return_message, BootloaderStatus *bs) {
+	TFPCommonWriteFirmwareReturn *wfr = _return_message;
+	wfr->header = data->header;
+	wfr->header.length = sizeof(TFPCommonWriteFirmwareReturn);
+
+	const uint32_t pointer = bootloader_get_extension(bs)->firmware_write_pointer;
+	if((pointer > (BOOTLOADER_FIRMWARE_SIZE-TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE)) ||
+	   ((pointer % TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE) != 0)) {
+		wfr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_INVALID_POINTER;
+		return HANDLE_MESSAGE_RETURN_INVALID_PARAMETER;
+	}
+
+#ifdef BOOTLOADER_USE_FAST_BOOT
+	boot_clear_firmware_verified();
+#endif
+
+	const uint32_t address = BOOT_SLOT_START_POS(tfp_common_get_write_slot(bs)) + pointer;
+
+	tinynvm_init();
+	if((pointer % TFP_COMMON_BOOTLOADER_ROW_SIZE) == 0) {
+		tinynvm_erase_row(address);
+	}
+	tinynvm_write_page(address, data->data);
+
+	wfr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_OK;
+
+	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
+}
+#endif
+
 BootloaderHandleMessageReturn tfp_common_set_write_firmware_pointer(const TFPCommonSetWriteFirmwarePointer *data, void *_return_message, BootloaderStatus *bs) {
-	if(bs->boot_mode != BOOT_MODE_BOOTLOADER) {
-		return HANDLE_MESSAGE_RETURN_NOT_SUPPORTED;
+#if BOOTLOADER_FIRMWARE_SLOT_COUNT > 1
+	if(bs->boot_mode == BOOT_MODE_FIRMWARE) {
+		bootloader_get_extension(bs)->firmware_write_pointer = data->pointer;
+		return HANDLE_MESSAGE_RETURN_EMPTY;
 	}
+#endif
 
 	tfp_common_firmware_pointer = data->pointer;
+#ifdef BOOTLOADER_USE_COMPRESSED_FIRMWARE
+	// A compressed stream always starts at the firmware pointer
+	firmware_lz_init(data->pointer);
+#endif
 
 	return HANDLE_MESSAGE_RETURN_EMPTY;
 }
 
 BootloaderHandleMessageReturn tfp_common_write_firmware(const TFPCommonWriteFirmware *data, void *_return_message, BootloaderStatus *bs) {
-	if(bs->boot_mode != BOOT_MODE_BOOTLOADER) {
-		return HANDLE_MESSAGE_RETURN_NOT_SUPPORTED;
+#if BOOTLOADER_FIRMWARE_SLOT_COUNT > 1
+	if(bs->boot_mode == BOOT_MODE_FIRMWARE) {
+		return tfp_common_write_firmware_slot(data, _return_message, bs);
+	}
+#endif
+
+	// A normal WRITE_FIRMWARE has one chunk, with jumbo frames it can have
+	// up to TFP_COMMON_WRITE_FIRMWARE_MAX_CHUNKS
+	const uint8_t chunks = (data->header.length - sizeof(TFPMessageHeader)) / TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE;
+	if((chunks == 0) || (chunks > TFP_COMMON_WRITE_FIRMWARE_MAX_CHUNKS)) {
+		return HANDLE_MESSAGE_RETURN_INVALID_PARAMETER;
 	}
 
 	TFPCommonWriteFirmwareReturn *wfr = _return_message;
 	wfr->header = data->header;
 	wfr->header.length = sizeof(TFPCommonWriteFirmwareReturn);
 
-	if((tfp_common_firmware_pointer >= (BOOTLOADER_FIRMWARE_SIZE-TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE)) ||
+	if((tfp_common_firmware_pointer > (BOOTLOADER_FIRMWARE_SIZE-chunks*TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE)) ||
 	   ((tfp_common_firmware_pointer % TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE) != 0)) {
 		wfr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_INVALID_POINTER;
 		return HANDLE_MESSAGE_RETURN_INVALID_PARAMETER;
 	}
 
-	// If we are at the start of a row we erase the row
-	if((tfp_common_firmware_pointer % (NVMCTRL_ROW_PAGES*TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE)) == 0) {
-		tinynvm_erase_row(BOOTLOADER_FIRMWARE_START_POS + tfp_common_firmware_pointer);
+#ifdef BOOTLOADER_USE_FAST_BOOT
+	boot_clear_firmware_verified();
+#endif
+
+	// The page is written in the background (the row is erased first if we
+	// are at the start of a row and it is not bulk erased). NVM errors of
+	// previous pages are reported with the next write.
+	for(uint8_t i = 0; i < chunks; i++) {
+		nvm_writer_write_page(BOOTLOADER_FIRMWARE_START_POS + tfp_common_firmware_pointer + i*TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE,
+		                      &data->data[i*TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE]);
 	}
 
-	tinynvm_write_page(BOOTLOADER_FIRMWARE_START_POS + tfp_common_firmware_pointer, data->data);
+	if(nvm_writer_get_and_clear_error()) {
+		wfr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_WRITE_ERROR;
+	} else {
+		wfr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_OK;
+	}
 
-	wfr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_OK;
+	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
+}
+
+#ifdef BOOTLOADER_USE_COMPRESSED_FIRMWARE
+BootloaderHandleMessageReturn tfp_common_write_firmware_compressed(const TFPCommonWriteFirmwareCompressed *data, void *_return_message, BootloaderStatus *bs) {
+	if(data->length > TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE) {
+		return HANDLE_MESSAGE_RETURN_INVALID_PARAMETER;
+	}
+
+	TFPCommonWriteFirmwareCompressedReturn *wfcr = _return_message;
+	wfcr->header = data->header;
+	wfcr->header.length = sizeof(TFPCommonWriteFirmwareCompressedReturn);
+
+#ifdef BOOTLOADER_USE_FAST_BOOT
+	boot_clear_firmware_verified();
+#endif
+
+	// Every complete page is handed to the nvm writer while decompressing
+	switch(firmware_lz_write(data->data, data->length)) {
+		case FIRMWARE_LZ_STATUS_INVALID_POINTER: wfcr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_INVALID_POINTER; break;
+		case FIRMWARE_LZ_STATUS_INVALID_DATA:    wfcr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_INVALID_DATA;    break;
+		default: {
+			if(nvm_writer_get_and_clear_error()) {
+				wfcr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_WRITE_ERROR;
+			} else {
+				wfcr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_OK;
+			}
+			break;
+		}
+	}
+
+	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
+}
+#endif
+
+#ifdef BOOTLOADER_USE_DIFFERENTIAL_WRITE
+BootloaderHandleMessageReturn tfp_common_get_row_digests(const TFPCommonGetRowDigests *data, void *_return_message, BootloaderStatus *bs) {
+	if((data->row_count > TFP_COMMON_ROW_DIGESTS_MAX) ||
+	   (data->pointer > BOOTLOADER_FIRMWARE_SIZE) ||
+	   ((data->pointer % TFP_COMMON_BOOTLOADER_ROW_SIZE) != 0) ||
+	   (data->row_count*TFP_COMMON_BOOTLOADER_ROW_SIZE > BOOTLOADER_FIRMWARE_SIZE - data->pointer)) {
+		return HANDLE_MESSAGE_RETURN_INVALID_PARAMETER;
+	}
+
+	TFPCommonGetRowDigestsReturn *grdr = _return_message;
+	grdr->header = data->header;
+	grdr->header.length = sizeof(TFPCommonGetRowDigestsReturn);
+
+	// Digests have to include the pages that are not yet written
+	nvm_writer_flush();
+
+	// Same CRC32 as the firmware CRC, one per row. The master only has to
+	// send the rows with a different digest.
+	for(uint8_t i = 0; i < TFP_COMMON_ROW_DIGESTS_MAX; i++) {
+		if(i < data->row_count) {
+			grdr->digests[i] = boot_calculate_crc(BOOTLOADER_FIRMWARE_START_POS + data->pointer + i*TFP_COMMON_BOOTLOADER_ROW_SIZE, TFP_COMMON_BOOTLOADER_ROW_SIZE);
+		} else {
+			grdr->digests[i] = 0;
+		}
+	}
 
 	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
 }
+#endif
+
+#ifdef BOOTLOADER_USE_BULK_ERASE
+// Erases row_count rows from pointer on (0 = up to the end of the firmware)
+// in the background. Afterwards the master only has to write the pages that
+// are not completely erased (0xFF), in any order.
+BootloaderHandleMessageReturn tfp_common_erase_firmware(const TFPCommonEraseFirmware *data, void *_return_message, BootloaderStatus *bs) {
+	TFPCommonEraseFirmwareReturn *efr = _return_message;
+	efr->header = data->header;
+	efr->header.length = sizeof(TFPCommonEraseFirmwareReturn);
+
+	uint16_t row_count = data->row_count;
+	if((data->pointer < BOOTLOADER_FIRMWARE_SIZE) && (row_count == 0)) {
+		row_count = (BOOTLOADER_FIRMWARE_SIZE - data->pointer) / TFP_COMMON_BOOTLOADER_ROW_SIZE;
+	}
+
+	if((data->pointer >= BOOTLOADER_FIRMWARE_SIZE) ||
+	   ((data->pointer % TFP_COMMON_BOOTLOADER_ROW_SIZE) != 0) ||
+	   (row_count*TFP_COMMON_BOOTLOADER_ROW_SIZE > BOOTLOADER_FIRMWARE_SIZE - data->pointer)) {
+		efr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_INVALID_POINTER;
+		return HANDLE_MESSAGE_RETURN_INVALID_PARAMETER;
+	}
+
+#ifdef BOOTLOADER_USE_FAST_BOOT
+	boot_clear_firmware_verified();
+#endif
+
+	nvm_writer_erase_rows(BOOTLOADER_FIRMWARE_START_POS + data->pointer, row_count);
+
+	// Reports NVM errors of pages written before the erase
+	if(nvm_writer_get_and_clear_error()) {
+		efr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_WRITE_ERROR;
+	} else {
+		efr->status = TFP_COMMON_WRITE_FIRMWARE_STATUS_OK;
+	}
+
+	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
+}
+#endif
+
+#ifdef BOOTLOADER_USE_RANGE_CRC
+// CRC32 (DSU, same as the firmware CRC) of length bytes from pointer on in
+// the firmware that is written: In bootloader mode the pages that are not
+// yet written are included. In firmware mode it is the slot that
+// WRITE_FIRMWARE writes to (the running firmware with only one slot).
+// The master can verify the whole image or single rows without a reboot.
+BootloaderHandleMessageReturn tfp_common_get_firmware_crc(const TFPCommonGetFirmwareCRC *data, void *_return_message, BootloaderStatus *bs) {
+	// The DSU only works on whole words
+	if((data->length == 0) ||
+	   (data->pointer > BOOTLOADER_FIRMWARE_SIZE) ||
+	   (data->length > BOOTLOADER_FIRMWARE_SIZE - data->pointer) ||
+	   ((data->pointer % 4) != 0) ||
+	   ((data->length % 4) != 0)) {
+		return HANDLE_MESSAGE_RETURN_INVALID_PARAMETER;
+	}
+
+	TFPCommonGetFirmwareCRCReturn *gfcr = _return_message;
+	gfcr->header = data->header;
+	gfcr->header.length = sizeof(TFPCommonGetFirmwareCRCReturn);
+
+#if BOOTLOADER_FIRMWARE_SLOT_COUNT > 1
+	const uint32_t start = BOOT_SLOT_START_POS(tfp_common_get_write_slot(bs));
+#else
+	const uint32_t start = BOOTLOADER_FIRMWARE_START_POS;
+#endif
+
+	if(bs->boot_mode == BOOT_MODE_BOOTLOADER) {
+		nvm_writer_flush();
+	}
+
+	gfcr->crc = boot_calculate_crc(start + data->pointer, data->length);
+
+	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
+}
+#endif
+
+#ifdef SPITFP_USE_STATISTICS
+// Same call and layout as get_spitfp_error_count of the Bricklet API, so the
+// error counts can also be read while the Bricklet is in bootloader mode.
+// In firmware mode the call belongs to the firmware and is forwarded.
+BootloaderHandleMessageReturn tfp_common_get_spitfp_error_count(const TFPCommonGetSPITFPErrorCount *data, void *_return_message, BootloaderStatus *bs) {
+	TFPCommonGetSPITFPErrorCountReturn *gsecr = _return_message;
+	gsecr->header = data->header;
+	gsecr->header.length = sizeof(TFPCommonGetSPITFPErrorCountReturn);
+
+	const SPITFPExtension *ext = spitfp_get_extension(&bs->st);
+	gsecr->error_count_ack_checksum     = ext->error_count_ack_checksum;
+	gsecr->error_count_message_checksum = ext->error_count_message_checksum;
+	gsecr->error_count_frame            = ext->error_count_frame;
+	gsecr->error_count_overflow         = ext->error_count_overflow;
+
+	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
+}
+#endif
+
+#ifdef BOOTLOADER_USE_PROFILING
+// Cycle counts of a probe (see profile.c), optionally cleared after reading
+BootloaderHandleMessageReturn tfp_common_get_profile_probe(const TFPCommonGetProfileProbe *data, void *_return_message, BootloaderStatus *bs) {
+	if(data->probe >= PROFILE_PROBE_COUNT) {
+		return HANDLE_MESSAGE_RETURN_INVALID_PARAMETER;
+	}
+
+	TFPCommonGetProfileProbeReturn *gppr = _return_message;
+	gppr->header = data->header;
+	gppr->header.length = sizeof(TFPCommonGetProfileProbeReturn);
+
+	const ProfileProbe *probe = profile_get(data->probe);
+	gppr->count = probe->count;
+	gppr->min   = probe->min;
+	gppr->max   = probe->max;
+	gppr->total = probe->total;
+
+	if(data->clear) {
+		profile_clear(data->probe);
+	}
+
+	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
+}
+#endif
 
 BootloaderHandleMessageReturn tfp_common_set_status_led_config(const TFPCommonSetStatusLEDConfig *data, void *_return_message, BootloaderStatus *bs) {
 	if(data->config >= TFP_COMMON_STATUS_LED_SHOW_COMMUNICATION_STATUS) {
@@ -287,7 +694,7 @@ BootloaderHandleMessageReturn tfp_common_get_status_led_config(const TFPCommonGe
 }
 
 #if 0
-BootloaderHandleMessageReturn tfp_common_get_chip_temperature(const TFPCommonGetChipTemperature *data, void *_return_message) {
+BootloaderHandleMessageReturn tfp_common_get_chip_temperature(const TFPCommonGetChipTemperature *data, void *_return_message, BootloaderStatus *bs) {
 	TFPCommonGetChipTemperatureReturn *gctr = _return_message;
 	gctr->header = data->header;
 	gctr->header.length = sizeof(TFPCommonGetChipTemperatureReturn);
@@ -301,10 +708,10 @@ BootloaderHandleMessageReturn tfp_common_get_chip_temperature(const TFPCommonGet
 BootloaderHandleMessageReturn tfp_common_reset(const TFPCommonReset *data, void *_return_message, BootloaderStatus *bs) {
 	if(bs->boot_mode == BOOT_MODE_BOOTLOADER) {
 		bs->boot_mode = BOOT_MODE_BOOTLOADER_WAIT_FOR_REBOOT;
-		bs->reboot_started_at = bs->system_timer_tick;
+		bs->reboot_started_at = bootloader_get_system_timer_tick(bs);
 	} else if(bs->boot_mode == BOOT_MODE_FIRMWARE) {
 		bs->boot_mode = BOOT_MODE_FIRMWARE_WAIT_FOR_REBOOT;
-		bs->reboot_started_at = bs->system_timer_tick;
+		bs->reboot_started_at = bootloader_get_system_timer_tick(bs);
 	}
 
 	// We can ignore all other cases, in the other cases we will be rebooting shortly anyway
@@ -312,33 +719,50 @@ BootloaderHandleMessageReturn tfp_common_reset(const TFPCommonReset *data, void
 	return HANDLE_MESSAGE_RETURN_EMPTY;
 }
 
-BootloaderHandleMessageReturn tfp_common_get_identity(const TFPCommonGetIdentity *data, void *_return_message) {
+// Only the firmware version can change in bootloader mode (while a new
+// firmware is written), in firmware mode everything is constant
+static void tfp_common_get_firmware_version(uint8_t *version_fw) {
+	const uint32_t firmware_version = BOOT_SLOT_CONFIGURATION_POINTER(boot_get_running_slot())->firmware_version;
+	version_fw[0] = (firmware_version >> 16) & 0xFF;
+	version_fw[1] = (firmware_version >> 8)  & 0xFF;
+	version_fw[2] = (firmware_version >> 0)  & 0xFF;
+}
+
+static void tfp_common_build_identity(TFPCommonIdentity *identity) {
+	tfp_uid_uint32_to_base58(tfp_common_get_uid(), identity->uid);
+	memset(identity->connected_uid, 0, TFP_COMMON_ENUMERATE_CALLBACK_UID_LENGTH);
+	identity->position = 0;
+
+	identity->version_hw[0] = BOOTLOADER_HW_VERSION_MAJOR;
+	identity->version_hw[1] = BOOTLOADER_HW_VERSION_MINOR;
+	identity->version_hw[2] = BOOTLOADER_HW_VERSION_REVISION;
+
+	tfp_common_get_firmware_version(identity->version_fw);
+
+	identity->device_identifier = BOOTLOADER_DEVICE_IDENTIFIER;
+}
+
+BootloaderHandleMessageReturn tfp_common_get_identity(const TFPCommonGetIdentity *data, void *_return_message, BootloaderStatus *bs) {
 	TFPCommonGetIdentityReturn *gir = _return_message;
 	gir->header        = data->header;
 	gir->header.uid    = tfp_common_get_uid();
 	gir->header.length = sizeof(TFPCommonGetIdentityReturn);
 
-	tfp_uid_uint32_to_base58(tfp_common_get_uid(), gir->uid);
-	memset(gir->connected_uid, 0, TFP_COMMON_ENUMERATE_CALLBACK_UID_LENGTH);
-
-	gir->version_hw[0] = BOOTLOADER_HW_VERSION_MAJOR;
-	gir->version_hw[1] = BOOTLOADER_HW_VERSION_MINOR;
-	gir->version_hw[2] = BOOTLOADER_HW_VERSION_REVISION;
-
-	gir->version_fw[0] = (BOOTLOADER_FIRMWARE_CONFIGURATION_POINTER->firmware_version >> 16) & 0xFF;
-	gir->version_fw[1] = (BOOTLOADER_FIRMWARE_CONFIGURATION_POINTER->firmware_version >> 8)  & 0xFF;
-	gir->version_fw[2] = (BOOTLOADER_FIRMWARE_CONFIGURATION_POINTER->firmware_version >> 0)  & 0xFF;
-
-	gir->device_identifier = BOOTLOADER_DEVICE_IDENTIFIER;
+	if(bs->boot_mode == BOOT_MODE_FIRMWARE) {
+		tfp_common_build_identity(&gir->identity);
+	} else {
+		memcpy(&gir->identity, &tfp_common_identity, sizeof(TFPCommonIdentity));
+		tfp_common_get_firmware_version(gir->identity.version_fw);
+	}
 
 	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
 }
 
-BootloaderHandleMessageReturn tfp_common_enumerate(const TFPCommonEnumerate *data, void *_return_message) {
+BootloaderHandleMessageReturn tfp_common_enumerate(const TFPCommonEnumerate *data, void *_return_message, BootloaderStatus *bs) {
 	// The function itself does not return anything, but we return the callback here instead.
 	// We use get_identity for uids, fw version and hw version.
 	// The layout of the struct it the same.
-	tfp_common_get_identity((void*)data, _return_message);
+	tfp_common_get_identity((const TFPCommonGetIdentity*)data, _return_message, bs);
 
 	TFPCommonEnumerateCallback *ec = _return_message;
 	ec->header.length           = sizeof(TFPCommonEnumerateCallback);
@@ -355,11 +779,11 @@ BootloaderHandleMessageReturn tfp_common_enumerate(const TFPCommonEnumerate *dat
 	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
 }
 
-BootloaderHandleMessageReturn tfp_common_co_mcu_enumerate(const TFPCommonCoMCUEnumerate *data, void *_return_message) {
+BootloaderHandleMessageReturn tfp_common_co_mcu_enumerate(const TFPCommonCoMCUEnumerate *data, void *_return_message, BootloaderStatus *bs) {
 	// This is the same as enumerate, but with TFP_COMMON_ENUMERATE_TYPE_ADDED (initial enumerate)
 	// This gets triggered by the Brick
-	tfp_common_enumerate((void*)data, _return_message);
-	((TFPCommonEnumerateCallback*)data)->enumeration_type = TFP_COMMON_ENUMERATE_TYPE_ADDED;
+	tfp_common_enumerate((const TFPCommonEnumerate*)data, _return_message, bs);
+	((TFPCommonEnumerateCallback*)_return_message)->enumeration_type = TFP_COMMON_ENUMERATE_TYPE_ADDED;
 
 	return HANDLE_MESSAGE_RETURN_NEW_MESSAGE;
 }
@@ -371,83 +795,180 @@ void tfp_common_handle_reset(BootloaderStatus *bs) {
 			return;
 		}
 
-		case BOOT_MODE_BOOTLOADER_WAIT_FOR_REBOOT:
+		case BOOT_MODE_BOOTLOADER_WAIT_FOR_REBOOT: {
+			if((bootloader_get_system_timer_tick(bs) - bs->reboot_started_at) >= TFP_COMMON_WAIT_BEFORE_RESET) {
+				// Don't reset while a page is still being written
+				nvm_writer_flush();
+				NVIC_SystemReset();
+			}
+			return;
+		}
+
 		case BOOT_MODE_FIRMWARE_WAIT_FOR_REBOOT: {
-			if((bs->system_timer_tick - bs->reboot_started_at) >= TFP_COMMON_WAIT_BEFORE_RESET) {
+			if((bootloader_get_system_timer_tick(bs) - bs->reboot_started_at) >= TFP_COMMON_WAIT_BEFORE_RESET) {
 				NVIC_SystemReset();
 			}
 			return;
 		}
 
 		case BOOT_MODE_FIRMWARE_WAIT_FOR_ERASE_AND_REBOOT: {
-			if((bs->system_timer_tick - bs->reboot_started_at) >= TFP_COMMON_WAIT_BEFORE_RESET) {
+			if((bootloader_get_system_timer_tick(bs) - bs->reboot_started_at) >= TFP_COMMON_WAIT_BEFORE_RESET) {
 				// Turn all interrupts off here! The firmware code should not be
 				// able to do anything as soon as we are at this point. Otherwise we might
 				// have a race condition between the memory erase and the reset.
 				cpu_irq_disable();
 				tinynvm_init();
-				tinynvm_erase_row(BOOTLOADER_FIRMWARE_START_POS);
+				// All slots, otherwise we would boot into another slot
+				for(uint8_t slot = 0; slot < BOOTLOADER_FIRMWARE_SLOT_COUNT; slot++) {
+					tinynvm_erase_row(BOOT_SLOT_START_POS(slot));
+				}
 				NVIC_SystemReset();
 			}
 		}
 	}
 }
 
-void tfp_common_handle_message(const void *message, const uint8_t length, BootloaderStatus *bs) {
-	// Do we need to check for UID here? Or do we define that the Brick already checks this?
-#if 0
-	const uint32_t message_uid = tfp_get_fid_from_message(message);
-	if((message_uid != tfp_common_get_uid()) && (message_uid != 0)) {
-		spitfp_send_ack(&bs->st);
-		return;
-	}
-#endif
+// Boot modes (BootloaderStatus.boot_mode) in which a function is handled,
+// see tfp_common_dispatch for the other modes
+#define TFP_COMMON_MODES_BOOTLOADER (1 << BOOT_MODE_BOOTLOADER)
+#define TFP_COMMON_MODES_ALL        0xFF
 
-	// TODO: Wait for ~1 second after startup for CoMCUEnumerate message. If there is none,
-	//       send an "answer" to it anyway
+// With several slots the next firmware is written while the firmware runs
+#if BOOTLOADER_FIRMWARE_SLOT_COUNT > 1
+#define TFP_COMMON_MODES_WRITE      ((1 << BOOT_MODE_BOOTLOADER) | (1 << BOOT_MODE_FIRMWARE))
+#else
+#define TFP_COMMON_MODES_WRITE      TFP_COMMON_MODES_BOOTLOADER
+#endif
 
-#if 0
-	const uint8_t message_length = tfp_get_length_from_message(message);
-	if(length != message_length) {
-		// TODO: What do we do here? Send ACK or ignore message?
-		//       Should we just not check at all?
-		return;
-	}
+// With jumbo frames WRITE_FIRMWARE has a variable number of chunks
+#ifdef SPITFP_USE_JUMBO_FRAMES
+#define TFP_COMMON_WRITE_FIRMWARE_VARIABLE_LENGTH true
+#else
+#define TFP_COMMON_WRITE_FIRMWARE_VARIABLE_LENGTH false
 #endif
 
-	uint8_t return_message[TFP_COMMON_RETURN_MESSAGE_LENGTH];
-	BootloaderHandleMessageReturn handle_message_return = HANDLE_MESSAGE_RETURN_EMPTY;
+typedef BootloaderHandleMessageReturn (*TFPCommonHandler)(const void *data, void *_return_message, BootloaderStatus *bs);
 
-	switch(tfp_get_fid_from_message(message)) {
-		case TFP_COMMON_FID_SET_BOOTLOADER_MODE:        handle_message_return = tfp_common_set_bootloader_mode(message, return_message, bs);        break;
-		case TFP_COMMON_FID_GET_BOOTLOADER_MODE:        handle_message_return = tfp_common_get_bootloader_mode(message, return_message, bs);        break;
-		case TFP_COMMON_FID_SET_WRITE_FIRMWARE_POINTER: handle_message_return = tfp_common_set_write_firmware_pointer(message, return_message, bs); break;
-		case TFP_COMMON_FID_WRITE_FIRMWARE:             handle_message_return = tfp_common_write_firmware(message, return_message, bs);             break;
-		case TFP_COMMON_FID_SET_STATUS_LED_CONFIG:      handle_message_return = tfp_common_set_status_led_config(message, return_message, bs);      break;
-		case TFP_COMMON_FID_GET_STATUS_LED_CONFIG:      handle_message_return = tfp_common_get_status_led_config(message, return_message, bs);      break;
+typedef struct {
+	TFPCommonHandler handler;
+	uint8_t length;       // Request length, minimum length if variable_length
+	uint8_t modes;        // TFP_COMMON_MODES_*
+	bool variable_length;
+} TFPCommonFunction;
+
+#define TFP_COMMON_FUNCTION(fid, handler, request, modes) \
+	[(fid) - TFP_COMMON_FID_FIRST] = {(TFPCommonHandler)(handler), sizeof(request), (modes), false}
+
+// Indexed by FID - TFP_COMMON_FID_FIRST
+static const TFPCommonFunction tfp_common_functions[TFP_COMMON_FID_LAST - TFP_COMMON_FID_FIRST + 1] = {
+#ifdef BOOTLOADER_USE_RANGE_CRC
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_GET_FIRMWARE_CRC,           tfp_common_get_firmware_crc,           TFPCommonGetFirmwareCRC,           TFP_COMMON_MODES_ALL),
+#endif
+#ifdef BOOTLOADER_USE_BULK_ERASE
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_ERASE_FIRMWARE,             tfp_common_erase_firmware,             TFPCommonEraseFirmware,            TFP_COMMON_MODES_BOOTLOADER),
+#endif
+#ifdef BOOTLOADER_USE_PROFILING
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_GET_PROFILE_PROBE,          tfp_common_get_profile_probe,          TFPCommonGetProfileProbe,          TFP_COMMON_MODES_BOOTLOADER),
+#endif
+#if BOOTLOADER_FIRMWARE_SLOT_COUNT > 1
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_GET_WRITE_FIRMWARE_SLOT,    tfp_common_get_write_firmware_slot,    TFPCommonGetWriteFirmwareSlot,     TFP_COMMON_MODES_ALL),
+#endif
+#ifdef BOOTLOADER_USE_DIFFERENTIAL_WRITE
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_GET_ROW_DIGESTS,            tfp_common_get_row_digests,            TFPCommonGetRowDigests,            TFP_COMMON_MODES_BOOTLOADER),
+#endif
+#ifdef BOOTLOADER_USE_COMPRESSED_FIRMWARE
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_WRITE_FIRMWARE_COMPRESSED,  tfp_common_write_firmware_compressed,  TFPCommonWriteFirmwareCompressed,  TFP_COMMON_MODES_BOOTLOADER),
+#endif
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_SET_SPITFP_CONFIG,          tfp_common_set_spitfp_config,          TFPCommonSetSPITFPConfig,          TFP_COMMON_MODES_ALL),
+#ifdef SPITFP_USE_STATISTICS
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_GET_SPITFP_ERROR_COUNT,     tfp_common_get_spitfp_error_count,     TFPCommonGetSPITFPErrorCount,      TFP_COMMON_MODES_BOOTLOADER),
+#endif
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_SET_BOOTLOADER_MODE,        tfp_common_set_bootloader_mode,        TFPCommonSetBootloaderMode,        TFP_COMMON_MODES_ALL),
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_GET_BOOTLOADER_MODE,        tfp_common_get_bootloader_mode,        TFPCommonGetBootloaderMode,        TFP_COMMON_MODES_ALL),
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_SET_WRITE_FIRMWARE_POINTER, tfp_common_set_write_firmware_pointer, TFPCommonSetWriteFirmwarePointer,  TFP_COMMON_MODES_WRITE),
+	[TFP_COMMON_FID_WRITE_FIRMWARE - TFP_COMMON_FID_FIRST] = {
+		(TFPCommonHandler)tfp_common_write_firmware,
+		sizeof(TFPMessageHeader) + TFP_COMMON_BOOTLOADER_WRITE_CHUNK_SIZE,
+		TFP_COMMON_MODES_WRITE,
+		TFP_COMMON_WRITE_FIRMWARE_VARIABLE_LENGTH
+	},
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_SET_STATUS_LED_CONFIG,      tfp_common_set_status_led_config,      TFPCommonSetStatusLEDConfig,       TFP_COMMON_MODES_ALL),
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_GET_STATUS_LED_CONFIG,      tfp_common_get_status_led_config,      TFPCommonGetStatusLEDConfig,       TFP_COMMON_MODES_ALL),
 #if 0
-		case TFP_COMMON_FID_GET_CHIP_TEMPERATURE:       handle_message_return = tfp_common_get_chip_temperature(message, return_message);           break;
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_GET_CHIP_TEMPERATURE,       tfp_common_get_chip_temperature,       TFPCommonGetChipTemperature,       TFP_COMMON_MODES_ALL),
 #endif
-		case TFP_COMMON_FID_RESET:                      handle_message_return = tfp_common_reset(message, return_message, bs);                      break;
-		case TFP_COMMON_FID_CO_MCU_ENUMERATE:           handle_message_return = tfp_common_co_mcu_enumerate(message, return_message);               break;
-		case TFP_COMMON_FID_ENUMERATE:                  handle_message_return = tfp_common_enumerate(message, return_message);                      break;
-		case TFP_COMMON_FID_GET_IDENTITY:               handle_message_return = tfp_common_get_identity(message, return_message);                   break;
-		default: {
-			if(bs->boot_mode == BOOT_MODE_FIRMWARE) {
-				handle_message_return = bs->firmware_handle_message_func(message, return_message);
-			} else {
-				handle_message_return = HANDLE_MESSAGE_RETURN_NOT_SUPPORTED;
-			}
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_RESET,                      tfp_common_reset,                      TFPCommonReset,                    TFP_COMMON_MODES_ALL),
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_CO_MCU_ENUMERATE,           tfp_common_co_mcu_enumerate,           TFPCommonCoMCUEnumerate,           TFP_COMMON_MODES_ALL),
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_ENUMERATE,                  tfp_common_enumerate,                  TFPCommonEnumerate,                TFP_COMMON_MODES_ALL),
+	TFP_COMMON_FUNCTION(TFP_COMMON_FID_GET_IDENTITY,               tfp_common_get_identity,               TFPCommonGetIdentity,              TFP_COMMON_MODES_ALL),
+};
+
+// Only called in bootloader mode, the cache is in bootloader RAM
+void tfp_common_init(void) {
+	tfp_common_build_identity(&tfp_common_identity);
+}
 
-			break;
+// Without the extension only the functions that the bootloader always had
+// in firmware mode are available (TFP_COMMON_FID_LEGACY_FIRST and up, in all
+// boot modes), everything else goes to the firmware as before.
+static const TFPCommonFunction *tfp_common_get_function(const uint8_t fid, const bool extension, const uint8_t boot_mode) {
+	if(fid < (extension ? TFP_COMMON_FID_FIRST : TFP_COMMON_FID_LEGACY_FIRST)) {
+		return NULL;
+	}
+
+	const TFPCommonFunction *function = &tfp_common_functions[fid - TFP_COMMON_FID_FIRST];
+	if((function->handler == NULL) ||
+	   (!extension && (function->modes != TFP_COMMON_MODES_ALL)) ||
+	   ((function->modes & (1 << boot_mode)) == 0)) {
+		return NULL;
+	}
+
+	return function;
+}
+
+// One table lookup instead of a compare chain. In firmware mode FIDs that
+// have no handler or are not available in firmware mode go to the firmware,
+// in bootloader mode they return NOT_SUPPORTED. Requests with a length that
+// does not match the function return INVALID_PARAMETER.
+static BootloaderHandleMessageReturn tfp_common_dispatch(const void *message, const uint8_t length, void *return_message, const bool extension, BootloaderStatus *bs) {
+	const TFPCommonFunction *function = tfp_common_get_function(tfp_get_fid_from_message(message), extension, bs->boot_mode);
+	if(function == NULL) {
+		if(bs->boot_mode == BOOT_MODE_FIRMWARE) {
+			return bs->firmware_handle_message_func(message, return_message);
 		}
+
+		return HANDLE_MESSAGE_RETURN_NOT_SUPPORTED;
+	}
+
+	if(function->variable_length ? (length < function->length) : (length != function->length)) {
+		return HANDLE_MESSAGE_RETURN_INVALID_PARAMETER;
+	}
+
+	return function->handler(message, return_message, bs);
+}
+
+// Builds the response to the message in return_message. Returns false if
+// there is no response, the caller has to send an ACK instead. extension
+// is false for firmwares without BootloaderExtension.
+bool tfp_common_handle_message(const void *message, const uint8_t length, void *return_message, const bool extension, BootloaderStatus *bs) {
+	// Do we need to check for UID here? Or do we define that the Brick already checks this?
+#if 0
+	const uint32_t message_uid = tfp_get_fid_from_message(message);
+	if((message_uid != tfp_common_get_uid()) && (message_uid != 0)) {
+		return false;
 	}
+#endif
+
+	// TODO: Wait for ~1 second after startup for CoMCUEnumerate message. If there is none,
+	//       send an "answer" to it anyway
+
+	BootloaderHandleMessageReturn handle_message_return = tfp_common_dispatch(message, length, return_message, extension, bs);
 
 	bool has_message = true;
 	if(handle_message_return != HANDLE_MESSAGE_RETURN_NEW_MESSAGE) {
 		has_message = tfp_is_return_expected(message);
 		if(has_message) {
-			TFPMessageHeader *in_header = (TFPMessageHeader*)message;
+			const TFPMessageHeader *in_header = (const TFPMessageHeader*)message;
 			TFPMessageHeader *ret_header = (TFPMessageHeader*)return_message;
 
 			// Copy header from incoming message to outgoing message
@@ -464,9 +985,5 @@ void tfp_common_handle_message(const void *message, const uint8_t length, Bootlo
 		}
 	}
 
-	if(has_message) {
-		spitfp_send_ack_and_message(&bs->st, return_message, tfp_get_length_from_message(return_message));
-	} else {
-		spitfp_send_ack(&bs->st);
-	}
+	return has_message;
 }
@@ -31,10 +31,26 @@
 #define TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_DEVICE_IDENTIFIER_INCORRECT 4
 #define TFP_COMMON_SET_BOOTLOADER_MODE_STATUS_CRC_MISMATCH                5
 
+// The bootloader handles the common Bricklet FIDs it had from the start
+// (235-255) and the FIDs it added later (TFP_COMMON_FID_RESERVED_FIRST to
+// TFP_COMMON_FID_RESERVED_LAST). The added ones are used by no Bricklet or
+// Brick API: They are below the common functions of Bricks (231 and up) and
+// Bricklets (234 and up) and far above the device specific functions.
+// With SPITFP_USE_STATISTICS the bootloader also answers the Bricklet API
+// call 234 GET_SPITFP_ERROR_COUNT, but only in bootloader mode.
+// In firmware mode the bootloader forwards every FID it does not handle in
+// firmware mode to BootloaderStatus.firmware_handle_message_func. This
+// includes the firmware API in the common range (234 GET_SPITFP_ERROR_COUNT,
+// 248 WRITE_UID, 249 READ_UID, ...) and ERASE_FIRMWARE. A firmware without
+// BootloaderExtension (see firmware_entry.h) gets all FIDs below 235.
+#define TFP_COMMON_FID_RESERVED_FIRST 220
+#define TFP_COMMON_FID_RESERVED_LAST  226
+
 #include "bootloader_spitfp.h"
 #include "bricklib2/protocols/tfp/tfp.h"
 
-void tfp_common_handle_message(const void *message, const uint8_t length, BootloaderStatus *bs);
+void tfp_common_init(void);
+bool tfp_common_handle_message(const void *message, const uint8_t length, void *return_message, const bool extension, BootloaderStatus *bs);
 void tfp_common_handle_reset(BootloaderStatus *bs);
 
 #endif